@@ -0,0 +1,108 @@
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <new>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+/*
+ * A bump allocator. Memory is handed out from large blocks by advancing an offset, so creating
+ * many small objects costs a few large allocations instead of one allocation each, and the
+ * objects end up next to each other in memory. Individual objects cannot be freed; clear()
+ * destroys everything at once
+ */
+class Arena
+{
+public:
+    explicit Arena(std::size_t blockSize = 1 << 20) :
+        m_blockSize(blockSize),
+        m_offset(0)
+    {}
+
+    ~Arena()
+    {
+        clear();
+    }
+
+    Arena(const Arena&) = delete;
+    Arena& operator=(const Arena&) = delete;
+
+    // Returns uninitialized memory of the given size and alignment
+    void* allocate(std::size_t size, std::size_t alignment)
+    {
+        if (!m_blocks.empty())
+        {
+            // Round the offset up to the alignment within the current block
+            auto address = reinterpret_cast<std::uintptr_t>(m_blocks.back().data.get()) + m_offset;
+            std::size_t padding = (alignment - address % alignment) % alignment;
+
+            if (m_offset + padding + size <= m_blocks.back().size)
+            {
+                void* result = m_blocks.back().data.get() + m_offset + padding;
+                m_offset += padding + size;
+                return result;
+            }
+        }
+
+        // Start a new block, large enough for this allocation even if it is bigger than the usual
+        // block size
+        std::size_t blockSize = std::max(m_blockSize, size + alignment);
+        m_blocks.push_back({ std::make_unique<unsigned char[]>(blockSize), blockSize });
+        m_offset = 0;
+
+        return allocate(size, alignment);
+    }
+
+    // Constructs an object in the arena. Its destructor is run by clear()
+    template <typename T, typename... Args>
+    T* create(Args&&... args)
+    {
+        T* object = new (allocate(sizeof(T), alignof(T))) T(std::forward<Args>(args)...);
+
+        if constexpr (!std::is_trivially_destructible_v<T>)
+            m_destructors.push_back({ object, [] (void* object) { static_cast<T*>(object)->~T(); } });
+
+        return object;
+    }
+
+    // Destroys every object in the arena, in the reverse of the order they were created, and
+    // releases its memory
+    void clear()
+    {
+        for (auto it = m_destructors.rbegin(); it != m_destructors.rend(); ++it) it->destroy(it->object);
+
+        m_destructors.clear();
+        m_blocks.clear();
+        m_offset = 0;
+    }
+
+    // Returns the total size of the blocks allocated by the arena, in bytes
+    std::size_t getMemoryFootprint() const
+    {
+        std::size_t total = 0;
+        for (const auto& block : m_blocks) total += block.size;
+        return total;
+    }
+
+private:
+    struct Block
+    {
+        std::unique_ptr<unsigned char[]> data;
+        std::size_t size;
+    };
+
+    struct Destructor
+    {
+        void* object;
+        void (*destroy)(void*);
+    };
+
+    std::size_t m_blockSize;               // Size of each block of memory
+    std::size_t m_offset;                  // Offset of the first free byte in the last block
+    std::vector<Block> m_blocks;           // Blocks of memory that objects are allocated from
+    std::vector<Destructor> m_destructors; // Destructors of the objects that need them
+};
@@ -31,48 +31,266 @@ inline glm::vec3 uniformHemisphereSample(glm::vec2 hash, glm::vec3 axis)
     return glm::dot(dir, axis) < 0.0f ? -dir : dir;
 }
 
+// The parts of the BSDF that importanceSampleBsdf chooses between
+enum class BsdfLobe
+{
+    Diffuse,      // Lambertian reflection
+    Specular,     // GGX microfacet reflection
+    Transmission, // GGX microfacet refraction, for transparent materials
+};
+
+// Weight of a sample taken with probability density `pdf` when it could also have been taken by a
+// second strategy with density `otherPdf`. Multiple importance sampling with the power heuristic
+// (Veach 1997)
+inline float powerHeuristic(float pdf, float otherPdf)
+{
+    float pdf2 = pdf * pdf, otherPdf2 = otherPdf * otherPdf;
+    return pdf2 + otherPdf2 > 0.0f ? pdf2 / (pdf2 + otherPdf2) : 0.0f;
+}
+
+// Smallest GGX alpha used, so that perfectly smooth materials do not produce infinite densities
+constexpr float minGgxAlpha = 1e-3f;
+
+// Returns the GGX alpha parameter for a material, using the common roughness^2 mapping so that
+// roughness is perceptually linear
+inline float getGgxAlpha(const Material& material)
+{
+    return glm::max(material.roughness * material.roughness, minGgxAlpha);
+}
+
+// GGX (Trowbridge-Reitz) normal distribution function, for a microfacet normal at angle acos(cosTheta) to the surface normal
+inline float ggxDistribution(float cosTheta, float alpha)
+{
+    float alpha2 = alpha * alpha;
+    float d = cosTheta * cosTheta * (alpha2 - 1.0f) + 1.0f;
+    return alpha2 / (pi * d * d);
+}
+
+// Smith's Lambda function for GGX, for a direction at angle acos(cosTheta) to the surface normal
+inline float ggxLambda(float cosTheta, float alpha)
+{
+    float cos2 = cosTheta * cosTheta;
+    return 0.5f * (glm::sqrt(alpha * alpha * (1.0f - cos2) + cos2) / cosTheta - 1.0f);
+}
+
+// Fraction of microfacets facing a direction that are not masked by other microfacets
+inline float ggxMasking(float cosTheta, float alpha)
+{
+    return 1.0f / (1.0f + ggxLambda(cosTheta, alpha));
+}
+
+// Fraction of microfacets that are neither masked from one direction nor shadowed from the other,
+// using the height-correlated form of Smith's masking-shadowing function
+inline float ggxMaskingShadowing(float cosO, float cosI, float alpha)
+{
+    return 1.0f / (1.0f + ggxLambda(cosO, alpha) + ggxLambda(cosI, alpha));
+}
+
+// Returns the fraction of light reflected by a smooth dielectric boundary, where cosTheta is the
+// cosine of the incident angle and eta is the ratio of the refractive indices on the incident and
+// transmitted sides. Returns 1 for total internal reflection
+inline float fresnelDielectric(float cosTheta, float eta)
+{
+    float sin2Transmitted = eta * eta * (1.0f - cosTheta * cosTheta);
+    if (sin2Transmitted >= 1.0f) return 1.0f;
+
+    float cosTransmitted = glm::sqrt(1.0f - sin2Transmitted);
+    float rs = (eta * cosTheta - cosTransmitted) / (eta * cosTheta + cosTransmitted);
+    float rp = (cosTheta - eta * cosTransmitted) / (cosTheta + eta * cosTransmitted);
+
+    return 0.5f * (rs * rs + rp * rp);
+}
+
+// Builds two tangents which form an orthonormal basis with the unit vector n
+// Source: Duff et al. 2017, "Building an Orthonormal Basis, Revisited"
+inline void makeBasis(const glm::vec3& n, glm::vec3& tangent, glm::vec3& bitangent)
+{
+    float sign = n.z >= 0.0f ? 1.0f : -1.0f;
+    float a = -1.0f / (sign + n.z);
+    float b = n.x * n.y * a;
+
+    tangent   = glm::vec3(1.0f + sign * n.x * n.x * a, sign * b, -sign * n.x);
+    bitangent = glm::vec3(b, sign + n.y * n.y * a, -n.y);
+}
+
+// Samples a microfacet normal from the distribution of normals visible from the direction wo, so
+// that no samples are wasted on microfacets facing away from it. Both vectors are in the local
+// frame, where the surface normal is +z
+// Source: Heitz 2018, "Sampling the GGX Distribution of Visible Normals"
+inline glm::vec3 sampleGgxVisibleNormal(const glm::vec3& wo, float alpha, const glm::vec2& random)
+{
+    // Stretch the view direction so that the distribution becomes a hemisphere
+    glm::vec3 stretched = glm::normalize(glm::vec3(alpha * wo.x, alpha * wo.y, wo.z));
+
+    float lengthSquared = stretched.x * stretched.x + stretched.y * stretched.y;
+    glm::vec3 t1 = lengthSquared > 0.0f ? glm::vec3(-stretched.y, stretched.x, 0.0f) / glm::sqrt(lengthSquared) : glm::vec3(1.0f, 0.0f, 0.0f);
+    glm::vec3 t2 = glm::cross(stretched, t1);
+
+    // Sample a point on the projected hemisphere
+    float r = glm::sqrt(random.x);
+    float phi = tau * random.y;
+    float p1 = r * glm::cos(phi);
+    float p2 = r * glm::sin(phi);
+    float s = 0.5f * (1.0f + stretched.z);
+    p2 = (1.0f - s) * glm::sqrt(1.0f - p1 * p1) + s * p2;
+
+    glm::vec3 normal = p1 * t1 + p2 * t2 + glm::sqrt(glm::max(0.0f, 1.0f - p1 * p1 - p2 * p2)) * stretched;
+
+    // Unstretch back to the GGX distribution
+    return glm::normalize(glm::vec3(alpha * normal.x, alpha * normal.y, glm::max(0.0f, normal.z)));
+}
+
+// Returns the Fresnel reflectance of the specular layer of an opaque material. Materials with no
+// specular colour have no specular layer at all, rather than the grazing-angle reflection that
+// Schlick's approximation would give them
+inline glm::vec3 getSpecularFresnel(const Material& material, float cosTheta)
+{
+    return material.specular == glm::vec3(0.0f) ? glm::vec3(0.0f) : fresnelSchlick(material.specular, cosTheta);
+}
+
+// Returns the probability of choosing the specular lobe over the diffuse lobe of an opaque
+// material, in proportion to how much light each reflects towards wo
+inline float getSpecularProbability(const Material& material, float cosO)
+{
+    glm::vec3 fresnel = getSpecularFresnel(material, cosO);
+    float specular = luminance(fresnel);
+    float diffuse  = luminance(material.diffuse) * (1.0f - glm::max(fresnel.x, glm::max(fresnel.y, fresnel.z)));
+
+    return specular + diffuse > 0.0f ? specular / (specular + diffuse) : 0.0f;
+}
+
+// Returns the BSDF of an opaque material times the cosine of the incident angle, for light
+// arriving from direction wi and leaving in direction wo (both pointing away from the surface)
+//
+// The material is a GGX microfacet specular layer with a Schlick Fresnel term over a Lambertian
+// base. The base receives whatever the specular layer does not reflect at normal incidence.
+// hasSpecular may only be false for materials without a specular layer, which are then evaluated
+// as the plain Lambertian base
+template <bool hasSpecular = true>
+inline glm::vec3 evaluateBsdf(const Material& material, const glm::vec3& normal, const glm::vec3& wo, const glm::vec3& wi)
+{
+    float cosO = glm::dot(normal, wo);
+    float cosI = glm::dot(normal, wi);
+    if (!material.isOpaque || cosO <= 0.0f || cosI <= 0.0f) return glm::vec3(0.0f);
+
+    if (!hasSpecular) return material.diffuse / pi * cosI;
+
+    float alpha = getGgxAlpha(material);
+    glm::vec3 halfway = glm::normalize(wo + wi);
+
+    glm::vec3 specular = ggxDistribution(glm::dot(normal, halfway), alpha) * ggxMaskingShadowing(cosO, cosI, alpha)
+        * getSpecularFresnel(material, glm::dot(wo, halfway)) / (4.0f * cosO * cosI);
+
+    glm::vec3 fresnelO = getSpecularFresnel(material, cosO);
+    glm::vec3 diffuse = material.diffuse / pi * (1.0f - glm::max(fresnelO.x, glm::max(fresnelO.y, fresnelO.z)));
+
+    return (specular + diffuse) * cosI;
+}
+
+// Returns the probability density, with respect to solid angle, that importanceSampleBsdf chooses
+// direction wi at an opaque surface seen from direction wo. See evaluateBsdf for hasSpecular
+template <bool hasSpecular = true>
+inline float getBsdfPdf(const Material& material, const glm::vec3& normal, const glm::vec3& wo, const glm::vec3& wi)
+{
+    float cosO = glm::dot(normal, wo);
+    float cosI = glm::dot(normal, wi);
+    if (!material.isOpaque || cosO <= 0.0f || cosI <= 0.0f) return 0.0f;
+
+    if (!hasSpecular) return cosI / pi;
+
+    float alpha = getGgxAlpha(material);
+    glm::vec3 halfway = glm::normalize(wo + wi);
+
+    // Visible normal density, converted from the halfway vector to the reflected direction
+    float specularPdf = ggxMasking(cosO, alpha) * ggxDistribution(glm::dot(normal, halfway), alpha) / (4.0f * cosO);
+    float diffusePdf  = cosI / pi;
+
+    float specularProbability = getSpecularProbability(material, cosO);
+    return glm::mix(diffusePdf, specularPdf, specularProbability);
+}
+
 // Returns a pseudo-randomly selected direction where the probability density of a direction being chosen
-// is proportional to the BSDF
+// is proportional to the BSDF. hasTransmission may only be false for opaque materials, and
+// hasSpecular only for materials that are transparent or have no specular layer, in which case
+// the code for the missing lobes is left out
+template <bool hasTransmission = true, bool hasSpecular = true>
 inline glm::vec3 importanceSampleBsdf(
     const Material& material,           // The hit material
-    const glm::vec3& normal,            // The hit normal
+    const glm::vec3& normal,            // The hit normal, facing the incident ray
     const glm::vec3& incidentDirection, // The incident ray direction
     const glm::vec2& random,            // Two quasi-random numbers on [0,1]
     bool& insideTransparentMaterial,    // Whether the path-tracer currently believes it is inside a transparent material like glass
-    glm::vec3& tint                     // Set to the remaining, non-importance-sampled part of the BSDF. The radiance should be multiplied by this
+    glm::vec3& tint,                    // Set to the BSDF times the cosine of the new direction divided by its probability density. The radiance should be multiplied by this
+    BsdfLobe& lobe,                     // Set to the part of the BSDF that the direction was sampled from
+    float& pdf                          // Set to the probability density of the direction for opaque materials, or 0 for transparent ones, whose BSDF cannot be evaluated for other directions
 ) {
-    // Randomly offset normal using surface roughness
-    // (fake roughness)
-    auto newNormal = glm::normalize(normal + material.roughness * uniformHemisphereSample(random, normal));
+    glm::vec3 wo = -incidentDirection;
+    float cosO = glm::max(glm::dot(normal, wo), 1e-4f);
+    float alpha = getGgxAlpha(material);
+    float lobeRandom = hash(random + 0.1f).x;
 
-    // Calculate reflected direction
-    auto reflectedDirection = glm::reflect(incidentDirection, newNormal);
+    // Samples a visible microfacet normal in the local frame of the surface, and returns it in world space
+    auto sampleMicrofacetNormal = [&] ()
+    {
+        glm::vec3 tangent, bitangent;
+        makeBasis(normal, tangent, bitangent);
 
-    // Calculate fresnel coefficient
-    auto halfwayDirection = glm::normalize(-incidentDirection + reflectedDirection);
-    auto fresnel = fresnelSchlick(material.specular, glm::dot(halfwayDirection, reflectedDirection));
+        glm::vec3 localWo(glm::dot(wo, tangent), glm::dot(wo, bitangent), cosO);
+        glm::vec3 localMicrofacetNormal = sampleGgxVisibleNormal(glm::normalize(localWo), alpha, random);
+        return localMicrofacetNormal.x * tangent + localMicrofacetNormal.y * bitangent + localMicrofacetNormal.z * normal;
+    };
 
-    // Decide whether the scattering event represents a reflection or a refraction
-    auto reflect = hash(random + 0.1f).x < fresnel.x && (material.specular.x + material.specular.y + material.specular.z) > eps;
+    if (hasTransmission && !material.isOpaque)
+    {
+        // A rough dielectric boundary, which reflects or refracts in proportion to its Fresnel
+        // reflectance for the sampled microfacet (Walter et al. 2007). The Fresnel term and the
+        // microfacet density cancel, leaving only the masking of the new direction
+        pdf = 0.0f;
 
-    // Calculate refracted direction and check if a total internal reflection occurred
-    auto eta = insideTransparentMaterial ? material.refractiveIndex : 1.0f / material.refractiveIndex;
-    glm::vec3 refractedDirection = glm::refract(incidentDirection, newNormal, eta);
-    if (glm::length(refractedDirection) < 0.5f) reflect = true; // Total internal reflection
+        glm::vec3 microfacetNormal = sampleMicrofacetNormal();
 
-    if (reflect) // Specular reflection
-    {
-        return reflectedDirection;
+        float eta = insideTransparentMaterial ? material.refractiveIndex : 1.0f / material.refractiveIndex;
+        float fresnel = fresnelDielectric(glm::dot(wo, microfacetNormal), eta);
+
+        if (lobeRandom < fresnel)
+        {
+            lobe = BsdfLobe::Specular;
+            glm::vec3 direction = glm::reflect(incidentDirection, microfacetNormal);
+
+            float cosI = glm::dot(normal, direction);
+            tint = cosI > 0.0f ? glm::vec3(ggxMasking(cosI, alpha)) : glm::vec3(0.0f);
+
+            return direction;
+        }
+        else
+        {
+            lobe = BsdfLobe::Transmission;
+            glm::vec3 direction = glm::refract(incidentDirection, microfacetNormal, eta);
+
+            float cosI = -glm::dot(normal, direction);
+            tint = cosI > 0.0f ? material.transmittance * ggxMasking(cosI, alpha) : glm::vec3(0.0f);
+
+            insideTransparentMaterial = !insideTransparentMaterial;
+            return direction;
+        }
     }
-    else if (material.isOpaque) // Diffuse reflection
+
+    // Choose between the specular and diffuse lobes, then weigh the direction by the density of
+    // both, so that directions either lobe could have produced are not over-counted
+    glm::vec3 direction;
+    if (hasSpecular && lobeRandom < getSpecularProbability(material, cosO))
     {
-        tint = material.diffuse;
-        return glm::normalize(normal + uniformSphereSample(random));
+        lobe = BsdfLobe::Specular;
+        direction = glm::reflect(incidentDirection, sampleMicrofacetNormal());
     }
-    else // Specular refraction
+    else
     {
-        if (fresnel.x != 0.0f) tint = fresnel / fresnel.x;
-        insideTransparentMaterial = !insideTransparentMaterial;
-        return refractedDirection;
+        lobe = BsdfLobe::Diffuse;
+        direction = glm::normalize(normal + uniformSphereSample(random));
     }
+
+    pdf = getBsdfPdf<hasSpecular>(material, normal, wo, direction);
+    tint = pdf > 0.0f ? evaluateBsdf<hasSpecular>(material, normal, wo, direction) / pdf : glm::vec3(0.0f);
+
+    return direction;
 }
@@ -0,0 +1,398 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+#include "utility.hh"
+
+/*
+ * Bounding volume hierarchies used to accelerate the ray-scene intersection
+ *
+ * Both BVHs are built over a list of primitive bounding boxes. The builder decides an order for
+ * the primitives such that every leaf references a contiguous range of them; the caller must
+ * store its primitives in that order (see `primitiveOrder` in build()). During traversal, the
+ * caller's intersectPrimitive(index, tMax) function is called for each primitive in a leaf that
+ * the ray reaches. It must return true and shorten tMax if the primitive is hit closer than tMax
+ */
+
+// Maximum number of primitives stored in one leaf
+constexpr uint bvhMaxLeafSize = 8;
+
+// Number of primitives below which a lazily built WideBvh leaves a subtree to be built on first use
+constexpr uint bvhLazySubtreeSize = 1024;
+
+// Ray data precomputed once per traversal
+struct BvhRay
+{
+    BvhRay(const Ray& ray) : o(ray.o)
+    {
+        // Avoid infinities from axis-aligned rays, which would produce NaNs in the slab test
+        glm::vec3 d = ray.d;
+        for (int axis = 0; axis < 3; ++axis)
+            if (glm::abs(d[axis]) < 1e-20f) d[axis] = d[axis] < 0.0f ? -1e-20f : 1e-20f;
+
+        invD = 1.0f / d;
+    }
+
+    glm::vec3 o;    // Ray origin
+    glm::vec3 invD; // Reciprocal of the ray direction
+};
+
+// Returns the distance at which the ray enters the box, or inf if it misses the box or the box
+// begins beyond tMax
+inline float intersectBox(const BvhRay& ray, const Box& box, float tMax)
+{
+    glm::vec3 t0 = (box.min - ray.o) * ray.invD;
+    glm::vec3 t1 = (box.max - ray.o) * ray.invD;
+    glm::vec3 tNear = glm::min(t0, t1);
+    glm::vec3 tFar  = glm::max(t0, t1);
+
+    float entry = glm::max(glm::max(tNear.x, tNear.y), glm::max(tNear.z, 0.0f));
+    float exit  = glm::min(glm::min(tFar.x, tFar.y), glm::min(tFar.z, tMax));
+
+    return entry <= exit ? entry : inf;
+}
+
+/*
+ * A plain binary BVH, 32 bytes per node. This is the layout that the wide BVH is collapsed from
+ * and is kept so that the two layouts can be compared with `lumos benchmark`
+ */
+class BinaryBvh
+{
+public:
+    struct Node
+    {
+        Box bounds;  // Box enclosing every primitive below this node
+        uint offset; // Index of the first primitive for leaves; index of the right child for interior nodes (the left child always directly follows its parent)
+        uint count;  // Number of primitives in a leaf, zero for interior nodes
+    };
+
+    // Builds the BVH using the surface area heuristic and fills `primitiveOrder` with the
+    // original index of the primitive that should be stored at each position. If deferredSize is
+    // larger than bvhMaxLeafSize, nodes with more than bvhMaxLeafSize and at most deferredSize
+    // primitives are not split, but left as oversized leaves for the caller to build later
+    void build(const std::vector<Box>& boxes, std::vector<uint>& primitiveOrder, uint deferredSize = 0);
+
+    void clear() { m_nodes.clear(); }
+
+    const std::vector<Node>& getNodes() const { return m_nodes; }
+
+    std::size_t getMemoryFootprint() const { return m_nodes.size() * sizeof(Node); }
+
+    // Returns true if any call to intersectPrimitive returned true
+    template <typename IntersectPrimitive>
+    bool intersect(const Ray& ray, float& tMax, const IntersectPrimitive& intersectPrimitive) const
+    {
+        if (m_nodes.empty()) return false;
+
+        BvhRay bvhRay(ray);
+        bool hit = false;
+
+        struct StackEntry { uint node; float t; };
+        std::array<StackEntry, 128> stack;
+        int stackSize = 0;
+
+        if (intersectBox(bvhRay, m_nodes[0].bounds, tMax) == inf) return false;
+        stack[stackSize++] = { 0, 0.0f };
+
+        while (stackSize > 0)
+        {
+            auto entry = stack[--stackSize];
+            if (entry.t > tMax) continue; // Something closer has been found since this node was pushed
+
+            const Node& node = m_nodes[entry.node];
+
+            if (node.count > 0)
+            {
+                for (uint i = node.offset; i < node.offset + node.count; ++i)
+                    hit |= intersectPrimitive(i, tMax);
+
+                continue;
+            }
+
+            uint near = entry.node + 1, far = node.offset;
+            float tNear = intersectBox(bvhRay, m_nodes[near].bounds, tMax);
+            float tFar  = intersectBox(bvhRay, m_nodes[far].bounds, tMax);
+
+            // Visit the closer child first
+            if (tFar < tNear) { std::swap(near, far); std::swap(tNear, tFar); }
+            if (tFar  != inf) stack[stackSize++] = { far, tFar };
+            if (tNear != inf) stack[stackSize++] = { near, tNear };
+        }
+
+        return hit;
+    }
+
+private:
+    struct BuildPrimitive
+    {
+        Box box;
+        glm::vec3 centre;
+        uint index;
+    };
+
+    void buildRecursive(uint nodeIndex, std::vector<BuildPrimitive>& primitives, uint begin, uint end);
+
+    std::vector<Node> m_nodes;
+    uint m_deferredSize = 0; // See build()
+};
+
+/*
+ * A 4-wide BVH with quantized child bounds
+ *
+ * Each node stores the bounds of its (up to) four children as 8-bit offsets relative to the
+ * node's own box, which fits the whole node in one 64 byte cache line compared to the 2 x 32
+ * bytes needed to store two children in the binary layout. The per-axis scale is a power of two
+ * so that decoding is exact, and the quantized boxes are rounded outwards so they always enclose
+ * the real boxes. Nodes are stored in depth-first order, and the four child boxes are tested
+ * against the ray at once using SSE where available
+ *
+ * A lazily built BVH only builds its top levels up front, down to subtrees of at most
+ * bvhLazySubtreeSize primitives. Each of those is built the first time a ray reaches it, by
+ * whichever thread gets there first while the others wait, so parts of a scene that no ray
+ * reaches are never built. The primitives within a lazy subtree are reached through an extra
+ * index, because their order is only decided once the caller has stored them
+ */
+class WideBvh
+{
+public:
+    static constexpr int width = 4;
+
+    struct alignas(64) Node
+    {
+        glm::vec3 origin;                 // Lower corner of the node's box
+        std::int8_t exponent[3];          // Per-axis quantization scale, as a power of two
+        glm::u8 childCount;               // Number of valid children, stored in the first childCount slots
+        glm::u8 lo[3][width];             // Quantized lower bounds of each child, per axis
+        glm::u8 hi[3][width];             // Quantized upper bounds of each child, per axis
+        uint child[width];                // Node index for interior children, first primitive index for leaves
+        glm::u8 primitiveCount[width];    // Number of primitives in leaf children, zero for interior children
+    };
+
+    static_assert(sizeof(Node) == 64, "WideBvh::Node should occupy exactly one cache line");
+
+    // Builds the BVH using the surface area heuristic and fills `primitiveOrder` with the
+    // original index of the primitive that should be stored at each position. If lazy is set, only
+    // the top levels are built now (see above)
+    void build(const std::vector<Box>& boxes, std::vector<uint>& primitiveOrder, bool lazy = false);
+
+    // Collapses an existing binary BVH into this BVH, keeping its primitive order
+    void build(const BinaryBvh& binary);
+
+    // Updates the bounds of every node after the primitives have moved, keeping the tree's
+    // structure. `boxes` holds the new primitive bounding boxes in primitive order. This is much
+    // faster than a rebuild, but the tree gets worse the further primitives move from where it was
+    // built, which getCost() tracks. Lazy subtrees are discarded, to be built again when next used
+    void refit(const std::vector<Box>& boxes);
+
+    // Returns the sum of the surface areas of the nodes' boxes, which is proportional to the
+    // expected number of nodes a random ray visits. Compare with getBuildCost() to decide when a
+    // refitted tree should be rebuilt
+    float getCost() const { return m_cost; }
+
+    // Returns getCost() as it was right after the tree was last built
+    float getBuildCost() const { return m_buildCost; }
+
+    void clear() { m_nodes.clear(); m_lazySubtrees.clear(); m_lazyBoxes.clear(); m_cost = m_buildCost = 0.0f; }
+
+    // Returns the memory used by the nodes, including those of the lazy subtrees built so far.
+    // Must not be called while rays are being traced
+    std::size_t getMemoryFootprint() const;
+
+    // Returns true if any call to intersectPrimitive returned true. If anyHit is set, traversal
+    // stops at the first such primitive instead of searching for the closest one, which is all
+    // that visibility queries need
+    template <bool anyHit = false, typename IntersectPrimitive>
+    bool intersect(const Ray& ray, float& tMax, const IntersectPrimitive& intersectPrimitive) const
+    {
+        if (m_nodes.empty()) return false;
+
+        BvhRay bvhRay(ray);
+        bool hit = false;
+
+        // Stack entries are either an interior node (count = 0) or a leaf's primitive range
+        struct StackEntry { uint index; uint count; float t; };
+        std::array<StackEntry, 256> stack;
+        int stackSize = 0;
+
+        stack[stackSize++] = { 0, 0, 0.0f };
+
+        while (stackSize > 0)
+        {
+            auto entry = stack[--stackSize];
+            if (entry.t > tMax) continue; // Something closer has been found since this entry was pushed
+
+            if (entry.count == lazyChild)
+            {
+                hit |= intersectLazySubtree<anyHit>(entry.index, ray, tMax, intersectPrimitive);
+                if (anyHit && hit) return true;
+
+                continue;
+            }
+
+            if (entry.count > 0)
+            {
+                for (uint i = entry.index; i < entry.index + entry.count; ++i)
+                {
+                    hit |= intersectPrimitive(i, tMax);
+                    if (anyHit && hit) return true;
+                }
+
+                continue;
+            }
+
+            const Node& node = m_nodes[entry.index];
+
+            float childT[width];
+            int hitMask = intersectChildren(node, bvhRay, tMax, childT);
+
+            // Sort the children that were hit by distance, then push them furthest first so that
+            // the nearest is visited next
+            int order[width], hitCount = 0;
+            for (int i = 0; i < width; ++i)
+            {
+                if ((hitMask & (1 << i)) == 0) continue;
+
+                int j = hitCount++;
+                for (; j > 0 && childT[order[j - 1]] < childT[i]; --j) order[j] = order[j - 1];
+                order[j] = i;
+            }
+
+            for (int j = 0; j < hitCount; ++j)
+            {
+                int i = order[j];
+                stack[stackSize++] = { node.child[i], node.primitiveCount[i], childT[i] };
+            }
+        }
+
+        return hit;
+    }
+
+private:
+    // Value of primitiveCount marking a child as a lazy subtree, in which case child holds the
+    // subtree's index in m_lazySubtrees
+    static constexpr glm::u8 lazyChild = 255;
+
+    static_assert(bvhMaxLeafSize < lazyChild, "Leaf sizes must not be mistaken for lazy subtrees");
+
+    struct LazySubtree;
+
+    // Returns a lazy subtree, building it first if no ray has reached it before
+    const LazySubtree& getLazySubtree(uint index) const;
+
+    // Intersects a ray with a lazy subtree, building it first if needed
+    template <bool anyHit, typename IntersectPrimitive>
+    bool intersectLazySubtree(uint index, const Ray& ray, float& tMax, const IntersectPrimitive& intersectPrimitive) const;
+
+    // Returns 2^exponent as a float by constructing its bit pattern
+    static float exp2i(int exponent)
+    {
+        std::uint32_t bits = std::uint32_t(exponent + 127) << 23;
+        float result;
+        std::memcpy(&result, &bits, sizeof(float));
+        return result;
+    }
+
+    // Tests the ray against all children of a node at once. Returns a bit mask of the children that
+    // were hit and stores the entry distance of each child in t
+    static int intersectChildren(const Node& node, const BvhRay& ray, float tMax, float t[width])
+    {
+        // The box of child i along an axis is [origin + lo[i] * scale, origin + hi[i] * scale], so
+        // the slab distances are q * (scale / d) + (origin - o) / d, one multiply-add per bound
+        glm::vec3 scale(exp2i(node.exponent[0]), exp2i(node.exponent[1]), exp2i(node.exponent[2]));
+        glm::vec3 a = scale * ray.invD;
+        glm::vec3 b = (node.origin - ray.o) * ray.invD;
+
+#if defined(__SSE2__)
+        const __m128i zero = _mm_setzero_si128();
+
+        // Widens four packed 8-bit quantized bounds to floats
+        auto unpack = [&] (const glm::u8* q)
+        {
+            std::int32_t packed;
+            std::memcpy(&packed, q, sizeof(packed));
+            __m128i v = _mm_cvtsi32_si128(packed);
+            v = _mm_unpacklo_epi16(_mm_unpacklo_epi8(v, zero), zero);
+            return _mm_cvtepi32_ps(v);
+        };
+
+        __m128 entry = _mm_setzero_ps();
+        __m128 exit  = _mm_set1_ps(tMax);
+
+        for (int axis = 0; axis < 3; ++axis)
+        {
+            __m128 va = _mm_set1_ps(a[axis]);
+            __m128 vb = _mm_set1_ps(b[axis]);
+            __m128 t0 = _mm_add_ps(_mm_mul_ps(unpack(node.lo[axis]), va), vb);
+            __m128 t1 = _mm_add_ps(_mm_mul_ps(unpack(node.hi[axis]), va), vb);
+
+            entry = _mm_max_ps(entry, _mm_min_ps(t0, t1));
+            exit  = _mm_min_ps(exit,  _mm_max_ps(t0, t1));
+        }
+
+        _mm_storeu_ps(t, entry);
+        int mask = _mm_movemask_ps(_mm_cmple_ps(entry, exit));
+#else
+        int mask = 0;
+        for (int i = 0; i < width; ++i)
+        {
+            float entry = 0.0f, exit = tMax;
+            for (int axis = 0; axis < 3; ++axis)
+            {
+                float t0 = node.lo[axis][i] * a[axis] + b[axis];
+                float t1 = node.hi[axis][i] * a[axis] + b[axis];
+                entry = glm::max(entry, glm::min(t0, t1));
+                exit  = glm::min(exit,  glm::max(t0, t1));
+            }
+
+            t[i] = entry;
+            if (entry <= exit) mask |= 1 << i;
+        }
+#endif
+
+        return mask & ((1 << node.childCount) - 1);
+    }
+
+    uint collapse(const BinaryBvh& binary, uint binaryIndex);
+
+    // Sets a node's origin and scale to cover `bounds`, and quantizes the bounds of its children
+    static void quantize(Node& node, const Box& bounds, const Box* childBounds);
+
+    std::vector<Node> m_nodes;
+    std::vector<std::unique_ptr<LazySubtree>> m_lazySubtrees; // Subtrees left to build on first use
+    std::vector<Box> m_lazyBoxes; // Bounding boxes of the primitives, in primitive order, kept to build the lazy subtrees
+    float m_cost = 0.0f;      // Sum of the surface areas of the nodes' boxes, not counting lazy subtrees
+    float m_buildCost = 0.0f; // m_cost when the tree was built
+};
+
+// A subtree of a lazily built WideBvh over the primitives in [begin, end)
+struct WideBvh::LazySubtree
+{
+    LazySubtree(uint begin, uint end) : begin(begin), end(end) {}
+
+    uint begin, end;
+    std::once_flag buildFlag;
+    std::atomic<bool> built { false };
+    WideBvh bvh;             // BVH over the subtree's primitives, built on first use
+    std::vector<uint> order; // Position relative to begin of the primitive at each position of bvh
+};
+
+template <bool anyHit, typename IntersectPrimitive>
+bool WideBvh::intersectLazySubtree(uint index, const Ray& ray, float& tMax, const IntersectPrimitive& intersectPrimitive) const
+{
+    const LazySubtree& subtree = getLazySubtree(index);
+
+    return subtree.bvh.intersect<anyHit>(ray, tMax, [&] (uint i, float& tMax)
+    {
+        return intersectPrimitive(subtree.begin + subtree.order[i], tMax);
+    });
+}
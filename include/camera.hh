@@ -1,5 +1,7 @@
 #pragma once
 
+#include <memory>
+
 #include "utility.hh"
 
 class Camera
@@ -8,6 +10,17 @@ public:
 	virtual ~Camera() {};
 	virtual Ray getPrimaryRay(const glm::vec2& coord) const = 0;
 
+	// Returns the angle subtended by one pixel of an image with the given size, used as the spread
+	// angle of the primary ray cones
+	virtual float getPixelSpreadAngle(glm::ivec2 imageSize) const = 0;
+
+	// Finds the coordinate on the image, on [0, 1], whose primary ray passes through `pos`. The
+	// inverse of getPrimaryRay. Returns false if `pos` is behind the camera
+	virtual bool project(const glm::vec3& pos, glm::vec2& coord) const = 0;
+
+	// Returns a copy of the camera, eg to remember where it was when it moves
+	virtual std::unique_ptr<Camera> clone() const = 0;
+
 	glm::vec3 position; // position of the camera in the world
 	glm::vec2 rotation; // azimuthal angle (yaw), altitude (pitch), in degrees
 };
@@ -16,7 +29,14 @@ class PerspectiveCamera : public Camera
 {
 public:
 	Ray getPrimaryRay(const glm::vec2& coord) const;
+	float getPixelSpreadAngle(glm::ivec2 imageSize) const;
+	bool project(const glm::vec3& pos, glm::vec2& coord) const;
+	std::unique_ptr<Camera> clone() const { return std::make_unique<PerspectiveCamera>(*this); }
 
 	float fov; // horizontal field-of-view angle, in degrees
 	float aspectRatio; // image width / image height
+
+private:
+	// Returns the rotation from a camera facing along the z axis to the camera's orientation
+	glm::mat3 getRotation() const;
 };
@@ -0,0 +1,105 @@
+#pragma once
+
+#include <atomic>
+#include <cstring>
+#include <fstream>
+#include <string>
+#include <thread>
+#include <type_traits>
+#include <vector>
+
+/*
+ * The state of a render, saved so that a long render can be continued after the program stops
+ *
+ * Values are appended with write() and read back with read() in the same order. Only plain values
+ * are stored, byte for byte, so a checkpoint must be read by the same build on the same kind of
+ * machine that wrote it
+ *
+ * Large blocks such as images are appended with writeReference(), which only records where they
+ * are, and are written straight from there to the file when the checkpoint is saved, so that
+ * saving never needs a second copy of them. Likewise, a loaded checkpoint reads its values from
+ * the file as they are asked for rather than holding the whole file in memory
+ */
+class Checkpoint
+{
+public:
+    template <typename T>
+    void write(const T& value)
+    {
+        static_assert(std::is_trivially_copyable_v<T>, "Only plain values can be written to checkpoints");
+        writeBytes(&value, sizeof(T));
+    }
+
+    void writeBytes(const void* data, std::size_t size)
+    {
+        const char* bytes = static_cast<const char*>(data);
+        m_data.insert(m_data.end(), bytes, bytes + size);
+    }
+
+    // Appends `size` bytes that are written from `data` when the checkpoint is saved, instead of
+    // being copied now. The data must stay unchanged until saveToFile() returns
+    void writeReference(const void* data, std::size_t size)
+    {
+        m_references.push_back({ m_data.size(), data, size });
+    }
+
+    // Reads the next value. Returns false if the checkpoint ends first
+    template <typename T>
+    bool read(T& value)
+    {
+        static_assert(std::is_trivially_copyable_v<T>, "Only plain values can be read from checkpoints");
+        return readBytes(&value, sizeof(T));
+    }
+
+    bool readBytes(void* data, std::size_t size)
+    {
+        return (bool) m_file.read(static_cast<char*>(data), (std::streamsize) size);
+    }
+
+    // Writes the checkpoint to a file. The new contents are written to a temporary file and flushed
+    // to the disk before it replaces the old one, so that a crash or power loss while saving leaves
+    // the previous checkpoint intact. Returns false if the file cannot be written
+    bool saveToFile(const std::string& path) const;
+
+    // Opens a checkpoint file, ready to be read from the start. Returns false if it cannot be opened
+    bool loadFromFile(const std::string& path);
+
+private:
+    // A block of memory to be written at position `offset` of m_data
+    struct Reference
+    {
+        std::size_t offset;
+        const void* data;
+        std::size_t size;
+    };
+
+    std::vector<char> m_data;              // The values written, apart from the references
+    std::vector<Reference> m_references;   // Blocks written in place, in order
+    std::ifstream m_file;                  // The file being read, for a loaded checkpoint
+};
+
+// Saves checkpoints to a file on a background thread, so that the window stays responsive while
+// they are written. Rendering must wait until isSaving() returns false, because the images the
+// checkpoint refers to are written from where they are. Only one checkpoint is written at a time
+class CheckpointSaver
+{
+public:
+    CheckpointSaver() = default;
+    ~CheckpointSaver() { wait(); }
+
+    CheckpointSaver(const CheckpointSaver&) = delete;
+    CheckpointSaver& operator=(const CheckpointSaver&) = delete;
+
+    // Starts saving a checkpoint to `path`, after waiting for the previous one to be written
+    void save(Checkpoint&& checkpoint, const std::string& path);
+
+    // Returns true while a checkpoint is being written
+    bool isSaving() const { return m_saving; }
+
+    // Waits for the checkpoint being saved, if any, to be written
+    void wait();
+
+private:
+    std::thread m_thread;
+    std::atomic<bool> m_saving { false };
+};
@@ -0,0 +1,45 @@
+#pragma once
+
+#include "image.hh"
+#include "utility.hh"
+
+/*
+ * Edge-avoiding à-trous wavelet filter (Dammertz et al. 2010, "Edge-Avoiding À-Trous Wavelet
+ * Transform for fast Global Illumination Filtering"), with the variance-guided colour weight from
+ * SVGF (Schied et al. 2017)
+ *
+ * The noisy radiance is blurred with a 5x5 B-spline kernel whose taps are spread further apart on
+ * each iteration, so that a wide blur is achieved with only 25 taps per pixel per iteration. Each
+ * tap is weighted by how similar its normal and albedo are to the centre pixel, which stops the
+ * blur from crossing geometric edges, and by how similar its luminance is relative to the
+ * estimated noise level, so that noisy regions are blurred more than converged ones. The albedo is
+ * divided out before filtering and multiplied back in afterwards so that textures stay sharp
+ */
+class Denoiser
+{
+public:
+    Denoiser(glm::ivec2 size, PixelLayout layout, ImageBacking backing = ImageBacking::Memory);
+
+    // Filters `radiance` using the first-hit albedo and normal images as guides and stores the
+    // result in `output`, using the threads in `pool`. `luminanceMoment` holds the mean squared
+    // luminance of each pixel's samples, and sampleCount the number of samples in each pixel
+    void denoise(
+        const Image<glm::vec3>& radiance,
+        const Image<float>& luminanceMoment,
+        const Image<glm::vec3, CompactVec3>& albedo,
+        const Image<glm::vec3, CompactVec3>& normal,
+        const Image<float>& sampleCount,
+        Image<glm::vec3, CompactColor>& output,
+        ThreadPool& pool
+    );
+
+    int   iterationCount    = 5;    // Number of filter passes; the filter covers 4 * 2^iterationCount pixels
+    float colorPhi          = 4.0f; // Luminance difference, in standard deviations, at which a tap's weight falls to 1/e
+    int   normalSharpness   = 6;    // The normal weight is dot(n, n')^(2^normalSharpness)
+    float albedoPhi         = 0.1f; // Albedo difference at which a tap's weight falls to 1/e
+
+private:
+    // Ping-pong buffers holding the demodulated irradiance (rgb) and its variance (a) between passes
+    Image<glm::vec4, CompactVec4> m_ping;
+    Image<glm::vec4, CompactVec4> m_pong;
+};
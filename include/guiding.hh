@@ -0,0 +1,73 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <vector>
+
+#include "checkpoint.hh"
+#include "utility.hh"
+
+/*
+ * An online-learned estimate of where light arrives from, used to guide the directions that paths
+ * bounce in (in the spirit of Müller et al. 2017, "Practical Path Guiding for Efficient
+ * Light-Transport Simulation", with a uniform grid instead of an adaptive tree)
+ *
+ * The scene's bounding box is divided into a uniform grid of cells, and the sphere of directions
+ * around each cell into an 8x8 grid of bins of equal solid angle (uniform in cos(theta) and phi).
+ * While training, every path vertex adds its estimate of the radiance arriving along its sampled
+ * directions to the bins of its cell. update() turns the totals into a distribution per cell,
+ * which is then sampled and evaluated while the next round of training data is collected into a
+ * separate buffer, so that sampling never sees partially written data
+ *
+ * record() may be called from many threads at once; it only performs atomic additions. These are
+ * integer additions of fixed point values, so the totals, and the distributions built from them,
+ * do not depend on the order the threads record in. update() must not run at the same time as any
+ * other call
+ */
+class PathGuide
+{
+public:
+    // Number of direction bins along each axis of the direction grid
+    static constexpr int directionResolution = 8;
+    static constexpr int binCount = directionResolution * directionResolution;
+
+    // Sets up an empty guide covering the given bounds with resolution^3 cells
+    void reset(const Box& bounds, int resolution);
+
+    // Adds an estimate of the radiance arriving at `pos` from `direction`, divided by the
+    // probability density of the direction, to the training data
+    void record(const glm::vec3& pos, const glm::vec3& direction, float value);
+
+    // Replaces the sampling distributions with ones built from the training data collected since
+    // the last update, and clears the training data
+    void update();
+
+    // Returns the index of the cell containing `pos` if it has a distribution to sample, or -1
+    int getCell(const glm::vec3& pos) const;
+
+    // Samples a direction from a cell's distribution
+    glm::vec3 sample(int cell, const glm::vec2& random) const;
+
+    // Returns the probability density, with respect to solid angle, that sample() chooses `direction`
+    float getPdf(int cell, const glm::vec3& direction) const;
+
+    // Writes the guide's distributions and training data to a checkpoint. Must not run at the same
+    // time as record() or update()
+    void saveCheckpoint(Checkpoint& checkpoint) const;
+
+    // Restores the guide from a checkpoint written by saveCheckpoint(). Returns false if the
+    // checkpoint ends early
+    bool loadCheckpoint(Checkpoint& checkpoint);
+
+private:
+    int getCellIndex(const glm::vec3& pos) const;
+
+    static int getBinIndex(const glm::vec3& direction);
+
+    Box m_bounds;
+    int m_resolution = 0;
+    std::vector<std::atomic<std::uint64_t>> m_training; // Sum of recorded values per cell and bin, in fixed point
+    std::vector<std::atomic<int>> m_sampleCounts; // Number of recorded values per cell
+    std::vector<float> m_cdf;                   // Cumulative distribution over the bins of each cell, with binCount entries per cell
+    std::vector<bool> m_trained;                // Whether each cell has a distribution to sample
+};
@@ -1,30 +1,125 @@
 #pragma once
 
-template <typename T>
+#include <atomic>
+#include <cstdio>
+#include <memory>
+#include <string>
+#include <type_traits>
+#include <vector>
+
+#include "mapped_buffer.hh"
+#include "parallel.hh"
+#include "pixel.hh"
+#include "utility.hh"
+
+// Width and height of the tiles that images are divided into by the tiled layouts and by process()
+constexpr int imageTileSize = 8;
+
+// The order in which an image's pixels are stored in memory
+enum class PixelLayout
+{
+    RowMajor, // One row of pixels after another. Required for images that are written to files or uploaded as textures
+    Tiled,    // 8x8 tiles of pixels in the order process() visits them, with the pixels in each tile stored row by row
+    Morton,   // 8x8 tiles of pixels in the order process() visits them, with the pixels in each tile stored in Z-order
+};
+
+// Where an image's pixels are held
+enum class ImageBacking
+{
+    Memory,     // Allocated on the heap
+    MappedFile, // In a memory-mapped temporary file (see MappedBuffer), so that only the tiles being worked on need to stay in memory. For images too large to keep in memory
+};
+
+// Number of tiles that process() works through before releasing them from a mapped image
+constexpr int imageReleaseTileCount = 1024;
+
+/*
+ * Tracks which blocks of imageReleaseTileCount tiles a parallel pass over the tiles [begin, end)
+ * has finished. Threads take chunks of tiles in any order and finish them at different times, so
+ * a block may only be released once every tile in it has finished, not when the thread that takes
+ * its last tile gets there
+ */
+class TileReleaseTracker
+{
+public:
+    TileReleaseTracker(int begin, int end) :
+        m_begin(begin),
+        m_end(end),
+        m_firstBlock(begin / imageReleaseTileCount)
+    {
+        int blockCount = end > begin ? (end - 1) / imageReleaseTileCount - m_firstBlock + 1 : 0;
+        m_remaining = std::make_unique<std::atomic<int>[]>(blockCount);
+
+        // Blocks are aligned to multiples of imageReleaseTileCount and clipped to the range
+        for (int i = 0; i < blockCount; ++i)
+        {
+            int blockBegin = glm::max((m_firstBlock + i) * imageReleaseTileCount, begin);
+            int blockEnd   = glm::min((m_firstBlock + i + 1) * imageReleaseTileCount, end);
+            m_remaining[i] = blockEnd - blockBegin;
+        }
+    }
+
+    // Records that a tile has finished. Returns true if it was the last tile of its block to
+    // finish, and sets [blockBegin, blockEnd) to the block's tiles
+    bool finish(int tileIndex, int& blockBegin, int& blockEnd)
+    {
+        int block = tileIndex / imageReleaseTileCount;
+        if (m_remaining[block - m_firstBlock].fetch_sub(1, std::memory_order_acq_rel) != 1) return false;
+
+        blockBegin = glm::max(block * imageReleaseTileCount, m_begin);
+        blockEnd   = glm::min((block + 1) * imageReleaseTileCount, m_end);
+        return true;
+    }
+
+private:
+    int m_begin, m_end;
+    int m_firstBlock; // Index of the block containing m_begin
+    std::unique_ptr<std::atomic<int>[]> m_remaining; // Number of unfinished tiles in each block
+};
+
+// An image of T pixels. The pixels are held in memory as Storage, which may be a compact format
+// from pixel.hh that T is converted to and from on every load and store
+template <typename T, typename Storage = T>
 class Image
 {
 public:
     // Construct an uninitialized image
     Image() :
-        m_data(nullptr),
-        m_size(0)
+        m_size(0),
+        m_layout(PixelLayout::RowMajor),
+        m_data(nullptr)
     {}
 
     // Construct a blank image of the specified width and height
-    Image(glm::ivec2 size) :
-        m_size(size)
+    Image(glm::ivec2 size, PixelLayout layout = PixelLayout::RowMajor, ImageBacking backing = ImageBacking::Memory) :
+        m_size(size),
+        m_layout(layout)
     {
-        m_data = new T[size.x * size.y];
+        if (backing == ImageBacking::MappedFile)
+        {
+            static_assert(std::is_trivially_copyable_v<Storage>, "Only plain pixels can be stored in mapped files");
+
+            m_mapping = std::make_unique<MappedBuffer>(getStorageBytes());
+            m_data = static_cast<Storage*>(m_mapping->data());
+        }
+        else
+        {
+            m_data = new Storage[getStorageSize()];
+        }
+
+        m_tiles = TileGrid(size, imageTileSize);
     }
 
     ~Image()
     {
-        if (m_data != nullptr) delete [] m_data;
+        freeData();
     }
 
     // Loads the image data from a png file at the specified path
     void loadFromFile(const char* path)
     {
+        static_assert(std::is_same_v<T, Storage>, "Only uncompressed images can be loaded from files");
+
         // Load the image data using the stb_image library
         int width, height, channelCount;
         unsigned char* data = stbi_load(path, &width, &height, &channelCount, T::length());
@@ -36,17 +131,22 @@ public:
         else
         {
             // Delete the old image data
-            if (m_data != nullptr) delete [] m_data;
+            freeData();
 
-            m_data = reinterpret_cast<T*>(data);
+            m_data = reinterpret_cast<Storage*>(data);
             m_size.x = width;
             m_size.y = height;
+            m_layout = PixelLayout::RowMajor;
+            m_tiles = TileGrid(m_size, imageTileSize);
         }
     }
 
     // Writes the image data to a png file at the specified path
     void writeToFile(const char* path) const
     {
+        static_assert(std::is_same_v<T, Storage>, "Only uncompressed images can be written to files");
+        assert(m_layout == PixelLayout::RowMajor);
+
         bool success = stbi_write_png(
 			path,
 			m_size.x,
@@ -60,12 +160,83 @@ public:
             throw std::runtime_error(fmt::format("Failed to write image file: {}", path));
     }
 
+    // Loads the image data from a little-endian RGB PFM file at the specified path, keeping the
+    // full floating point values
+    void loadFromPfm(const char* path)
+    {
+        static_assert(std::is_same_v<T, glm::vec3> && std::is_same_v<T, Storage>, "Only uncompressed RGB float images can be loaded from PFM files");
+
+        FILE* file = std::fopen(path, "rb");
+        if (file == nullptr) throw std::runtime_error(fmt::format("Failed to load image file: {}", path));
+
+        // The header is "PF", the width and height, and a scale whose sign gives the byte order,
+        // followed by a single whitespace character
+        char type[3] = {};
+        int width, height;
+        float scale;
+        if (std::fscanf(file, "%2s %d %d %f", type, &width, &height, &scale) != 4 || std::string(type) != "PF" ||
+            width <= 0 || height <= 0 || scale >= 0.0f || std::fgetc(file) == EOF)
+        {
+            std::fclose(file);
+            throw std::runtime_error(fmt::format("Not a little-endian RGB PFM file: {}", path));
+        }
+
+        Storage* data = new Storage[width * height];
+
+        // PFM stores the rows from the bottom of the image up
+        bool success = true;
+        for (int y = height - 1; y >= 0 && success; --y)
+            success = std::fread(&data[y * width], sizeof(Storage), width, file) == (std::size_t) width;
+
+        std::fclose(file);
+
+        if (!success)
+        {
+            delete [] data;
+            throw std::runtime_error(fmt::format("Failed to load image file: {}", path));
+        }
+
+        freeData();
+
+        m_data = data;
+        m_size = glm::ivec2(width, height);
+        m_layout = PixelLayout::RowMajor;
+        m_tiles = TileGrid(m_size, imageTileSize);
+    }
+
+    // Writes the image data to a little-endian RGB PFM file at the specified path, keeping the full
+    // floating point values. Works with any layout
+    void writeToPfm(const char* path) const
+    {
+        static_assert(std::is_same_v<T, glm::vec3>, "Only RGB float images can be written to PFM files");
+
+        FILE* file = std::fopen(path, "wb");
+        if (file == nullptr) throw std::runtime_error(fmt::format("Failed to write image file: {}", path));
+
+        // A negative scale marks the data as little-endian
+        std::fprintf(file, "PF\n%d %d\n-1.0\n", m_size.x, m_size.y);
+
+        std::vector<glm::vec3> row(m_size.x);
+        bool success = true;
+        for (int y = m_size.y - 1; y >= 0 && success; --y)
+        {
+            for (int x = 0; x < m_size.x; ++x) row[x] = load(glm::ivec2(x, y));
+            success = std::fwrite(row.data(), sizeof(glm::vec3), m_size.x, file) == (std::size_t) m_size.x;
+        }
+
+        if (std::fclose(file) != 0 || !success)
+            throw std::runtime_error(fmt::format("Failed to write image file: {}", path));
+    }
+
     // Returns the data stored in the pixel at `pos`.
     T load(glm::ivec2 pos) const
     {
         assert(glm::clamp(pos, glm::ivec2(0), m_size) == pos);
         int pixelIndex = getPixelIndex(pos);
-        return m_data[pixelIndex];
+
+        T data;
+        unpackPixel(m_data[pixelIndex], data);
+        return data;
     }
 
     // Stores the data in the pixel at `pos`.
@@ -73,59 +244,92 @@ public:
     {
         assert(clamp(pos, glm::ivec2(0), m_size) == pos);
         int pixelIndex = getPixelIndex(pos);
-        m_data[pixelIndex] = data;
+        packPixel(data, m_data[pixelIndex]);
     }
 
     // Executes f in parallel for each pixel in the image and stores the result in that pixel. The
     // The function's parameter is the position of that pixel on the image in UV space. Using this
     // function is similar to running a fragment shader for each pixel on an image
+    //
+    // The image is processed in 8x8 tiles, visited in Z-order within each tile and with the tiles
+    // themselves visited in Z-order. Threads take chunkSize tiles at a time from the pool, so the
+    // pixels a thread processes together are close on the image, and so are the parts of the scene
+    // they see, while threads that finish early keep taking work until none is left
+    //
+    // The tiles of a mapped image are released a block of imageReleaseTileCount at a time, once
+    // every tile in the block is done, so that however large the image is, only the part being
+    // worked on stays in memory
     template <typename function>
-    void process(const function& f, int groupCount)
+    void process(const function& f, ThreadPool& pool, int chunkSize = 4)
     {
-        assert(groupCount >= 1);
+        TileReleaseTracker releaseTracker(0, m_mapping ? getTileCount() : 0);
 
-        const float pixelCount = m_size.x * m_size.y;
-        const float groupSize  = (float) (pixelCount / groupCount);
+        pool.parallelFor(getTileCount(), chunkSize, [&] (int tileIndex)
+        {
+            processTile(tileIndex, f);
 
-        std::vector<std::thread> threads;
-        threads.reserve(groupCount);
+            int blockBegin, blockEnd;
+            if (m_mapping && releaseTracker.finish(tileIndex, blockBegin, blockEnd)) releaseTiles(blockBegin, blockEnd);
+        });
 
-        auto processGroup = [] (Image<T>* image, const function& f, int begin, int end)
-        {
-            for (int pixelIndex = begin; pixelIndex < end; ++pixelIndex)
-            {
-                // Get the position of the pixel in the image from its index
-                glm::ivec2 pos;
-                pos.y = pixelIndex / image->m_size.x;
-                pos.x = pixelIndex - image->m_size.x * pos.y;
-
-                // Call the function for this pixel
-                T result = f(pos);
-
-                // Store the result in the image
-                image->m_data[pixelIndex] = result;
-            }
-        };
-
-        // Start the threads
-        for (int groupIndex = 0; groupIndex < groupCount; ++groupIndex)
-        {
-            // Calculate the indices of the first and last pixels in this group;
-            const int begin = groupIndex * groupSize;
-            const int end = glm::max(begin + groupSize, pixelCount);
+        release();
+    }
 
-            // Create a new thread inside of the thread list to process this group of pixels
-            threads.emplace_back(processGroup, this, f, begin, end);
-        }
+    // Executes f for each pixel in one of the tiles that process() divides the image into, in
+    // Z-order, and stores the results. Used to schedule the tiles of several images together
+    template <typename function>
+    void processTile(int tileIndex, const function& f)
+    {
+        glm::ivec2 begin, end;
+        m_tiles.getTile(tileIndex, begin, end);
 
-        // Wait for all of the threads to finish
-        for (int groupIndex = 0; groupIndex < groupCount; ++groupIndex)
+        for (uint i = 0; i < imageTileSize * imageTileSize; ++i)
         {
-            threads[groupIndex].join();
+            // Get the position of the pixel in the image from its Z-order index in the tile
+            glm::ivec2 pos = begin + glm::ivec2(mortonDecode(i));
+            if (pos.x >= end.x || pos.y >= end.y) continue; // Tiles may overhang the edges of the image
+
+            // Call the function for this pixel and store the result in the image
+            packPixel(T(f(pos)), m_data[getPixelIndex(pos)]);
         }
     }
 
+    // Returns the number of tiles that process() divides the image into
+    int getTileCount() const { return m_tiles.getTileCount(); }
+
+    // Lets the operating system drop the pixels of the tiles [begin, end), in the order process()
+    // visits them, of a mapped image from memory until they are next used. Only the tiled layouts
+    // store tiles contiguously, so this does nothing for row-major images, or for images held in
+    // memory
+    void releaseTiles(int begin, int end)
+    {
+        if (!m_mapping || m_layout == PixelLayout::RowMajor) return;
+
+        constexpr std::size_t tileBytes = imageTileSize * imageTileSize * sizeof(Storage);
+        m_mapping->release(begin * tileBytes, (end - begin) * tileBytes);
+    }
+
+    // Lets the operating system drop all pixels of a mapped image from memory until they are next used
+    void release()
+    {
+        if (m_mapping) m_mapping->release(0, getStorageBytes());
+    }
+
+    glm::ivec2 getSize() const { return m_size; }
+
+    PixelLayout getLayout() const { return m_layout; }
+
+    // Returns the backing array, in the image's layout and storage format, eg to save the image
+    // exactly as it is and restore it later
+    Storage* getStorage() { return m_data; }
+    const Storage* getStorage() const { return m_data; }
+
+    // Returns the size of the backing array in bytes
+    std::size_t getStorageBytes() const { return (std::size_t) getStorageSize() * sizeof(Storage); }
+
+    // Returns the raw pixel data. Only meaningful for row-major images
     const unsigned char* data() {
+        assert(m_layout == PixelLayout::RowMajor);
         return reinterpret_cast<unsigned char*>(m_data);
     }
 
@@ -133,10 +337,51 @@ private:
     // Assigns a unique integer location to each pixel, its location in the backing array
     int getPixelIndex(glm::ivec2 pos) const
     {
-        return pos.y * m_size.x + pos.x;
+        if (m_layout == PixelLayout::RowMajor) return pos.y * m_size.x + pos.x;
+
+        glm::ivec2 tile  = pos / imageTileSize;
+        glm::ivec2 local = pos % imageTileSize;
+
+        // Tiles are stored in the order process() visits them, so that the tiles it has finished
+        // with occupy a contiguous range that can be released
+        int tileIndex = m_tiles.getTileIndex(tile);
+        int tileOffset = m_layout == PixelLayout::Tiled ? local.y * imageTileSize + local.x : (int) mortonEncode(local.x, local.y);
+
+        return tileIndex * imageTileSize * imageTileSize + tileOffset;
+    }
+
+    // Returns the number of tiles needed to cover the image horizontally and vertically
+    glm::ivec2 getTileDimensions() const
+    {
+        return (m_size + imageTileSize - 1) / imageTileSize;
+    }
+
+    // Deletes the backing array, or unmaps it for mapped images
+    void freeData()
+    {
+        if (m_mapping) m_mapping.reset();
+        else if (m_data != nullptr) delete [] m_data;
+
+        m_data = nullptr;
+    }
+
+    // Returns the number of elements in the backing array, which is padded to whole tiles for the
+    // tiled layouts
+    int getStorageSize() const
+    {
+        if (m_layout == PixelLayout::RowMajor) return m_size.x * m_size.y;
+
+        glm::ivec2 tileCount = getTileDimensions();
+        return tileCount.x * tileCount.y * imageTileSize * imageTileSize;
     }
 
     glm::ivec2 m_size;
 
-    T* m_data;
+    PixelLayout m_layout;
+
+    TileGrid m_tiles; // The tiles that process() divides the image into
+
+    Storage* m_data;
+
+    std::unique_ptr<MappedBuffer> m_mapping; // The file holding m_data for mapped images
 };
@@ -0,0 +1,92 @@
+#pragma once
+
+#include <cstdint>
+#include <vector>
+
+#include "shape.hh"
+#include "utility.hh"
+
+/*
+ * An emissive triangle, with what is needed to sample a point on it and weigh its contribution
+ */
+struct LightTriangle
+{
+    glm::vec3 v0, edge1, edge2; // First vertex and the two edges leaving it
+    glm::vec3 normal;           // Unit geometric normal
+    float area;
+    glm::vec3 emission;         // Emitted radiance, the same from both sides
+    uint triangleIndex;         // Index of the triangle in the scene
+    std::uint64_t bitTrail;     // Path from the root of the light tree to this light's leaf, one bit per level (1 = right)
+
+    Box getBoundingBox() const { return TriangleIntersectionData(v0, v0 + edge1, v0 + edge2).getBoundingBox(); }
+};
+
+/*
+ * A point sampled on a light
+ */
+struct LightSample
+{
+    glm::vec3 pos;      // Position on the light
+    glm::vec3 normal;   // Geometric normal of the light at pos
+    glm::vec3 emission; // Radiance emitted towards the shading point
+    float pdf;          // Probability density of choosing this point, with respect to area on the light
+};
+
+/*
+ * A hierarchy of the emissive triangles in a scene, used to pick a light for each shading point
+ * with probability roughly proportional to its contribution there (Estevez and Kulla 2018,
+ * "Importance Sampling of Many Lights with Adaptive Tree Splitting")
+ *
+ * Each node bounds the positions and normals of the lights below it and stores their total power.
+ * From a shading point, the importance of a node is its power divided by the squared distance to
+ * it, scaled down by how far the lights may be turned away from the point and how far they may be
+ * below its horizon. A light is picked by walking down from the root and choosing each child with
+ * probability proportional to its importance, so the cost of a pick grows with the log of the
+ * number of lights while far away or back-facing groups are rarely chosen
+ */
+class LightTree
+{
+public:
+    // Builds the tree over the given lights. Their bit trails are filled in, and they are
+    // reordered so that triangleIndex maps back to the scene
+    void build(std::vector<LightTriangle> lights);
+
+    void clear() { m_nodes.clear(); m_lights.clear(); }
+
+    bool empty() const { return m_lights.empty(); }
+
+    const std::vector<LightTriangle>& getLights() const { return m_lights; }
+
+    // Picks a light for the shading point `pos` with normal `normal`, or a zero normal if light from
+    // every direction matters there. Sets `pmf` to the probability of picking it and returns its
+    // index, or -1 if no light can contribute
+    int pick(const glm::vec3& pos, const glm::vec3& normal, float random, float& pmf) const;
+
+    // Returns the probability that pick() chooses the light at lightIndex from the same shading point
+    float getPickProbability(const glm::vec3& pos, const glm::vec3& normal, int lightIndex) const;
+
+    // Samples a point on a light uniformly by area
+    LightSample sample(int lightIndex, const glm::vec2& random) const;
+
+private:
+    struct Node
+    {
+        Box bounds;       // Bounds of the lights' positions
+        glm::vec3 axis;   // Axis of a double cone containing the lights' normals
+        float coneAngle;  // Half-angle of the cone, up to pi/2
+        float power;      // Total emitted power of the lights
+        uint offset;      // Index of the right child for interior nodes, or of the light for leaves
+        bool isLeaf;
+    };
+
+    // Returns an estimate of the contribution of a node's lights to the shading point
+    static float getImportance(const Node& node, const glm::vec3& pos, const glm::vec3& normal);
+
+    // Returns the probability of choosing the left child of the interior node at nodeIndex
+    float getLeftProbability(uint nodeIndex, const glm::vec3& pos, const glm::vec3& normal) const;
+
+    uint buildNode(uint begin, uint end, std::uint64_t bitTrail, int depth);
+
+    std::vector<Node> m_nodes;           // Nodes in depth-first order; the left child follows its parent
+    std::vector<LightTriangle> m_lights; // Lights in the order of the leaves
+};
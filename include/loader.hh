@@ -0,0 +1,108 @@
+#pragma once
+
+#include <atomic>
+#include <fstream>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "scene.hh"
+#include "shape.hh"
+
+/*
+ * Loads an OBJ model into a scene on a background thread, so that the scene can be displayed and
+ * rendered while the rest of the model is still being read
+ *
+ * The model is parsed a line at a time, and its faces are collected into triangles. Whenever the
+ * triangles read since the last build outnumber those built before, the loading thread builds a
+ * BVH over all of them, so that the total time spent building stays proportional to one build of
+ * the whole model. update() is called from the thread that owns the scene, between frames, to
+ * swap the latest of these meshes into the scene, which takes no longer than adding the model's
+ * materials and building the scene's light tree
+ *
+ * The model's triangles replace any triangles in the scene, and its materials and objects are
+ * added after those already in the scene, so nothing else may add materials or objects to the
+ * scene while it loads
+ */
+class SceneLoader
+{
+public:
+    // Starts loading the model at `path` into `scene`
+    SceneLoader(const std::string& path, Scene& scene);
+
+    // Stops loading, if the model has not been read yet
+    ~SceneLoader();
+
+    SceneLoader(const SceneLoader&) = delete;
+    SceneLoader& operator=(const SceneLoader&) = delete;
+
+    // Swaps the latest mesh built by the loading thread into the scene, if there is a new one.
+    // Returns true if the scene changed
+    bool update(Scene& scene);
+
+    // Waits until the whole model has been read, then adds the rest of it to the scene
+    void finish(Scene& scene);
+
+    // Returns true once the whole model has been read and added to the scene
+    bool isComplete() const { return m_complete; }
+
+    // Returns the fraction of the model file that has been read
+    float getProgress() const { return m_progress; }
+
+    // Returns false if the model could not be read, once it is complete
+    bool succeeded() const { return m_succeeded; }
+
+    // Return the warnings and errors from reading the model, once it is complete
+    const std::string& getWarning() const { return m_warning; }
+    const std::string& getError() const { return m_error; }
+
+private:
+    void load();
+
+    // Builds a mesh of the triangles read so far and hands it over to the thread that owns the
+    // scene. The last mesh, built once the whole model has been read, takes the triangles rather
+    // than copying them
+    void buildMesh(bool last);
+
+    // Adds the waiting materials and objects to the scene and swaps in the latest mesh
+    void apply(Scene& scene);
+
+    // Read only by the loading thread
+    std::string m_path;
+    std::ifstream m_file;
+    tinyobj::attrib_t m_attrib;     // Vertex positions, normals and texture coordinates read so far
+    TriangleMesh m_mesh;            // Triangles read so far, in the order they were read
+    std::size_t m_builtCount = 0;   // Number of triangles in the last mesh built
+    std::size_t m_progressCount = 0; // Number of triangles read when the progress was last updated
+    int m_materialId = -1;          // Material of the faces being read
+    std::string m_objectName;       // Name of the object that the next face starts, if m_newObject is set
+    bool m_newObject = true;        // Whether the next face starts a new object
+    std::streamoff m_fileSize = 0;
+    bool m_lazyBvh;                 // Whether the meshes' BVHs are built lazily, as the scene's are
+
+    // Indices in the scene, fixed when loading starts
+    uint m_defaultMaterialIndex; // Material for faces without one. The model's materials follow it
+    uint m_objectOffset;         // Index of the model's first object
+
+    // Shared between the threads, guarded by m_mutex
+    std::mutex m_mutex;
+    TriangleMesh m_builtMesh;                     // Latest mesh built, if m_meshReady is set
+    bool m_meshReady = false;                     // Whether m_builtMesh is waiting to be swapped into the scene
+    std::vector<tinyobj::material_t> m_materials; // Materials of the model's material libraries
+    std::vector<std::string> m_objectNames;       // Names of the model's objects
+    std::string m_warning;
+    std::string m_error;
+    bool m_read = false; // Whether m_builtMesh is the last one
+
+    // Used only by the thread that owns the scene
+    std::size_t m_addedMaterialCount = 0; // Number of materials of m_materials added to the scene
+    std::size_t m_addedObjectCount = 0;   // Number of objects of m_objectNames added to the scene
+
+    std::atomic<bool> m_complete { false };
+    std::atomic<bool> m_succeeded { false };
+    std::atomic<bool> m_cancelled { false };
+    std::atomic<float> m_progress { 0.0f };
+
+    std::thread m_thread;
+};
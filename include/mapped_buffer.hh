@@ -0,0 +1,44 @@
+#pragma once
+
+#include <cstddef>
+#include <string>
+
+/*
+ * A block of memory backed by a temporary file rather than by swap, for images too large to keep
+ * in memory
+ *
+ * Pages of the file are read in when first touched and may be written back and dropped by the
+ * operating system whenever memory is short, so only the parts being worked on need to stay
+ * resident. release() drops pages straight away. The file is deleted when the buffer is destroyed,
+ * or by the operating system if the program exits first
+ */
+class MappedBuffer
+{
+public:
+    // Maps a zero-filled temporary file of `size` bytes. Throws std::runtime_error on failure
+    explicit MappedBuffer(std::size_t size);
+    ~MappedBuffer();
+
+    MappedBuffer(const MappedBuffer&) = delete;
+    MappedBuffer& operator=(const MappedBuffer&) = delete;
+
+    void* data() const { return m_data; }
+    std::size_t size() const { return m_size; }
+
+    // Tells the operating system that the pages wholly inside [offset, offset + size) will not be
+    // needed for a while, so they are written back and dropped from memory. Their contents are kept
+    void release(std::size_t offset, std::size_t size);
+
+    // Sets the directory the temporary files are created in. Defaults to the system's temporary
+    // directory
+    static void setDirectory(const std::string& directory);
+
+private:
+    void* m_data = nullptr;
+    std::size_t m_size = 0;
+
+#if defined(_WIN32)
+    void* m_file = nullptr;
+    void* m_mapping = nullptr;
+#endif
+};
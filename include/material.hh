@@ -12,4 +12,23 @@ struct Material
     float refractiveIndex   = 1.5f;            // For transparent materials; index of refraction of the surface
     float roughness         = 0.1f;            // The material's roughness, with 0.0 representing an ideally smooth surface and 1.0 representing a very rough surface
     bool isOpaque           = true;            // Whether the material is opaque
+    int diffuseTexture      = -1;              // Index of the texture multiplying the diffuse albedo in the scene's texture cache, or -1 for none
+    int roughnessTexture    = -1;              // Index of the texture multiplying the roughness in the scene's texture cache, or -1 for none
+};
+
+/*
+ * The parts of the BSDF that a set of materials use. The renderer traces paths with a version of
+ * the path tracer compiled for exactly these, so that scenes without glass or shiny surfaces do not
+ * pay for them
+ */
+struct MaterialFeatures
+{
+    bool transmission = false; // Whether any material is transparent
+    bool specular     = false; // Whether any opaque material has a specular layer
+
+    void add(const Material& material)
+    {
+        transmission |= !material.isOpaque;
+        specular     |= material.isOpaque && material.specular != glm::vec3(0.0f);
+    }
 };
@@ -0,0 +1,212 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "utility.hh"
+
+/*
+ * A fixed set of worker threads that execute parallel loops
+ *
+ * The threads are started once and sleep between loops, so a loop costs a wake-up rather than a
+ * thread creation per thread. Work is handed out in chunks of consecutive indices from a shared
+ * counter, so faster threads take more chunks and no thread is left idle while another has a
+ * long queue of work. The calling thread works on the loop too
+ */
+class ThreadPool
+{
+public:
+    // Creates a pool that runs loops on threadCount threads, including the calling thread
+    explicit ThreadPool(int threadCount)
+    {
+        for (int i = 1; i < threadCount; ++i) m_workers.emplace_back([this] { workerLoop(); });
+    }
+
+    ~ThreadPool()
+    {
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_stop = true;
+        }
+
+        m_wakeCondition.notify_all();
+        for (auto& worker : m_workers) worker.join();
+    }
+
+    ThreadPool(const ThreadPool&) = delete;
+    ThreadPool& operator=(const ThreadPool&) = delete;
+
+    int getThreadCount() const { return (int) m_workers.size() + 1; }
+
+    // Returns the number of threads to use when none is configured: one per hardware thread
+    static int getDefaultThreadCount()
+    {
+        return glm::max((int) std::thread::hardware_concurrency(), 1);
+    }
+
+    // Calls f(index) for every index in [0, count), handing out chunkSize consecutive indices at a
+    // time. Returns once every call has finished
+    template <typename Function>
+    void parallelFor(int count, int chunkSize, const Function& f)
+    {
+        if (count <= 0) return;
+
+        Job job;
+        job.context = &f;
+        job.invoke = [] (const void* context, int begin, int end)
+        {
+            const Function& f = *static_cast<const Function*>(context);
+            for (int index = begin; index < end; ++index) f(index);
+        };
+        job.count = count;
+        job.chunkSize = glm::max(chunkSize, 1);
+
+        run(job);
+    }
+
+private:
+    // A loop, with the loop body type-erased so that the workers can call it
+    struct Job
+    {
+        const void* context;                       // The loop body
+        void (*invoke)(const void*, int, int);     // Calls the loop body for indices [begin, end)
+        int count;                                 // Number of indices
+        int chunkSize;                             // Number of indices handed out at a time
+    };
+
+    // Runs chunks of the current job until there are none left
+    void work(const Job& job)
+    {
+        while (true)
+        {
+            int begin = m_nextIndex.fetch_add(job.chunkSize, std::memory_order_relaxed);
+            if (begin >= job.count) break;
+
+            job.invoke(job.context, begin, glm::min(begin + job.chunkSize, job.count));
+        }
+    }
+
+    void run(const Job& job)
+    {
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_job = job;
+            m_nextIndex = 0;
+            m_busyWorkers = (int) m_workers.size();
+            ++m_generation;
+        }
+
+        m_wakeCondition.notify_all();
+
+        work(job);
+
+        // Wait for the workers to finish their last chunks
+        std::unique_lock<std::mutex> lock(m_mutex);
+        m_doneCondition.wait(lock, [this] { return m_busyWorkers == 0; });
+    }
+
+    void workerLoop()
+    {
+        std::uint64_t seenGeneration = 0;
+
+        while (true)
+        {
+            Job job;
+
+            {
+                std::unique_lock<std::mutex> lock(m_mutex);
+                m_wakeCondition.wait(lock, [&] { return m_stop || m_generation != seenGeneration; });
+
+                if (m_stop) return;
+
+                seenGeneration = m_generation;
+                job = m_job;
+            }
+
+            work(job);
+
+            {
+                std::lock_guard<std::mutex> lock(m_mutex);
+                if (--m_busyWorkers == 0) m_doneCondition.notify_one();
+            }
+        }
+    }
+
+    std::vector<std::thread> m_workers;
+    std::mutex m_mutex;
+    std::condition_variable m_wakeCondition;   // Signalled when a job starts or the pool stops
+    std::condition_variable m_doneCondition;   // Signalled when the last worker finishes a job
+    Job m_job;                                 // The current job
+    std::uint64_t m_generation = 0;            // Incremented for every job so workers can tell a new job from the last one
+    std::atomic<int> m_nextIndex { 0 };        // First index of the next chunk to be handed out
+    int m_busyWorkers = 0;                     // Workers that have not yet finished the current job
+    bool m_stop = false;
+};
+
+/*
+ * A 2D range of integer positions, divided into square tiles which are visited in Z-order, so
+ * that tiles processed one after another (and by neighbouring chunks) are close together
+ */
+class TileGrid
+{
+public:
+    TileGrid(glm::ivec2 size = glm::ivec2(0), int tileSize = 8) :
+        m_size(size),
+        m_tileSize(tileSize)
+    {
+        glm::ivec2 tileCount = (size + tileSize - 1) / tileSize;
+
+        for (int y = 0; y < tileCount.y; ++y)
+            for (int x = 0; x < tileCount.x; ++x)
+                m_tileOrder.emplace_back(x, y);
+
+        std::sort(m_tileOrder.begin(), m_tileOrder.end(), [] (glm::ivec2 a, glm::ivec2 b)
+        {
+            return mortonEncode(a.x, a.y) < mortonEncode(b.x, b.y);
+        });
+
+        m_tileIndices.resize(m_tileOrder.size());
+        for (int i = 0; i < (int) m_tileOrder.size(); ++i)
+            m_tileIndices[m_tileOrder[i].y * tileCount.x + m_tileOrder[i].x] = i;
+    }
+
+    int getTileCount() const { return (int) m_tileOrder.size(); }
+
+    // Returns the index in Z-order of the tile with the given coordinates
+    int getTileIndex(glm::ivec2 tile) const
+    {
+        return m_tileIndices[tile.y * ((m_size.x + m_tileSize - 1) / m_tileSize) + tile.x];
+    }
+
+    // Sets [begin, end) to the range of positions covered by the tile at tileIndex in Z-order.
+    // Tiles at the edges are clipped to the range
+    void getTile(int tileIndex, glm::ivec2& begin, glm::ivec2& end) const
+    {
+        begin = m_tileOrder[tileIndex] * m_tileSize;
+        end   = glm::min(begin + m_tileSize, m_size);
+    }
+
+    // Calls f(begin, end) for every tile in parallel, where [begin, end) is the range of positions
+    // covered by the tile. chunkSize tiles are handed to a thread at a time
+    template <typename Function>
+    void parallelFor(ThreadPool& pool, int chunkSize, const Function& f) const
+    {
+        pool.parallelFor(getTileCount(), chunkSize, [&] (int tileIndex)
+        {
+            glm::ivec2 begin, end;
+            getTile(tileIndex, begin, end);
+            f(begin, end);
+        });
+    }
+
+private:
+    glm::ivec2 m_size;
+    int m_tileSize;
+    std::vector<glm::ivec2> m_tileOrder; // Tile coordinates in Z-order
+    std::vector<int> m_tileIndices;      // Index in Z-order of each tile, row by row
+};
@@ -0,0 +1,213 @@
+#pragma once
+
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+
+#if defined(__F16C__)
+#include <immintrin.h>
+#endif
+
+#include "utility.hh"
+
+/*
+ * Compact storage formats for image pixels
+ *
+ * An Image<T, Storage> holds its pixels as Storage and converts them to and from T in load() and
+ * store(), using the packPixel() and unpackPixel() overloads below. Intermediate images that are
+ * only read and written a few times per frame can be stored in these formats to cut the memory
+ * traffic of each pass, at the cost of precision
+ */
+
+// Largest finite half-precision value. Larger values are clamped to it when packed, so that
+// bright HDR pixels saturate instead of turning into infinities
+constexpr float maxHalf = 65504.0f;
+
+// Three half-precision floats. 6 bytes instead of 12, with 11 bits of precision and a range of
+// +-65504. Suitable for signed data such as normals
+struct Half3
+{
+    std::uint16_t r, g, b;
+};
+
+// Four half-precision floats. 8 bytes instead of 16
+struct Half4
+{
+    std::uint16_t r, g, b, a;
+};
+
+// Three unsigned floats with 9-bit mantissas and a shared 5-bit exponent, packed into 4 bytes.
+// Suitable for non-negative colours such as radiance and albedo, where the smaller components
+// only need to be accurate relative to the largest
+struct Rgb9e5
+{
+    std::uint32_t bits;
+};
+
+// Half-precision conversion
+
+inline std::uint32_t floatBits(float value) { std::uint32_t bits; std::memcpy(&bits, &value, 4); return bits; }
+inline float bitsToFloat(std::uint32_t bits) { float value; std::memcpy(&value, &bits, 4); return value; }
+
+// Converts a float to half precision, rounding to nearest even
+// Source: https://gist.github.com/rygorous/2156668 (float_to_half_fast3_rtne)
+inline std::uint16_t floatToHalf(float value)
+{
+#if defined(__F16C__)
+    return _cvtss_sh(value, _MM_FROUND_TO_NEAREST_INT);
+#else
+    std::uint32_t bits = floatBits(value);
+    std::uint32_t sign = (bits >> 16) & 0x8000;
+    bits &= 0x7fffffff;
+
+    std::uint32_t half;
+    if (bits >= 0x47800000)
+    {
+        // Too large for a half: infinity, or NaN if it was NaN
+        half = bits > 0x7f800000 ? 0x7e00 : 0x7c00;
+    }
+    else if (bits < 0x38800000)
+    {
+        // Subnormal or zero. Adding 0.5 shifts the mantissa into place with correct rounding
+        half = floatBits(bitsToFloat(bits) + 0.5f) - 0x3f000000;
+    }
+    else
+    {
+        // Normal: rebias the exponent and round the mantissa to nearest even
+        std::uint32_t mantissaOdd = (bits >> 13) & 1;
+        bits += ((15u - 127u) << 23) + 0xfff + mantissaOdd;
+        half = bits >> 13;
+    }
+
+    return (std::uint16_t) (half | sign);
+#endif
+}
+
+// Converts a half-precision float to a float
+// Source: https://gist.github.com/rygorous/2156668 (half_to_float)
+inline float halfToFloat(std::uint16_t half)
+{
+#if defined(__F16C__)
+    return _cvtsh_ss(half);
+#else
+    constexpr std::uint32_t shiftedExponent = 0x7c00 << 13;
+
+    std::uint32_t bits = (half & 0x7fff) << 13;
+    std::uint32_t exponent = bits & shiftedExponent;
+    bits += (127 - 15) << 23;
+
+    if (exponent == shiftedExponent)
+    {
+        bits += (128 - 16) << 23; // Infinity or NaN
+    }
+    else if (exponent == 0)
+    {
+        // Subnormal: renormalize by subtracting the implicit leading one
+        bits += 1 << 23;
+        bits = floatBits(bitsToFloat(bits) - bitsToFloat(113 << 23));
+    }
+
+    return bitsToFloat(bits | (std::uint32_t) (half & 0x8000) << 16);
+#endif
+}
+
+// Pixel conversion. Images whose storage type is the same as their pixel type copy the pixel
+
+template <typename T>
+inline void packPixel(const T& value, T& packed) { packed = value; }
+
+template <typename T>
+inline void unpackPixel(const T& packed, T& value) { value = packed; }
+
+inline void packPixel(const glm::vec4& value, Half4& packed)
+{
+    glm::vec4 clamped = glm::clamp(value, -maxHalf, maxHalf);
+
+#if defined(__F16C__)
+    // Convert all four components with one instruction
+    _mm_storel_epi64(reinterpret_cast<__m128i*>(&packed), _mm_cvtps_ph(_mm_loadu_ps(&clamped.x), _MM_FROUND_TO_NEAREST_INT));
+#else
+    packed = { floatToHalf(clamped.x), floatToHalf(clamped.y), floatToHalf(clamped.z), floatToHalf(clamped.w) };
+#endif
+}
+
+inline void unpackPixel(const Half4& packed, glm::vec4& value)
+{
+#if defined(__F16C__)
+    _mm_storeu_ps(&value.x, _mm_cvtph_ps(_mm_loadl_epi64(reinterpret_cast<const __m128i*>(&packed))));
+#else
+    value = glm::vec4(halfToFloat(packed.r), halfToFloat(packed.g), halfToFloat(packed.b), halfToFloat(packed.a));
+#endif
+}
+
+inline void packPixel(const glm::vec3& value, Half3& packed)
+{
+    glm::vec3 clamped = glm::clamp(value, -maxHalf, maxHalf);
+    packed = { floatToHalf(clamped.x), floatToHalf(clamped.y), floatToHalf(clamped.z) };
+}
+
+inline void unpackPixel(const Half3& packed, glm::vec3& value)
+{
+    value = glm::vec3(halfToFloat(packed.r), halfToFloat(packed.g), halfToFloat(packed.b));
+}
+
+// Packs a colour into RGB9E5. Negative components become zero, and components larger than the
+// format's maximum (65408) are clamped to it
+// Source: the EXT_texture_shared_exponent specification
+inline void packPixel(const glm::vec3& value, Rgb9e5& packed)
+{
+    constexpr int mantissaBits = 9;
+    constexpr int exponentBias = 15;
+    constexpr float maxValue = 65408.0f; // (2^9 - 1) / 2^9 * 2^16
+
+    // The comparisons are arranged so that NaN becomes zero
+    glm::vec3 color;
+    for (int i = 0; i < 3; ++i) color[i] = value[i] > 0.0f ? (value[i] < maxValue ? value[i] : maxValue) : 0.0f;
+
+    float maxComponent = glm::max(color.r, glm::max(color.g, color.b));
+
+    // Choose the smallest exponent that can hold the largest component. frexp gives
+    // floor(log2(maxComponent)) + 1 exactly
+    int exponent;
+    std::frexp(maxComponent, &exponent);
+    exponent = glm::max(exponent, -exponentBias) + exponentBias;
+
+    // Rounding may carry the largest component's mantissa over to 2^9, which needs the next exponent
+    if (std::floor(std::ldexp(maxComponent, mantissaBits + exponentBias - exponent) + 0.5f) == (float) (1 << mantissaBits))
+        ++exponent;
+
+    std::uint32_t bits = (std::uint32_t) exponent << 27;
+    for (int i = 0; i < 3; ++i)
+    {
+        auto mantissa = (std::uint32_t) std::floor(std::ldexp(color[i], mantissaBits + exponentBias - exponent) + 0.5f);
+        bits |= mantissa << (mantissaBits * i);
+    }
+
+    packed.bits = bits;
+}
+
+inline void unpackPixel(const Rgb9e5& packed, glm::vec3& value)
+{
+    // Scale the mantissas by 2^(exponent - bias - mantissaBits) by building the float directly
+    float scale = bitsToFloat((std::uint32_t) ((int) (packed.bits >> 27) - 15 - 9 + 127) << 23);
+
+    value = glm::vec3(
+        (float) (packed.bits & 0x1ff),
+        (float) ((packed.bits >> 9) & 0x1ff),
+        (float) ((packed.bits >> 18) & 0x1ff)
+    ) * scale;
+}
+
+// Storage formats of the renderer's intermediate images. The accumulated radiance and luminance
+// moments are always kept in full precision, because each frame only adds a small fraction to
+// them. Define LUMOS_FULL_PRECISION_BUFFERS to store the other images as floats too, eg to check
+// how much the compact formats affect the result
+#if defined(LUMOS_FULL_PRECISION_BUFFERS)
+using CompactVec3  = glm::vec3;
+using CompactVec4  = glm::vec4;
+using CompactColor = glm::vec3;
+#else
+using CompactVec3  = Half3;  // Vectors that may be negative: normals, and albedos averaged over a few hundred samples
+using CompactVec4  = Half4;  // The denoiser's irradiance and variance between passes
+using CompactColor = Rgb9e5; // Non-negative colours that are written once and then only read, such as the denoised image
+#endif
@@ -1,7 +1,16 @@
 #pragma once
 
+#include <chrono>
+#include <memory>
+#include <utility>
+#include <vector>
+
 #include "camera.hh"
+#include "checkpoint.hh"
+#include "denoiser.hh"
+#include "guiding.hh"
 #include "image.hh"
+#include "parallel.hh"
 #include "scene.hh"
 
 class Renderer
@@ -10,25 +19,182 @@ public:
     Renderer(glm::ivec2 windowSize);
 
     void reset();                           // Resets the renderer, ready to render a new image
-    void render();                          // Traces one path for every pixel in the image
-    void display(sf::RenderWindow& window); // Displays the current image to the screen
+    void render();                          // Traces one path for every pixel in the image, finishing the current frame if renderFor() started it
+
+    // Traces paths for as many tiles of the current frame as fit in `budget` seconds, judged by the
+    // measured cost of recent tiles, so that an interactive loop stays responsive however slow the
+    // scene is. Time spent denoising since the last call is taken out of the budget. Tiles traced
+    // so far show their new sample straight away. Returns whether the call finished the frame
+    bool renderFor(double budget);
+    void display(sf::RenderWindow& window); // Displays the current image to the screen, denoising it at most every denoise_interval
     void preview(sf::RenderWindow& window); // Displays a preview of the scene to the screen (diffuse color only)
-    void saveImage(const char* path);       // Saves the current image to a file
+    void saveImage(const char* path, int viewIndex = 0); // Saves the current image of a view to a PNG file, or to a PFM file with the radiance before tone mapping
     void setScene(const Scene* scene);      // Sets the scene to be rendered
     void setCamera(const Camera* camera);   // Sets the camera used to render the scene
 
+    // Sets several cameras to render the scene from at once, each into its own view. Every frame
+    // traces one path per pixel of every view
+    void setCameras(const std::vector<const Camera*>& cameras);
+
+    // Call after moving the cameras. With reprojection enabled, the samples of each pixel whose
+    // first surface is still visible are moved to where that surface now appears, so that the image
+    // stays mostly converged; otherwise the renderer starts over
+    void updateCameras();
+
+    // Writes the state of the render to a checkpoint: the images that every view accumulates, and
+    // the state of the sampler and of the path guide. Must be called between frames, ie after
+    // render(), or after renderFor() when it finishes a frame. The images are only referred to,
+    // so nothing may render or move the cameras until the checkpoint has been saved
+    void saveCheckpoint(Checkpoint& checkpoint) const;
+
+    // Continues a render from a checkpoint written by saveCheckpoint() with the same scene, cameras
+    // (including their field of view), image size and sampling settings, so that the images come
+    // out exactly as if the render had not been interrupted. This holds with path guiding too: the
+    // checkpoint holds the guide's distributions and training sums, and the sums are in fixed point,
+    // so an uninterrupted render trains the same guide whatever order the threads record in. Call
+    // after setting the scene and cameras. Returns false, and starts the render over, if the
+    // checkpoint does not match
+    bool loadCheckpoint(Checkpoint& checkpoint);
+
+    int    getViewCount() const { return (int) m_views.size(); }
+
+    // Returns the mean radiance of the samples taken so far for a view, before denoising and tone mapping
+    const Image<glm::vec3>& getRadianceImage(int viewIndex = 0) const { return m_views[viewIndex]->radianceImage; }
+
+    int    getFrameIndex() const { return m_frameIndex; }     // Returns the number of samples taken per pixel since the image was started or the cameras moved
+    double getDenoiseTime() const { return m_denoiseTime; }   // Returns the total time spent denoising, in seconds
+
 private:
-    // Recursive path-tracing algorithm
-    glm::vec3 tracePathSegment(const Ray& ray, const glm::vec2& random, int depth, int maxDepth, bool insideTransparentMaterial);
+    // The images that the paths traced from one camera accumulate in
+    struct View
+    {
+        View(glm::ivec2 size, PixelLayout layout, ImageBacking backing);
+
+        // Let mapped images drop the tiles [begin, end) of every image, or all of them, from memory
+        void releaseTiles(int begin, int end);
+        void release();
+
+        const Camera*    camera = nullptr;
+        Image<glm::vec3> radianceImage;  // Image used to store the result of the path tracer as a floating point colour
+        Image<float>     momentImage;    // Mean squared luminance of the samples in each pixel, used to estimate their variance
+        Image<glm::vec3, CompactVec3>  albedoImage;   // Average albedo of the first surface hit in each pixel, a guide for the denoiser
+        Image<glm::vec3, CompactVec3>  normalImage;   // Average normal of the first surface hit in each pixel, a guide for the denoiser
+        Image<glm::vec3, CompactColor> denoisedImage; // The radiance image after denoising
+        Image<float>     depthImage;       // Average distance to the first surface hit in each pixel, or infinity if any path missed, used to detect disocclusions
+        Image<float>     sampleCountImage; // Number of samples accumulated in each pixel, which differs between pixels after reprojection
+        std::unique_ptr<Camera> renderedCamera; // Copy of the camera as it was when the images were last rendered
+        bool             denoiseValid = false;        // Whether denoisedImage is up-to-date with radianceImage
+    };
+
+    // Properties of the first surface hit by a path, used to guide the denoiser
+    struct FirstHit
+    {
+        glm::vec3 albedo = glm::vec3(0.0f);
+        glm::vec3 normal = glm::vec3(0.0f);
+        float depth      = inf;
+    };
+
+    // The surface that a path segment leaves from, needed to weigh the emission that the segment finds
+    struct ScatterEvent
+    {
+        glm::vec3 pos    = glm::vec3(0.0f);
+        glm::vec3 normal = glm::vec3(0.0f);
+        float bsdfPdf    = 0.0f;    // Probability density with which the BSDF, mixed with the guide, chose the segment's direction
+        bool sampledLights = false; // Whether a light was also sampled directly from this surface
+    };
+
+    // Value of the fixedDepth template parameter of the path tracer for paths whose depth is only
+    // known at run time
+    static constexpr int anyDepth = -1;
+
+    // Recursive path-tracing algorithm, which traces at most remainingDepth more bounces. If firstHit
+    // is not null, it is set from the first surface the path hits
+    //
+    // The algorithm is compiled for the material features of the scene, leaving out the code for
+    // transparent materials and specular layers unless they are used. Unless fixedDepth is anyDepth,
+    // it is also compiled for a fixed remainingDepth, so that each bounce of the path has its own copy
+    template <bool hasTransmission, bool hasSpecular, int fixedDepth>
+    glm::vec3 tracePathSegment(const Ray& ray, const glm::vec2& random, int remainingDepth, bool insideTransparentMaterial, const ScatterEvent& scatter, FirstHit* firstHit = nullptr);
+
+    // A version of the path tracer, which traces a path from the camera
+    using PathKernel = glm::vec3 (Renderer::*)(const Ray& ray, const glm::vec2& random, FirstHit* firstHit);
+
+    template <bool hasTransmission, bool hasSpecular, int fixedDepth>
+    glm::vec3 tracePath(const Ray& ray, const glm::vec2& random, FirstHit* firstHit);
+
+    // Returns a hash of the settings that change what the samples converge to or how they are
+    // taken, which a checkpoint must have been saved with to be continued
+    std::uint64_t getSettingsHash() const;
+
+    // Returns the version of the path tracer compiled for the scene's material features and the
+    // maximum path depth
+    PathKernel selectPathKernel() const;
+
+    template <bool hasTransmission, bool hasSpecular, int... depths>
+    PathKernel selectPathKernel(std::integer_sequence<int, depths...>) const;
+
+    // Samples a point on one of the scene's lights and returns the light it reflects from the opaque
+    // surface at `hit` towards -incidentDirection, weighted for multiple importance sampling against
+    // bounces that sample the guide cell guideCell with probability guideFraction
+    template <bool hasSpecular>
+    glm::vec3 sampleDirectLight(const Hit& hit, const glm::vec3& incidentDirection, const glm::vec2& random, int guideCell, float guideFraction);
+
+    // Returns the probability density of a bounce from the opaque surface at `hit` choosing direction
+    // wi, when the guide cell guideCell is sampled with probability guideFraction and the BSDF otherwise
+    template <bool hasSpecular>
+    float getScatterPdf(const Hit& hit, const glm::vec3& wo, const glm::vec3& wi, int guideCell, float guideFraction) const;
+
+    // Checks that there is something to render and starts a new frame, unless one is unfinished.
+    // Returns false if there is nothing to render
+    bool prepareFrame();
+
+    // Returns the number of tiles in a frame, counting every view's
+    int getFrameTileCount() const;
+
+    // Traces one path for every pixel in the tiles [begin, end) of the current frame, numbering the
+    // views' tiles interleaved
+    void renderTiles(int begin, int end);
+
+    // Finishes the current frame once all of its tiles have been traced
+    void finishFrame();
+
+    // Denoises a view's radiance image into its denoised image, unless it is already up-to-date
+    void updateDenoisedImage(View& view);
+
+    // Tone maps a view's radiance image, or its denoised image if denoising is enabled, into the display
+    // image. The denoised image is brought up-to-date first if `updateDenoised` is set
+    void updateDisplayImage(View& view, bool updateDenoised = true);
 
     int              m_frameIndex;     // Incremented each frame
-    int              m_groupCount;     // Number of pixel groups (threads) used by the renderer
+    int              m_sequenceOffset; // Added to the frame index to choose the random numbers of a frame, so that reprojected pixels do not repeat their samples
+    int              m_nextTile;       // Index of the first tile of the current frame that has not been traced yet
+    double           m_tileCost;       // Recent average time to trace one tile, in seconds, or 0 before any are measured
+    ThreadPool       m_threadPool;     // Threads that the image passes run on
+    int              m_chunkSize;      // Number of 8x8 tiles a thread takes from the pool at a time
     glm::vec3        m_ambient;        // Color of ambient light source
+    int              m_maxPathDepth;   // Number of bounces after which paths are terminated
     glm::ivec2       m_windowSize;     // Size of the window in pixels
-	Image<glm::vec3> m_radianceImage;  // Image used to store the result of the path tracer as a floating point colour
-	Image<u8vec4>    m_displayImage;   // The result of the path tracer as an 8-bit image, tone mapped and converted to sRGB
-	Image<u8vec4>    m_blueNoiseImage; // Image containing 2 channels of blue noise, used for the monte-carlo sampling
-	sf::Texture      m_displayTexture; // Texture used to display the image to the screen
+    PixelLayout      m_pixelLayout;    // Memory layout of the intermediate images, read from the config file once
+    ImageBacking     m_imageBacking;   // Where the intermediate images are held, read from the config file once
+	std::vector<std::unique_ptr<View>> m_views; // One view per camera, all the size of the window
+	Denoiser         m_denoiser;       // Filter used to remove noise from images with few samples
+	bool             m_denoise;        // Whether the image is denoised before it is displayed or saved
+	bool             m_sampleLights;   // Whether paths sample the scene's emissive triangles directly at opaque surfaces
+	PathGuide        m_pathGuide;      // Learned distribution of incident light, sampled alongside the BSDF
+	bool             m_pathGuiding;    // Whether bounces from opaque surfaces are guided
+	int              m_guidingResolution;     // Number of guide cells along each axis of the scene's bounds
+	int              m_guidingTrainingFrames; // Number of frames of a scene that the guide learns from
+	int              m_guidingFrameIndex;     // Number of frames the guide has learned from so far
+	bool             m_guidingTraining;       // Whether the current frame records training data for the guide
+	bool             m_reprojection;           // Whether updateCameras() reprojects the images rather than starting over
+	int              m_reprojectionMaxSamples; // Number of samples a reprojected pixel keeps at most, so that it adapts to its new view
+	std::unique_ptr<View> m_reprojectionView;  // Images that views are reprojected into, then swapped with
+	double           m_denoiseTime;    // Total time spent denoising, in seconds
+	double           m_denoiseInterval;        // Least time between denoising passes for the display, in seconds
+	double           m_unbudgetedDenoiseTime;  // Time spent denoising since renderFor() last ran, taken out of its next budget
+	std::chrono::steady_clock::time_point m_lastDenoiseTime; // When the display was last denoised, or never after the image starts over
+	std::unique_ptr<Image<u8vec4>> m_displayImage; // The result of the path tracer for one view as an 8-bit image, tone mapped and converted to sRGB. Only allocated for displaying or saving PNGs
+	sf::Texture      m_displayTexture; // Texture used to display the image to the screen, created on first display
+    std::uint64_t    m_sceneVersion;   // Version of the scene that the current image shows
     const Scene*     m_scene;          // The scene to render
-    const Camera*    m_camera;         // The camera used to render the scene
 };
\ No newline at end of file
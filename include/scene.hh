@@ -1,32 +1,470 @@
 #pragma once
 
+#include <array>
+#include <cstdint>
+#include <fstream>
+#include <map>
+#include <string>
+#include <vector>
+
+#include "arena.hh"
+#include "bvh.hh"
+#include "lights.hh"
 #include "material.hh"
 #include "shape.hh"
+#include "spheres.hh"
+#include "texture.hh"
 
 // Stores information about an intersection
 struct Hit
 {
 	glm::vec3 pos;     // Position of the point of intersection
+	float distance;    // Distance along the ray to the point of intersection
 	glm::vec3 normal;  // Normal vector at the point of intersection
 	Material material; // Material at the point of intersection
+	int lightIndex;    // Index of the hit triangle in the scene's light tree, or -1 if it is not a light in the tree
+};
+
+// A group of triangles that can be moved or removed as a whole after the scene is built, such as
+// one object in an OBJ file
+struct SceneObject
+{
+	std::string name;
+	glm::mat4 transform = glm::mat4(1.0f); // Transform from the object's pose when it was added to its current pose
+	bool removed = false;
+};
+
+// Converts one triangle of an OBJ face to vertices, from indices into the arrays of `attrib` that
+// count from 0, with -1 for none. If a corner has no normal, all three corners use the face normal,
+// and corners without texture coordinates get (-1, -1), which means no texture
+inline std::array<TriangleShape::Vertex, 3> getObjTriangle(const tinyobj::attrib_t& attrib, const std::array<tinyobj::index_t, 3>& indices)
+{
+	auto inRange = [] (int index, const std::vector<tinyobj::real_t>& values, std::size_t size)
+	{
+		return index >= 0 && ((std::size_t) index + 1) * size <= values.size();
+	};
+
+	std::array<TriangleShape::Vertex, 3> vertices;
+	bool hasNormalData = true;
+
+	for (int i = 0; i < 3; ++i)
+	{
+		const tinyobj::index_t& index = indices[i];
+		auto& vertex = vertices[i];
+
+		vertex.pos = glm::vec3(0.0f);
+		if (inRange(index.vertex_index, attrib.vertices, 3))
+			vertex.pos = glm::vec3(attrib.vertices[index.vertex_index * 3 + 0], attrib.vertices[index.vertex_index * 3 + 1], attrib.vertices[index.vertex_index * 3 + 2]);
+
+		if (inRange(index.normal_index, attrib.normals, 3))
+			vertex.normal = glm::vec3(attrib.normals[index.normal_index * 3 + 0], attrib.normals[index.normal_index * 3 + 1], attrib.normals[index.normal_index * 3 + 2]);
+		else
+			hasNormalData = false;
+
+		vertex.texCoord = glm::vec2(-1.0f);
+		if (inRange(index.texcoord_index, attrib.texcoords, 2))
+			vertex.texCoord = glm::vec2(attrib.texcoords[index.texcoord_index * 2 + 0], attrib.texcoords[index.texcoord_index * 2 + 1]);
+	}
+
+	if (!hasNormalData)
+	{
+		// If a triangle has vertices P1, P2 and P3 then its normal vector may be given by the cross
+		// product (P2 - P1) x (P3 - P1)
+		glm::vec3 normal = glm::normalize(glm::cross(vertices[1].pos - vertices[0].pos, vertices[2].pos - vertices[0].pos));
+		for (auto& vertex : vertices) vertex.normal = normal;
+	}
+
+	return vertices;
+}
+
+// The pose a triangle was added to the scene in. Moved objects are transformed from it, so that
+// rounding errors do not build up as they keep moving
+struct TriangleRestPose
+{
+	TriangleIntersectionData triangle;
+	std::array<glm::vec3, 3> normals;
+	float texCoordScale;
+};
+
+// Triangles and the BVH over them. A scene builds its triangles into one of these, and a large model
+// can be built into one on another thread, then handed to Scene::setTriangles() once it is ready
+struct TriangleMesh
+{
+	std::vector<TriangleIntersectionData> triangles; // Hot triangle data, in the order of the leaves of bvh once built
+	std::vector<TriangleShadingData> shadingData;    // Cold triangle data, parallel to triangles
+	std::vector<TriangleRestPose> restPoses;         // Parallel to triangles, or empty while no object has moved
+	WideBvh bvh;
+	Box bounds = Box::empty();                       // Bounds of the triangles, once built
+
+	// Converts a triangle's vertices to its shading data, using a material from the scene's
+	// material list and belonging to the scene object `objectIndex`
+	static TriangleShadingData getShadingData(const std::array<TriangleShape::Vertex, 3>& vertices, uint materialIndex, uint objectIndex)
+	{
+		TriangleShadingData shadingData;
+		for (int i = 0; i < 3; ++i)
+		{
+			shadingData.normals[i]   = vertices[i].normal;
+			shadingData.texCoords[i] = vertices[i].texCoord;
+		}
+		shadingData.materialIndex = materialIndex;
+		shadingData.objectIndex   = objectIndex;
+
+		// Ratio of the triangle's size in texture space to its size in world space, used to convert
+		// ray cone widths to texture footprints
+		glm::vec2 uv1 = vertices[1].texCoord - vertices[0].texCoord, uv2 = vertices[2].texCoord - vertices[0].texCoord;
+		float texCoordArea = glm::abs(uv1.x * uv2.y - uv1.y * uv2.x);
+		float worldArea    = glm::length(glm::cross(vertices[1].pos - vertices[0].pos, vertices[2].pos - vertices[0].pos));
+		shadingData.texCoordScale = worldArea > 0.0f ? glm::sqrt(texCoordArea / worldArea) : 0.0f;
+
+		return shadingData;
+	}
+
+	void add(const std::array<TriangleShape::Vertex, 3>& vertices, uint materialIndex, uint objectIndex)
+	{
+		triangles.emplace_back(vertices[0].pos, vertices[1].pos, vertices[2].pos);
+		shadingData.push_back(getShadingData(vertices, materialIndex, objectIndex));
+	}
+
+	// Builds the BVH and stores the triangles in the order of its leaves, so that each leaf refers
+	// to a contiguous range of triangles. If lazy is set, see WideBvh::build
+	void build(bool lazy)
+	{
+		std::vector<Box> boxes;
+		std::vector<uint> order;
+
+		boxes.reserve(triangles.size());
+		for (const auto& triangle : triangles) boxes.push_back(triangle.getBoundingBox());
+
+		bvh.build(boxes, order, lazy);
+
+		bounds = Box::empty();
+		for (const auto& box : boxes) bounds.grow(box);
+
+		std::vector<TriangleIntersectionData> orderedTriangles;
+		std::vector<TriangleShadingData> orderedShadingData;
+		orderedTriangles.reserve(triangles.size());
+		orderedShadingData.reserve(triangles.size());
+		for (uint index : order)
+		{
+			orderedTriangles.push_back(triangles[index]);
+			orderedShadingData.push_back(shadingData[index]);
+		}
+		triangles = std::move(orderedTriangles);
+		shadingData = std::move(orderedShadingData);
+
+		if (restPoses.empty()) return;
+
+		std::vector<TriangleRestPose> orderedRestPoses;
+		orderedRestPoses.reserve(restPoses.size());
+		for (uint index : order) orderedRestPoses.push_back(restPoses[index]);
+		restPoses = std::move(orderedRestPoses);
+	}
 };
 
 // A scene composed of many shapes. This class is responsible for performing the ray-scene
 // intersection calculation.
+//
+// Triangles are stored separately from other shapes in two arrays: the intersection data that is
+// read during BVH traversal, and the shading data that is read only for the closest hit
+//
+// Particles and point clouds are stored as sphere sets, each with its own hierarchy, which are
+// intersected after the triangles and shapes
+//
+// Objects can be transformed or removed after the scene is built. The triangle BVH is then refitted
+// rather than rebuilt, until refitting has made it too slow to traverse. Every change increments the
+// scene's version, which the renderer checks to know when to start a new image
 class Scene
 {
 public:
-	// Adds a shape instance to the scene, taking ownership of said instance
-	template <typename ShapeType>
-	void add(const ShapeType* shape)
+	// Constructs a shape in the scene's arena and adds it to the scene
+	// eg: scene.add<SphereShape>(material, origin, radius)
+	template <typename ShapeType, typename... Args>
+	const ShapeType* add(Args&&... args)
+	{
+		const ShapeType* shape = m_arena.create<ShapeType>(std::forward<Args>(args)...);
+		m_shapes.push_back(shape);
+		return shape;
+	}
+
+	// Starts a new object and returns its index. Triangles added afterwards belong to it
+	uint addObject(const std::string& name)
+	{
+		m_objects.push_back({ name });
+		return (uint) m_objects.size() - 1;
+	}
+
+	// Adds a triangle to the most recently added object, using a material from the scene's material
+	// list. Call build() afterwards to add it to the acceleration structures
+	void addTriangle(const std::array<TriangleShape::Vertex, 3>& vertices, uint materialIndex)
+	{
+		if (m_objects.empty()) addObject("");
+
+		m_triangles.emplace_back(vertices[0].pos, vertices[1].pos, vertices[2].pos);
+		m_triangleShadingData.push_back(TriangleMesh::getShadingData(vertices, materialIndex, (uint) m_objects.size() - 1));
+
+		const auto& shadingData = m_triangleShadingData.back();
+		if (!m_triangleRestPoses.empty()) m_triangleRestPoses.push_back({ m_triangles.back(), shadingData.normals, shadingData.texCoordScale });
+	}
+
+	// Adds a set of spheres to the scene and returns its index. Call build() afterwards to add it to
+	// the acceleration structures
+	uint addSphereSet(SphereSet&& spheres)
+	{
+		m_sphereSets.push_back(std::move(spheres));
+		return (uint) m_sphereSets.size() - 1;
+	}
+
+	// Adds a material to the scene's material list and returns its index
+	uint addMaterial(const Material& material)
+	{
+		m_materials.push_back(material);
+		return (uint) m_materials.size() - 1;
+	}
+
+	// Converts a material read by tinyobjloader to a Lumos material and adds it to the scene's
+	// material list, loading its textures from paths relative to baseDir. Returns its index
+	uint addMaterial(const tinyobj::material_t& tinyobjMaterial, const std::string& baseDir, std::string& warning)
 	{
-		m_shapes.emplace_back(dynamic_cast<const Shape*>(shape));
+		Material material;
+		material.diffuse         = glm::pow(toVec3((float*) tinyobjMaterial.diffuse), glm::vec3(2.2f));
+		material.specular        = glm::pow(toVec3((float*) tinyobjMaterial.specular), glm::vec3(2.2f));
+		material.emission        = glm::pow(toVec3((float*) tinyobjMaterial.ambient), glm::vec3(2.2f));
+		material.transmittance   = glm::pow(toVec3((float*) tinyobjMaterial.transmittance), glm::vec3(2.2f));
+		material.refractiveIndex = tinyobjMaterial.ior;
+		material.roughness       = tinyobjMaterial.roughness == 0.0f ? 1.0f : tinyobjMaterial.roughness;
+		material.isOpaque        = tinyobjMaterial.dissolve > 0.5f;
+
+		// tinyobjloader defaults the transmittance to zero when the file does not specify it,
+		// which would make transparent materials black
+		if (material.transmittance == glm::vec3(0.0f)) material.transmittance = glm::vec3(1.0f);
+
+		if (!tinyobjMaterial.diffuse_texname.empty())
+			material.diffuseTexture = m_textureCache.load(baseDir + tinyobjMaterial.diffuse_texname, true, warning);
+
+		if (!tinyobjMaterial.roughness_texname.empty())
+			material.roughnessTexture = m_textureCache.load(baseDir + tinyobjMaterial.roughness_texname, false, warning);
+
+		return addMaterial(material);
 	}
 
 	// Clears the scene, deleting all existing shapes
 	void clear()
 	{
 		m_shapes.clear();
+		m_arena.clear();
+		m_triangles.clear();
+		m_triangleShadingData.clear();
+		m_triangleRestPoses.clear();
+		m_materials.clear();
+		m_textureCache.clear();
+		m_triangleBvh.clear();
+		m_shapeBvh.clear();
+		m_sphereSets.clear();
+		m_lightTree.clear();
+		m_materialFeatures = MaterialFeatures();
+		m_objects.clear();
+		m_bounds = Box::empty();
+		++m_version;
+	}
+
+	// Sets whether build() builds the triangle BVH lazily, leaving the subtrees below its top levels
+	// to be built by the first ray that reaches them. This gets large scenes on screen sooner, and
+	// parts of them that no ray reaches are never built
+	void setLazyBvh(bool lazy) { m_lazyBvh = lazy; }
+
+	// Returns whether build() builds the triangle BVH lazily
+	bool getLazyBvh() const { return m_lazyBvh; }
+
+	// Builds the acceleration structures over all triangles and shapes in the scene. Must be
+	// called after shapes are added and before the scene is rendered
+	void build()
+	{
+		TriangleMesh mesh;
+		mesh.triangles = std::move(m_triangles);
+		mesh.shadingData = std::move(m_triangleShadingData);
+		mesh.restPoses = std::move(m_triangleRestPoses);
+
+		// Drop the triangles of removed objects, which were only collapsed until now
+		std::size_t keptCount = 0;
+		for (std::size_t i = 0; i < mesh.triangles.size(); ++i)
+		{
+			if (m_objects[mesh.shadingData[i].objectIndex].removed) continue;
+
+			mesh.triangles[keptCount] = mesh.triangles[i];
+			mesh.shadingData[keptCount] = mesh.shadingData[i];
+			if (!mesh.restPoses.empty()) mesh.restPoses[keptCount] = mesh.restPoses[i];
+			++keptCount;
+		}
+		mesh.triangles.resize(keptCount);
+		mesh.shadingData.resize(keptCount);
+		if (!mesh.restPoses.empty()) mesh.restPoses.resize(keptCount);
+
+		mesh.build(m_lazyBvh);
+		setTriangles(std::move(mesh));
+	}
+
+	// Replaces the scene's triangles with a mesh that has already been built, and builds the rest of
+	// the acceleration structures. The shading data's material and object indices refer to the
+	// scene's materials and objects, which must have been added first. Triangles without rest poses
+	// must be in the poses of their objects' transforms
+	void setTriangles(TriangleMesh&& mesh)
+	{
+		m_triangles = std::move(mesh.triangles);
+		m_triangleShadingData = std::move(mesh.shadingData);
+		m_triangleRestPoses = std::move(mesh.restPoses);
+		m_triangleBvh = std::move(mesh.bvh);
+
+		// Bound the whole scene, starting with the triangles
+		m_bounds = mesh.bounds;
+
+		// Build a BVH over the other shapes too, storing them in the order of its leaves
+		std::vector<Box> boxes;
+		std::vector<uint> order;
+		for (const auto& shape : m_shapes) boxes.push_back(shape->getBoundingBox());
+
+		for (const auto& box : boxes) m_bounds.grow(box);
+
+		m_shapeBvh.build(boxes, order);
+
+		std::vector<const Shape*> orderedShapes;
+		orderedShapes.reserve(m_shapes.size());
+		for (uint index : order) orderedShapes.push_back(m_shapes[index]);
+		m_shapes = std::move(orderedShapes);
+
+		// Sphere sets have their own hierarchies, which are only rebuilt when spheres are added
+		for (auto& spheres : m_sphereSets)
+		{
+			spheres.build();
+			m_bounds.grow(spheres.getBounds());
+		}
+
+		buildLightTree();
+
+		// Find the parts of the BSDF that the scene's materials use
+		m_materialFeatures = MaterialFeatures();
+		for (const auto& material : m_materials) m_materialFeatures.add(material);
+		for (const auto& shape : m_shapes) shape->addMaterialFeatures(m_materialFeatures);
+
+		++m_version;
+	}
+
+	// Moves an object from its current pose to `transform`, which is relative to the pose it was
+	// added in
+	void setObjectTransform(uint objectIndex, const glm::mat4& transform)
+	{
+		SceneObject& object = m_objects[objectIndex];
+		if (object.removed) return;
+
+		// Transform the triangles from the poses they were added in rather than from their current
+		// poses, so that rounding errors do not build up as the object keeps moving. Those poses are
+		// only kept once the first object moves, when every object is still in them
+		if (m_triangleRestPoses.empty())
+		{
+			m_triangleRestPoses.reserve(m_triangles.size());
+			for (std::size_t i = 0; i < m_triangles.size(); ++i)
+				m_triangleRestPoses.push_back({ m_triangles[i], m_triangleShadingData[i].normals, m_triangleShadingData[i].texCoordScale });
+		}
+
+		// Normals are transformed by the inverse transpose so that they stay perpendicular to the
+		// surface under non-uniform scaling
+		glm::mat3 normalTransform = glm::transpose(glm::inverse(glm::mat3(transform)));
+		object.transform = transform;
+
+		auto transformPoint = [&] (const glm::vec3& point) { return xyz(transform * glm::vec4(point, 1.0f)); };
+
+		bool lightsMoved = false;
+		for (std::size_t i = 0; i < m_triangles.size(); ++i)
+		{
+			auto& shadingData = m_triangleShadingData[i];
+			if (shadingData.objectIndex != objectIndex) continue;
+
+			const auto& restPose = m_triangleRestPoses[i];
+			const auto& restTriangle = restPose.triangle;
+
+			auto& triangle = m_triangles[i];
+			triangle = TriangleIntersectionData(
+				transformPoint(restTriangle.v0),
+				transformPoint(restTriangle.v0 + restTriangle.edge1),
+				transformPoint(restTriangle.v0 + restTriangle.edge2)
+			);
+
+			for (int j = 0; j < 3; ++j) shadingData.normals[j] = glm::normalize(normalTransform * restPose.normals[j]);
+
+			// Scaling changes the triangle's size in world space but not in texture space
+			float restArea = glm::length(glm::cross(restTriangle.edge1, restTriangle.edge2));
+			float newArea  = glm::length(glm::cross(triangle.edge1, triangle.edge2));
+			shadingData.texCoordScale = newArea > 0.0f ? restPose.texCoordScale * glm::sqrt(restArea / newArea) : restPose.texCoordScale;
+
+			lightsMoved |= shadingData.lightIndex >= 0;
+		}
+
+		refit(lightsMoved);
+	}
+
+	// Removes an object from the scene. Its triangles are collapsed to points so that rays miss
+	// them, and are dropped the next time the scene is built
+	void removeObject(uint objectIndex)
+	{
+		SceneObject& object = m_objects[objectIndex];
+		if (object.removed) return;
+
+		object.removed = true;
+
+		bool lightsRemoved = false;
+		for (std::size_t i = 0; i < m_triangles.size(); ++i)
+		{
+			auto& shadingData = m_triangleShadingData[i];
+			if (shadingData.objectIndex != objectIndex) continue;
+
+			m_triangles[i] = TriangleIntersectionData(m_triangles[i].v0, m_triangles[i].v0, m_triangles[i].v0);
+			lightsRemoved |= shadingData.lightIndex >= 0;
+		}
+
+		refit(lightsRemoved);
+	}
+
+	// Returns the index of the first object with the given name that has not been removed, or -1
+	int findObject(const std::string& name) const
+	{
+		for (std::size_t i = 0; i < m_objects.size(); ++i)
+			if (!m_objects[i].removed && m_objects[i].name == name) return (int) i;
+
+		return -1;
+	}
+
+	const std::vector<SceneObject>& getObjects() const { return m_objects; }
+
+	// Returns a number that changes whenever the scene does
+	std::uint64_t getVersion() const { return m_version; }
+
+	std::size_t getShapeCount() const { return m_shapes.size(); }
+
+	// Returns the number of spheres in all of the scene's sphere sets
+	std::size_t getSphereCount() const
+	{
+		std::size_t count = 0;
+		for (const auto& spheres : m_sphereSets) count += spheres.size();
+		return count;
+	}
+
+	const Shape& getShape(std::size_t index) const { return *m_shapes[index]; }
+
+	const std::vector<TriangleIntersectionData>& getTriangles() const { return m_triangles; }
+
+	const LightTree& getLightTree() const { return m_lightTree; }
+
+	// Returns the parts of the BSDF used by the scene's materials, as of the last build()
+	const MaterialFeatures& getMaterialFeatures() const { return m_materialFeatures; }
+
+	// Returns a box enclosing everything in the scene
+	const Box& getBounds() const { return m_bounds; }
+
+	// Returns the memory used by the acceleration structures in bytes
+	std::size_t getBvhMemoryFootprint() const
+	{
+		std::size_t footprint = m_triangleBvh.getMemoryFootprint() + m_shapeBvh.getMemoryFootprint();
+		for (const auto& spheres : m_sphereSets) footprint += spheres.getMemoryFootprint();
+		return footprint;
 	}
 
 	bool loadFromFile(const char* path, std::string& warning, std::string& error)
@@ -37,83 +475,42 @@ public:
 
 		if (tinyobj::LoadObj(&attrib, &shapes, &materials, &warning, &error, path))
 		{
+			// Texture paths in the material file are relative to the model's directory
+			std::string baseDir = path;
+			auto separator = baseDir.find_last_of("/\\");
+			baseDir = separator == std::string::npos ? "" : baseDir.substr(0, separator + 1);
+
+			// Convert from tinyobjloader material format to Lumos material format
+			uint materialOffset = (uint) m_materials.size();
+			for (const auto& tinyobjMaterial : materials) addMaterial(tinyobjMaterial, baseDir, warning);
+
+			// Faces without a material use the default material
+			uint defaultMaterialIndex = addMaterial(Material());
+
+			// Allocate space for all of the triangles at once
+			std::size_t totalTriCount = m_triangles.size();
+			for (const auto& shape : shapes) totalTriCount += shape.mesh.num_face_vertices.size();
+			m_triangles.reserve(totalTriCount);
+			m_triangleShadingData.reserve(totalTriCount);
+
 			for (std::size_t shapeIndex = 0; shapeIndex < shapes.size(); ++shapeIndex) // For each tinyobj shape
-			{ 
-				std::size_t indexOffset = 0;
-				std::size_t triCount = shapes[shapeIndex].mesh.num_face_vertices.size();
-
-				for (std::size_t triIndex = 0; triIndex < triCount; ++triIndex) // For each triangle
-				{ 
-					// Vertices of the new triangle to be added
-					std::array<TriangleShape::Vertex, 3> vertices;
-
-					bool hasNormalData = false;
-					const auto& tinyobjMaterial = materials[shapes[shapeIndex].mesh.material_ids[triIndex]];
-					
-					// Convert from tinyobjloader material format to Lumos material format
-					Material material;
-					material.diffuse         = glm::pow(toVec3((float*) tinyobjMaterial.diffuse), glm::vec3(2.2f));
-					material.specular        = glm::pow(toVec3((float*) tinyobjMaterial.specular), glm::vec3(2.2f));
-					material.emission        = glm::pow(toVec3((float*) tinyobjMaterial.ambient), glm::vec3(2.2f));
-					material.transmittance   = glm::pow(toVec3((float*) tinyobjMaterial.transmittance), glm::vec3(2.2f));
-					material.refractiveIndex = tinyobjMaterial.ior;
-					material.roughness       = tinyobjMaterial.roughness == 0.0f ? 1.0f : tinyobjMaterial.roughness;
-					material.isOpaque        = tinyobjMaterial.dissolve > 0.5f;
-
-					// Set each vertex from the 3D model
-					int i = 0;
-					for (auto& vertex : vertices)
-					{
-						tinyobj::index_t indices = shapes[shapeIndex].mesh.indices[indexOffset + i];
-
-						// Get vertex position
-						vertex.pos.x = attrib.vertices[indices.vertex_index * 3 + 0];
-						vertex.pos.y = attrib.vertices[indices.vertex_index * 3 + 1];
-						vertex.pos.z = attrib.vertices[indices.vertex_index * 3 + 2];
-
-						// If normal_index is negative, there is no normal data for this vertex so
-						// we compute the normal later
-						if (indices.normal_index >= 0)
-						{
-							hasNormalData = true;
-							vertex.normal.x = attrib.normals[indices.normal_index * 3 + 0];
-							vertex.normal.y = attrib.normals[indices.normal_index * 3 + 1];
-							vertex.normal.z = attrib.normals[indices.normal_index * 3 + 2];
-						}
-
-						// If texcoord_index is negative, there is no texCoord data for this vertex
-						if (indices.texcoord_index >= 0)
-						{
-							vertex.texCoord.x = attrib.texcoords[indices.texcoord_index * 2 + 0];
-							vertex.texCoord.y = attrib.texcoords[indices.texcoord_index * 2 + 1];
-						}
-						else
-						{
-							vertex.texCoord = glm::vec2(-1.0f); // Don't use any texture
-						}
-
-						++i;
-					}
-
-					if (!hasNormalData)
-					{
-						// Compute normal vector from vertex positions
-						// If a triangle has vertices P1, P2 and P3 then its normal vector may be
-						// given by the cross product (P2 - P1) x (P3 - P1)
-						glm::vec3 normal = glm::normalize(glm::cross(vertices[1].pos - vertices[0].pos, vertices[2].pos - vertices[0].pos));
-						vertices[0].normal = normal;
-						vertices[1].normal = normal;
-						vertices[2].normal = normal;
-					}
-
-					// Add the new triangle to the scene
-					add(new TriangleShape(material, vertices));
-
-					// Update index offset for next triangle
-					indexOffset += 3;
+			{
+				addObject(shapes[shapeIndex].name);
+
+				const auto& mesh = shapes[shapeIndex].mesh;
+				for (std::size_t triIndex = 0; triIndex < mesh.num_face_vertices.size(); ++triIndex) // For each triangle
+				{
+					int materialId = mesh.material_ids[triIndex];
+					uint materialIndex = materialId >= 0 ? materialOffset + (uint) materialId : defaultMaterialIndex;
+
+					// LoadObj has already split the faces into triangles
+					std::array<tinyobj::index_t, 3> indices = { mesh.indices[triIndex * 3 + 0], mesh.indices[triIndex * 3 + 1], mesh.indices[triIndex * 3 + 2] };
+					addTriangle(getObjTriangle(attrib, indices), materialIndex);
 				}
 			}
 
+			build();
+
 			return true;
 		}
 		else
@@ -122,45 +519,245 @@ public:
 		}
 	}
 
+	// Loads a set of spheres from a PLY point cloud (see SphereSet::loadFromFile). The material_index
+	// of each point selects a material from the MTL file next to it with the same name, in the order
+	// they appear there, if there is one. Points without a radius use defaultRadius
+	bool loadSpheresFromFile(const char* path, float defaultRadius, std::string& warning, std::string& error)
+	{
+		std::string stem = path;
+		std::size_t dot = stem.rfind('.');
+		std::size_t separator = stem.find_last_of("/\\");
+		if (dot != std::string::npos && (separator == std::string::npos || dot > separator)) stem = stem.substr(0, dot);
+
+		std::string baseDir = separator == std::string::npos ? "" : stem.substr(0, separator + 1);
+
+		std::vector<uint> materialIndices;
+		std::ifstream materialFile(stem + ".mtl");
+		if (materialFile)
+		{
+			std::map<std::string, int> materialNames;
+			std::vector<tinyobj::material_t> materials;
+			tinyobj::LoadMtl(&materialNames, &materials, &materialFile, &warning, &error);
+
+			for (const auto& tinyobjMaterial : materials)
+				materialIndices.push_back(addMaterial(tinyobjMaterial, baseDir, warning));
+		}
+
+		uint defaultMaterialIndex = addMaterial(Material());
+
+		SphereSet spheres;
+		if (!spheres.loadFromFile(path, defaultRadius, materialIndices, defaultMaterialIndex, warning, error)) return false;
+
+		addSphereSet(std::move(spheres));
+		build();
+
+		return true;
+	}
+
 	// Returns true if the ray intersects with the scene, and stores information about the intersection in `hit`
 	bool intersects(const Ray& ray, Hit& hit) const
 	{
 		float minT = inf;                               // distance to the point of intersection
-		const Shape* closestIntersectedShape = nullptr; // pointer to the closest intersected shape
+		int closestTriangle = -1;                       // index of the closest intersected triangle
+		glm::vec2 closestBarycentrics;                  // barycentric coordinates of the intersection with the closest triangle
+		const Shape* closestIntersectedShape = nullptr; // pointer to the closest intersected shape, if it is closer than any triangle
 		glm::vec4 closestIntersectionInfo;              // information about the closest intersection used to compute the material and normal vectors
+		int closestSphereSet = -1;                      // index of the set containing the closest intersected sphere, if it is closer than any triangle or shape
+		uint closestSphere = 0;                         // index of the closest intersected sphere within its set
 
-		// Test all shapes in order, tracking the closest one to intersect the ray. Very unoptimised.
-		for (const auto& shape : m_shapes)
+		// Traverse the BVHs, tracking the closest triangle or shape to intersect the ray. Only the
+		// intersection data is read here
+		m_triangleBvh.intersect(ray, minT, [&] (uint index, float& tMax)
+		{
+			float t; glm::vec2 barycentrics;
+			if (intersectTriangle(ray, m_triangles[index], t, barycentrics) && t < tMax)
+			{
+				closestTriangle = (int) index;
+				closestBarycentrics = barycentrics;
+				tMax = t;
+				return true;
+			}
+
+			return false;
+		});
+
+		m_shapeBvh.intersect(ray, minT, [&] (uint index, float& tMax)
 		{
 			glm::vec4 intersectionInfo; float t;
-			if (shape->intersects(ray, t, intersectionInfo) && t < minT)
+			if (m_shapes[index]->intersects(ray, t, intersectionInfo) && t < tMax)
 			{
-				closestIntersectedShape = shape.get();
+				closestTriangle = -1;
+				closestIntersectedShape = m_shapes[index];
 				closestIntersectionInfo = intersectionInfo;
-				minT = t;
+				tMax = t;
+				return true;
 			}
+
+			return false;
+		});
+
+		for (std::size_t setIndex = 0; setIndex < m_sphereSets.size(); ++setIndex)
+		{
+			if (!m_sphereSets[setIndex].intersects(ray, minT, closestSphere)) continue;
+
+			closestTriangle = -1;
+			closestIntersectedShape = nullptr;
+			closestSphereSet = (int) setIndex;
 		}
 
 		// If an intersection was found, get the material and normal vector at the point of intersection
 		// and store it for later in `hit`
-		if (closestIntersectedShape != nullptr)
+		if (closestTriangle >= 0)
+		{
+			const auto& shadingData = m_triangleShadingData[closestTriangle];
+
+			hit.pos      = ray(minT);
+			hit.normal   = interpolateTriangle(shadingData.normals, closestBarycentrics);
+			hit.material = m_materials[shadingData.materialIndex];
+			hit.lightIndex = shadingData.lightIndex;
+
+			if (hit.material.diffuseTexture >= 0 || hit.material.roughnessTexture >= 0)
+			{
+				// The width of the ray cone at the hit, projected onto the surface and converted to
+				// texture space, determines which mip level is read
+				const auto& triangle = m_triangles[closestTriangle];
+				float cosTheta = glm::abs(glm::dot(glm::normalize(glm::cross(triangle.edge1, triangle.edge2)), ray.d));
+				float coneWidth = ray.coneWidth + ray.coneSpread * minT;
+				float footprint = coneWidth * shadingData.texCoordScale / glm::max(cosTheta, 0.05f);
+
+				glm::vec2 texCoord = interpolateTriangle(shadingData.texCoords, closestBarycentrics);
+
+				if (hit.material.diffuseTexture >= 0)
+					hit.material.diffuse *= xyz(m_textureCache.get(hit.material.diffuseTexture).sample(texCoord, footprint));
+
+				if (hit.material.roughnessTexture >= 0)
+					hit.material.roughness *= m_textureCache.get(hit.material.roughnessTexture).sample(texCoord, footprint).r;
+			}
+		}
+		else if (closestIntersectedShape != nullptr)
 		{
 			hit.pos      = ray(minT);
 			hit.normal   = closestIntersectedShape->getNormal(closestIntersectionInfo);
 			hit.material = closestIntersectedShape->getMaterial(closestIntersectionInfo);
+			hit.lightIndex = -1;
+		}
+		else if (closestSphereSet >= 0)
+		{
+			const auto& spheres = m_sphereSets[closestSphereSet];
 
-			// Make sure that the normal points away from the surface and is a unit vector
-			hit.normal *= (glm::dot(hit.normal, ray.d) < 0.0f) ? 1.0f : -1.0f;
-			hit.normal  = normalize(hit.normal);
-
-			return true;
+			hit.pos      = ray(minT);
+			hit.normal   = (hit.pos - spheres.getCentre(closestSphere)) / spheres.getRadius(closestSphere);
+			hit.material = m_materials[spheres.getMaterialIndex(closestSphere)];
+			hit.lightIndex = -1;
 		}
 		else
 		{
 			return false;
 		}
+
+		hit.distance = minT;
+
+		// Make sure that the normal points away from the surface and is a unit vector
+		hit.normal *= (glm::dot(hit.normal, ray.d) < 0.0f) ? 1.0f : -1.0f;
+		hit.normal  = normalize(hit.normal);
+
+		return true;
+	}
+
+	// Returns true if anything in the scene blocks the ray before distance tMax. Stops at the first
+	// intersection found and skips the normal and material, so it is much cheaper than intersects()
+	bool occluded(const Ray& ray, float tMax) const
+	{
+		bool triangleHit = m_triangleBvh.intersect<true>(ray, tMax, [&] (uint index, float& tMax)
+		{
+			float t; glm::vec2 barycentrics;
+			return intersectTriangle(ray, m_triangles[index], t, barycentrics) && t < tMax;
+		});
+
+		if (triangleHit) return true;
+
+		bool shapeHit = m_shapeBvh.intersect<true>(ray, tMax, [&] (uint index, float& tMax)
+		{
+			glm::vec4 intersectionInfo; float t;
+			return m_shapes[index]->intersects(ray, t, intersectionInfo) && t < tMax;
+		});
+
+		if (shapeHit) return true;
+
+		for (const auto& spheres : m_sphereSets)
+			if (spheres.occluded(ray, tMax)) return true;
+
+		return false;
 	}
 
 private:
-	std::vector<std::unique_ptr<const Shape>> m_shapes;
+	// A refitted triangle BVH is rebuilt once its cost grows past this multiple of its cost when built
+	static constexpr float maxRefitCost = 1.5f;
+
+	// Builds the light tree over the emissive triangles, so that they can be sampled directly
+	void buildLightTree()
+	{
+		std::vector<LightTriangle> lights;
+		for (uint i = 0; i < m_triangles.size(); ++i)
+		{
+			const auto& triangle = m_triangles[i];
+			const auto& emission = m_materials[m_triangleShadingData[i].materialIndex].emission;
+			m_triangleShadingData[i].lightIndex = -1;
+
+			glm::vec3 cross = glm::cross(triangle.edge1, triangle.edge2);
+			float area = 0.5f * glm::length(cross);
+			if (luminance(emission) <= 0.0f || area <= 0.0f) continue;
+
+			lights.push_back({ triangle.v0, triangle.edge1, triangle.edge2, cross / (2.0f * area), area, emission, i, 0 });
+		}
+
+		m_lightTree.build(std::move(lights));
+
+		const auto& treeLights = m_lightTree.getLights();
+		for (uint i = 0; i < treeLights.size(); ++i) m_triangleShadingData[treeLights[i].triangleIndex].lightIndex = (int) i;
+	}
+
+	// Updates the triangle BVH and the scene's bounds after triangles have moved, rebuilding the
+	// scene instead if the refitted BVH would be too slow
+	void refit(bool lightsChanged)
+	{
+		std::vector<Box> boxes;
+		boxes.reserve(m_triangles.size());
+		for (const auto& triangle : m_triangles) boxes.push_back(triangle.getBoundingBox());
+
+		m_triangleBvh.refit(boxes);
+		if (m_triangleBvh.getCost() > maxRefitCost * m_triangleBvh.getBuildCost())
+		{
+			build();
+			return;
+		}
+
+		m_bounds = Box::empty();
+		for (std::size_t i = 0; i < boxes.size(); ++i)
+			if (!m_objects[m_triangleShadingData[i].objectIndex].removed) m_bounds.grow(boxes[i]);
+
+		for (const auto& shape : m_shapes) m_bounds.grow(shape->getBoundingBox());
+		for (const auto& spheres : m_sphereSets) m_bounds.grow(spheres.getBounds());
+
+		if (lightsChanged) buildLightTree();
+
+		++m_version;
+	}
+
+	std::vector<TriangleIntersectionData> m_triangles;        // Hot triangle data, in the order of the leaves of m_triangleBvh
+	std::vector<TriangleShadingData> m_triangleShadingData;   // Cold triangle data, parallel to m_triangles
+	std::vector<TriangleRestPose> m_triangleRestPoses;        // Parallel to m_triangles once an object has moved, otherwise empty
+	std::vector<Material> m_materials;                        // Materials referenced by TriangleShadingData::materialIndex
+	TextureCache m_textureCache;                              // Textures referenced by the materials
+	Arena m_arena;                                            // Memory for the other shapes
+	std::vector<const Shape*> m_shapes;                       // Other shapes, in the order of the leaves of m_shapeBvh
+	WideBvh m_triangleBvh;
+	WideBvh m_shapeBvh;
+	std::vector<SphereSet> m_sphereSets;                      // Particles and point clouds, each with its own hierarchy
+	LightTree m_lightTree;                                    // Hierarchy of the emissive triangles, for sampling them directly
+	Box m_bounds = Box::empty();                              // Bounds of all triangles and shapes
+	std::vector<SceneObject> m_objects;                       // Objects referenced by TriangleShadingData::objectIndex
+	std::uint64_t m_version = 0;                              // Incremented whenever the scene changes
+	MaterialFeatures m_materialFeatures;                      // Parts of the BSDF used by m_materials and the shapes' materials
+	bool m_lazyBvh = false;                                   // Whether the triangle BVH is built lazily
 };
@@ -1,5 +1,7 @@
 #pragma once
 
+#include <array>
+
 #include "material.hh"
 #include "utility.hh"
 
@@ -19,6 +21,9 @@ public:
     // Returns the material of the shape at the intersection position
     virtual Material getMaterial(const glm::vec4& intersectionInfo) const = 0;
 
+    // Adds the features of every material the shape can have to `features`
+    virtual void addMaterialFeatures(MaterialFeatures& features) const = 0;
+
     // Returns the normal vector to the shape at the last intersection position
     virtual glm::vec3 getNormal(const glm::vec4& intersectionInfo) const = 0;
 
@@ -26,6 +31,88 @@ public:
     virtual Box getBoundingBox() const = 0;
 };
 
+/*
+ * Precomputed data for the ray-triangle intersection test: the first vertex and the two edges
+ * leaving it. This is the only per-triangle data read while searching for the closest hit, so it
+ * is kept apart from the shading data and aligned to 16 bytes (48 bytes per triangle)
+ */
+struct alignas(16) TriangleIntersectionData
+{
+    glm::vec3 v0;    float pad0;
+    glm::vec3 edge1; float pad1; // v1 - v0
+    glm::vec3 edge2; float pad2; // v2 - v0
+
+    TriangleIntersectionData() = default;
+
+    TriangleIntersectionData(const glm::vec3& a, const glm::vec3& b, const glm::vec3& c) :
+        v0(a), pad0(0.0f),
+        edge1(b - a), pad1(0.0f),
+        edge2(c - a), pad2(0.0f) {}
+
+    Box getBoundingBox() const
+    {
+        glm::vec3 v1 = v0 + edge1, v2 = v0 + edge2;
+        return { glm::min(v0, glm::min(v1, v2)), glm::max(v0, glm::max(v1, v2)) };
+    }
+};
+
+// Data only needed once a triangle has been found to be the closest hit
+struct TriangleShadingData
+{
+    std::array<glm::vec3, 3> normals;   // Normal vector at each vertex
+    std::array<glm::vec2, 3> texCoords; // Texture coordinates at each vertex
+    uint materialIndex;                 // Index of the triangle's material in the scene's material list
+    float texCoordScale;                // sqrt(texture space area / world space area), for texture filtering
+    int lightIndex = -1;                // Index of the triangle in the scene's light tree if it is emissive, or -1
+    uint objectIndex = 0;               // Index of the scene object that the triangle belongs to
+};
+
+/*
+ * Ray-triangle intersection calculation using the Möller-Trumbore algorithm
+ *
+ * I learnt the algorithm from this tutorial:
+ * https://www.scratchapixel.com/lessons/3d-basic-rendering/ray-tracing-rendering-a-triangle/moller-trumbore-ray-triangle-intersection
+ *
+ * On a hit, barycentrics is set to the weights of the second and third vertices
+ */
+inline bool intersectTriangle(const Ray& ray, const TriangleIntersectionData& triangle, float& t, glm::vec2& barycentrics)
+{
+    // Compute the determinant of the matrix taking [t, u, v] to [x, y, z] as the scalar triple
+    // product of the ray direction, ac and ab
+    glm::vec3 p = glm::cross(ray.d, triangle.edge2);
+    float det = glm::dot(p, triangle.edge1);
+
+    if (abs(det) < eps) return false; // The ray misses the triangle
+
+    // Precompute reciprocal of determinant
+    det = 1.0f / det;
+
+    // Compute and validate u
+    glm::vec3 ao = ray.o - triangle.v0;
+    float u = glm::dot(ao, p) * det;
+    if (!between(u, 0.0f, 1.0f)) return false;
+
+    // Compute and validate v
+    glm::vec3 q = glm::cross(ao, triangle.edge1);
+    float v = glm::dot(ray.d, q) * det;
+    if (v < 0.0f || u + v > 1.0f) return false;
+
+    // Finally, compute t
+    t = dot(q, triangle.edge2) * det;
+    if (t < 0.0f) return false;
+
+    barycentrics = glm::vec2(u, v);
+
+    return true;
+}
+
+// Interpolates a per-vertex attribute using the barycentrics from intersectTriangle
+template <typename T>
+inline T interpolateTriangle(const std::array<T, 3>& values, const glm::vec2& barycentrics)
+{
+    return values[0] * (1.0f - barycentrics.x - barycentrics.y) + values[1] * barycentrics.x + values[2] * barycentrics.y;
+}
+
 class TriangleShape : public Shape
 {
 public:
@@ -38,50 +125,16 @@ public:
 
     TriangleShape(const Material& material, const std::array<Vertex, 3>& vertices) :
         m_material(material),
-        m_vertices(vertices) {}
+        m_triangle(vertices[0].pos, vertices[1].pos, vertices[2].pos),
+        m_normals({ vertices[0].normal, vertices[1].normal, vertices[2].normal }) {}
 
-    /*
-     * Ray-triangle intersection calculation using the Möller-Trumbore algorithm
-     *
-     * I learnt the algorithm from this tutorial:
-     * https://www.scratchapixel.com/lessons/3d-basic-rendering/ray-tracing-rendering-a-triangle/moller-trumbore-ray-triangle-intersection
-     */
     bool intersects(const Ray& ray, float& t, glm::vec4& intersectionInfo) const override
     {
-        // Get the position of each vertex
-        glm::vec3 a = m_vertices[0].pos;
-        glm::vec3 b = m_vertices[1].pos;
-        glm::vec3 c = m_vertices[2].pos;
-
-        // Compute the vectors from vertex A to the other two vertices
-        glm::vec3 ab = b - a;
-        glm::vec3 ac = c - a;
-
-        // Compute the determinant of the matrix taking [t, u, v] to [x, y, z] as the scalar triple
-        // product of the ray direction, ac and ab
-        glm::vec3 p = glm::cross(ray.d, ac);
-        float det = glm::dot(p, ab);
-
-        if (abs(det) < eps) return false; // The ray misses the triangle
-
-        // Precompute reciprocal of determinant
-        det = 1.0f / det;
-
-        // Compute and validate u
-        float u = glm::dot(ray.o - a, p) * det;
-        if (!between(u, 0.0f, 1.0f)) return false;
-
-        // Compute and validate v
-        glm::vec3 q = glm::cross(ray.o - a, ab);
-        float v = glm::dot(ray.d, q) * det;
-        if (v < 0.0f || u + v > 1.0f) return false;
-
-        // Finally, compute t
-        t = dot(q, ac) * det;
-        if (t < 0.0f) return false;
+        glm::vec2 barycentrics;
+        if (!intersectTriangle(ray, m_triangle, t, barycentrics)) return false;
 
         // Store barycentric coordinates in intersection info
-        intersectionInfo = glm::vec4(u, v, 0.0f, 0.0f);
+        intersectionInfo = glm::vec4(barycentrics, 0.0f, 0.0f);
 
         return true;
     }
@@ -91,29 +144,25 @@ public:
         return m_material;
     }
 
+    void addMaterialFeatures(MaterialFeatures& features) const override
+    {
+        features.add(m_material);
+    }
+
     glm::vec3 getNormal(const glm::vec4& intersectionInfo) const override
     {
-        float u = intersectionInfo.x;
-        float v = intersectionInfo.y;
-        return m_vertices[0].normal * u + m_vertices[1].normal * v + m_vertices[2].normal * (1.0f - u - v);
+        return interpolateTriangle(m_normals, glm::vec2(intersectionInfo.x, intersectionInfo.y));
     }
 
     Box getBoundingBox() const override
     {
-        // Get the position of each vertex
-        glm::vec3 a = m_vertices[0].pos;
-        glm::vec3 b = m_vertices[1].pos;
-        glm::vec3 c = m_vertices[2].pos;
-
-        // Min/max of each position along each axis
-        return {
-            glm::min(a, glm::min(b, c)),
-            glm::max(a, glm::max(b, c))
-        };
+        return m_triangle.getBoundingBox();
     }
 
+private:
     const Material m_material;
-    const std::array<Vertex, 3> m_vertices;
+    const TriangleIntersectionData m_triangle;
+    const std::array<glm::vec3, 3> m_normals;
 };
 
 class SphereShape : public Shape
@@ -165,6 +214,11 @@ public:
         return m_material;
     }
 
+    void addMaterialFeatures(MaterialFeatures& features) const override
+    {
+        features.add(m_material);
+    }
+
     glm::vec3 getNormal(const glm::vec4& intersectionInfo) const override
     {
         return xyz(intersectionInfo);
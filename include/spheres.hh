@@ -0,0 +1,178 @@
+#pragma once
+
+#include <string>
+#include <vector>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+#include "bvh.hh"
+#include "utility.hh"
+
+/*
+ * Four spheres stored as separate arrays of centre coordinates and radii, so that a ray can be
+ * tested against all four at once with SSE. Unused slots have NaN centres, which every comparison
+ * in the intersection test rejects
+ */
+struct alignas(16) SpherePacket
+{
+    static constexpr int width = 4;
+
+    float x[width];
+    float y[width];
+    float z[width];
+    float radius[width];
+
+    glm::vec3 getCentre(int i) const { return glm::vec3(x[i], y[i], z[i]); }
+
+    Box getBoundingBox() const;
+};
+
+/*
+ * A large set of spheres sharing one acceleration structure, for particles and point clouds
+ *
+ * A SphereShape is a separate object with a virtual intersection test and its own leaf in the
+ * scene's shape BVH, which is too heavy for millions of spheres. A sphere set instead sorts its
+ * spheres along a Morton curve, packs each run of four neighbours into a SpherePacket and builds a
+ * WideBvh over the packets, so that every leaf a ray reaches is tested four spheres at a time.
+ * Spheres are referred to by their index in packet order, packet * 4 + slot
+ */
+class SphereSet
+{
+public:
+    // Adds a sphere using a material from the scene's material list. Call build() afterwards to add
+    // it to the acceleration structure
+    void add(const glm::vec3& centre, float radius, uint materialIndex);
+
+    // Packs the spheres added since the last build and rebuilds the acceleration structure
+    void build();
+
+    // Reads the spheres from a PLY point cloud (ascii or binary), which must have a vertex element
+    // with float x, y and z properties. Optional radius and material_index properties give each
+    // point's radius and an index into `materialIndices`; points without them, or with an index
+    // out of range, use defaultRadius and defaultMaterialIndex. Returns false on failure, with the
+    // reason in `error`
+    bool loadFromFile(
+        const char* path,
+        float defaultRadius,
+        const std::vector<uint>& materialIndices,
+        uint defaultMaterialIndex,
+        std::string& warning,
+        std::string& error
+    );
+
+    // Returns true if the ray hits a sphere closer than tMax, in which case tMax is set to the
+    // distance to the hit and `index` to the sphere that was hit
+    bool intersects(const Ray& ray, float& tMax, uint& index) const
+    {
+        return m_bvh.intersect(ray, tMax, [&] (uint packetIndex, float& tMax)
+        {
+            int slot = intersectPacket(ray, m_packets[packetIndex], tMax);
+            if (slot < 0) return false;
+
+            index = packetIndex * SpherePacket::width + slot;
+            return true;
+        });
+    }
+
+    // Returns true if the ray hits any sphere before distance tMax
+    bool occluded(const Ray& ray, float tMax) const
+    {
+        return m_bvh.intersect<true>(ray, tMax, [&] (uint packetIndex, float& tMax)
+        {
+            return intersectPacket(ray, m_packets[packetIndex], tMax) >= 0;
+        });
+    }
+
+    glm::vec3 getCentre(uint index) const { return m_packets[index / SpherePacket::width].getCentre(index % SpherePacket::width); }
+    float getRadius(uint index) const { return m_packets[index / SpherePacket::width].radius[index % SpherePacket::width]; }
+    uint getMaterialIndex(uint index) const { return m_materialIndices[index]; }
+
+    // Returns the number of spheres in the set
+    std::size_t size() const { return m_size + m_centres.size(); }
+
+    // Returns a box enclosing every sphere, as of the last build()
+    const Box& getBounds() const { return m_bounds; }
+
+    // Returns the memory used by the packets and the acceleration structure in bytes
+    std::size_t getMemoryFootprint() const { return m_packets.size() * sizeof(SpherePacket) + m_bvh.getMemoryFootprint(); }
+
+private:
+    // Tests the ray against the four spheres of a packet. Returns the slot of the closest sphere hit
+    // closer than tMax and shortens tMax to it, or returns -1 if none is
+    static int intersectPacket(const Ray& ray, const SpherePacket& packet, float& tMax)
+    {
+        // As in SphereShape::intersects, solve |o + td - c|^2 = r^2 for t with a unit direction d.
+        // The ray leaves the sphere at the second root if it starts inside it
+        float t[SpherePacket::width];
+
+#if defined(__SSE2__)
+        __m128 ox = _mm_sub_ps(_mm_set1_ps(ray.o.x), _mm_load_ps(packet.x));
+        __m128 oy = _mm_sub_ps(_mm_set1_ps(ray.o.y), _mm_load_ps(packet.y));
+        __m128 oz = _mm_sub_ps(_mm_set1_ps(ray.o.z), _mm_load_ps(packet.z));
+        __m128 r  = _mm_load_ps(packet.radius);
+
+        __m128 b = _mm_add_ps(_mm_add_ps(_mm_mul_ps(ox, _mm_set1_ps(ray.d.x)), _mm_mul_ps(oy, _mm_set1_ps(ray.d.y))), _mm_mul_ps(oz, _mm_set1_ps(ray.d.z)));
+        __m128 c = _mm_sub_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(ox, ox), _mm_mul_ps(oy, oy)), _mm_mul_ps(oz, oz)), _mm_mul_ps(r, r));
+        __m128 discriminant = _mm_sub_ps(_mm_mul_ps(b, b), c);
+
+        const __m128 zero = _mm_setzero_ps();
+        __m128 hitMask = _mm_cmpge_ps(discriminant, zero);
+
+        __m128 root  = _mm_sqrt_ps(_mm_max_ps(discriminant, zero));
+        __m128 enter = _mm_sub_ps(_mm_sub_ps(zero, b), root);
+        __m128 exit  = _mm_add_ps(_mm_sub_ps(zero, b), root);
+
+        __m128 inside = _mm_cmplt_ps(enter, zero);
+        __m128 tv = _mm_or_ps(_mm_andnot_ps(inside, enter), _mm_and_ps(inside, exit));
+
+        hitMask = _mm_and_ps(hitMask, _mm_cmpge_ps(tv, zero));
+        hitMask = _mm_and_ps(hitMask, _mm_cmplt_ps(tv, _mm_set1_ps(tMax)));
+
+        int mask = _mm_movemask_ps(hitMask);
+        if (mask == 0) return -1;
+
+        _mm_storeu_ps(t, tv);
+#else
+        int mask = 0;
+        for (int i = 0; i < SpherePacket::width; ++i)
+        {
+            glm::vec3 offset = ray.o - packet.getCentre(i);
+            float b = glm::dot(offset, ray.d);
+            float discriminant = b * b - glm::dot(offset, offset) + packet.radius[i] * packet.radius[i];
+
+            if (!(discriminant >= 0.0f)) continue;
+
+            float root = glm::sqrt(discriminant);
+            t[i] = -b - root < 0.0f ? -b + root : -b - root;
+
+            if (t[i] >= 0.0f && t[i] < tMax) mask |= 1 << i;
+        }
+
+        if (mask == 0) return -1;
+#endif
+
+        int closest = -1;
+        for (int i = 0; i < SpherePacket::width; ++i)
+        {
+            if ((mask & (1 << i)) == 0 || t[i] >= tMax) continue;
+
+            tMax = t[i];
+            closest = i;
+        }
+
+        return closest;
+    }
+
+    std::vector<SpherePacket> m_packets;  // Spheres in the order of the leaves of m_bvh
+    std::vector<uint> m_materialIndices;  // Material of each sphere, parallel to the packet slots
+    std::size_t m_size = 0;               // Number of spheres in m_packets
+    WideBvh m_bvh;                        // Hierarchy of the packets
+    Box m_bounds = Box::empty();          // Bounds of the spheres in m_packets
+
+    // Spheres added since the last build
+    std::vector<glm::vec3> m_centres;
+    std::vector<float> m_radii;
+    std::vector<uint> m_newMaterialIndices;
+};
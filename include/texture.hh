@@ -0,0 +1,108 @@
+#pragma once
+
+#include <array>
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "utility.hh"
+
+// Returns the linear value of an 8-bit sRGB encoded value, using a lookup table
+inline float srgbToLinear(glm::u8 value)
+{
+    static const std::array<float, 256> table = [] ()
+    {
+        std::array<float, 256> table;
+        for (int i = 0; i < 256; ++i)
+        {
+            float x = i / 255.0f;
+            table[i] = x <= 0.04045f ? x / 12.92f : glm::pow((x + 0.055f) / 1.055f, 2.4f);
+        }
+        return table;
+    }();
+
+    return table[value];
+}
+
+// Returns the 8-bit sRGB encoding of a linear value on [0, 1]
+inline glm::u8 linearToSrgb(float value)
+{
+    value = glm::clamp(value, 0.0f, 1.0f);
+    float x = value <= 0.0031308f ? value * 12.92f : 1.055f * glm::pow(value, 1.0f / 2.4f) - 0.055f;
+    return (glm::u8) (x * 255.0f + 0.5f);
+}
+
+/*
+ * A mip-mapped RGBA texture used for material properties
+ *
+ * Each mip level is stored in 8x8 texel tiles (256 bytes, 4 cache lines) rather than in rows, so
+ * that a bilinear lookup touches one tile in most cases. The mip level is chosen from the size of
+ * the ray's footprint on the surface, so distant, minified surfaces read from small levels that
+ * stay in cache instead of sparsely sampling the full resolution image
+ */
+class Texture
+{
+public:
+    static constexpr int tileSize = 8;
+
+    // Loads the texture from an image file and generates its mip levels. Colour textures are
+    // sRGB encoded and are filtered in linear space; data textures (eg roughness) are used as-is
+    bool loadFromFile(const char* path, bool isSrgb);
+
+    /*
+     * Returns the bilinearly filtered value of the texture at uv, using the mip level whose texels
+     * are closest in size to `footprint`, the width of the area being sampled in texture space.
+     * Texture coordinates wrap around, and v = 0 is the bottom of the image as in OBJ files
+     */
+    glm::vec4 sample(glm::vec2 uv, float footprint) const;
+
+    glm::ivec2 getSize() const { return m_levels.empty() ? glm::ivec2(0) : m_levels[0].size; }
+
+    std::size_t getMemoryFootprint() const { return m_texels.size() * sizeof(u8vec4); }
+
+private:
+    struct Level
+    {
+        glm::ivec2 size;      // Size of the level in texels
+        int tileCountX;       // Number of tiles in each row of tiles
+        std::size_t offset;   // Index of the level's first texel in m_texels
+    };
+
+    // Returns the index in m_texels of the texel at pos in the given level
+    std::size_t getTexelIndex(const Level& level, glm::ivec2 pos) const
+    {
+        int tileIndex  = (pos.y / tileSize) * level.tileCountX + pos.x / tileSize;
+        int tileOffset = (pos.y % tileSize) * tileSize + pos.x % tileSize;
+        return level.offset + std::size_t(tileIndex) * tileSize * tileSize + tileOffset;
+    }
+
+    // Returns the texel at pos in the given level, decoded to linear values
+    glm::vec4 fetch(const Level& level, glm::ivec2 pos) const;
+
+    std::vector<Level> m_levels;
+    std::vector<u8vec4> m_texels;
+    bool m_isSrgb = false;
+};
+
+// Owns every texture used by a scene, making sure that each file is loaded only once no matter how
+// many materials refer to it
+class TextureCache
+{
+public:
+    // Returns the index of the texture loaded from path, loading it if this is the first time it
+    // has been requested. Returns -1 if the texture could not be loaded
+    int load(const std::string& path, bool isSrgb, std::string& warning);
+
+    const Texture& get(int index) const { return *m_textures[index]; }
+
+    void clear()
+    {
+        m_textures.clear();
+        m_indices.clear();
+    }
+
+private:
+    std::vector<std::unique_ptr<Texture>> m_textures;
+    std::map<std::pair<std::string, bool>, int> m_indices; // Maps path and colour space to the index in m_textures
+};
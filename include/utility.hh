@@ -28,6 +28,11 @@ struct Ray
     glm::vec3 o; // The ray origin in world-space
     glm::vec3 d; // The ray direction in world-space
 
+    // The ray is treated as a cone when choosing texture mip levels: its width at distance t is
+    // coneWidth + coneSpread * t
+    float coneWidth  = 0.0f; // Width of the cone at the ray origin
+    float coneSpread = 0.0f; // Spread angle of the cone in radians
+
     // Returns the point t units along the ray
     glm::vec3 operator() (float t) const { return o + d * t; }
 };
@@ -39,6 +44,33 @@ struct Box
 {
     glm::vec3 min; // The box's lower bound
     glm::vec3 max; // The box's upper bound
+
+    // Returns a box that contains nothing, ready to be grown
+    static Box empty() { return { glm::vec3(inf), glm::vec3(-inf) }; }
+
+    // Expands the box to enclose another box
+    void grow(const Box& box)
+    {
+        min = glm::min(min, box.min);
+        max = glm::max(max, box.max);
+    }
+
+    // Expands the box to enclose a point
+    void grow(const glm::vec3& point)
+    {
+        min = glm::min(min, point);
+        max = glm::max(max, point);
+    }
+
+    glm::vec3 centre() const { return 0.5f * (min + max); }
+    glm::vec3 extent() const { return max - min; }
+
+    // Returns the surface area of the box, or zero for an empty box. Used by the SAH in the BVH builder
+    float surfaceArea() const
+    {
+        glm::vec3 e = glm::max(max - min, glm::vec3(0.0f));
+        return 2.0f * (e.x * e.y + e.y * e.z + e.z * e.x);
+    }
 };
 
 // Useful functions
@@ -67,6 +99,46 @@ inline bool between(glm::vec3 x, float min, float max)
     return glm::all(glm::greaterThan(x, glm::vec3(min))) && glm::all(glm::lessThan(x, glm::vec3(max)));
 }
 
+// Interleaves the bits of x and y to give the position of (x, y) along the Z-order (Morton) curve
+inline uint mortonEncode(uint x, uint y)
+{
+    // Spread the lower 16 bits of v out so that there is a zero between each bit
+    auto spread = [] (uint v)
+    {
+        v &= 0x0000ffff;
+        v = (v | (v << 8)) & 0x00ff00ff;
+        v = (v | (v << 4)) & 0x0f0f0f0f;
+        v = (v | (v << 2)) & 0x33333333;
+        v = (v | (v << 1)) & 0x55555555;
+        return v;
+    };
+
+    return spread(x) | (spread(y) << 1);
+}
+
+// Inverse of mortonEncode
+inline glm::uvec2 mortonDecode(uint code)
+{
+    // Gather every other bit of v into the lower 16 bits
+    auto compact = [] (uint v)
+    {
+        v &= 0x55555555;
+        v = (v | (v >> 1)) & 0x33333333;
+        v = (v | (v >> 2)) & 0x0f0f0f0f;
+        v = (v | (v >> 4)) & 0x00ff00ff;
+        v = (v | (v >> 8)) & 0x0000ffff;
+        return v;
+    };
+
+    return glm::uvec2(compact(code), compact(code >> 1));
+}
+
+// Returns the luminance of a linear RGB colour (Rec. 709 weights)
+inline float luminance(const glm::vec3& rgb)
+{
+    return glm::dot(rgb, glm::vec3(0.2126f, 0.7152f, 0.0722f));
+}
+
 // Returns the nth value in the R2 sequence with seed s (low discrepancy sequence, results in faster convergence compared to random sampling)
 inline glm::vec2 R2(int n, glm::vec2 s) {
 	constexpr float phi2 = 1.3247179572f; // Plastic constant, solution to x^3 = x + 1
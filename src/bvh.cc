@@ -0,0 +1,381 @@
+#include <algorithm>
+#include <cmath>
+
+#include "bvh.hh"
+
+// Number of bins used to evaluate candidate splits along each axis
+constexpr int sahBinCount = 16;
+
+// Cost of visiting a node relative to the cost of intersecting a primitive, used by the SAH
+constexpr float sahTraversalCost = 1.0f;
+
+void BinaryBvh::build(const std::vector<Box>& boxes, std::vector<uint>& primitiveOrder, uint deferredSize)
+{
+    m_nodes.clear();
+    m_deferredSize = deferredSize;
+    primitiveOrder.clear();
+
+    if (boxes.empty()) return;
+
+    std::vector<BuildPrimitive> primitives;
+    primitives.reserve(boxes.size());
+
+    for (uint i = 0; i < boxes.size(); ++i)
+        primitives.push_back({ boxes[i], boxes[i].centre(), i });
+
+    // A binary tree with n leaves has 2n - 1 nodes
+    m_nodes.reserve(2 * boxes.size());
+    m_nodes.emplace_back();
+
+    buildRecursive(0, primitives, 0, (uint) primitives.size());
+
+    primitiveOrder.reserve(primitives.size());
+    for (const auto& primitive : primitives) primitiveOrder.push_back(primitive.index);
+}
+
+void BinaryBvh::buildRecursive(uint nodeIndex, std::vector<BuildPrimitive>& primitives, uint begin, uint end)
+{
+    uint count = end - begin;
+
+    // Compute the bounds of the node and of the primitive centres
+    Box bounds = Box::empty(), centreBounds = Box::empty();
+    for (uint i = begin; i < end; ++i)
+    {
+        bounds.grow(primitives[i].box);
+        centreBounds.grow(primitives[i].centre);
+    }
+
+    m_nodes[nodeIndex].bounds = bounds;
+
+    auto makeLeaf = [&] ()
+    {
+        m_nodes[nodeIndex].offset = begin;
+        m_nodes[nodeIndex].count  = count;
+    };
+
+    if (count == 1 || (count > bvhMaxLeafSize && count <= m_deferredSize))
+    {
+        makeLeaf();
+        return;
+    }
+
+    // Find the cheapest split according to the surface area heuristic. Primitives are sorted into
+    // bins by their centres, then each boundary between two bins is evaluated as a split plane
+    int bestAxis = -1, bestSplit = 0;
+    float bestCost = inf;
+
+    glm::vec3 centreExtent = centreBounds.extent();
+
+    for (int axis = 0; axis < 3; ++axis)
+    {
+        if (centreExtent[axis] <= 0.0f) continue; // All centres lie on a plane perpendicular to this axis
+
+        struct Bin { Box bounds = Box::empty(); uint count = 0; };
+        std::array<Bin, sahBinCount> bins;
+
+        float binScale = sahBinCount / centreExtent[axis];
+        for (uint i = begin; i < end; ++i)
+        {
+            int binIndex = glm::min(int((primitives[i].centre[axis] - centreBounds.min[axis]) * binScale), sahBinCount - 1);
+            bins[binIndex].bounds.grow(primitives[i].box);
+            bins[binIndex].count++;
+        }
+
+        // Sweep from the right to find the area and primitive count right of each boundary
+        std::array<float, sahBinCount> rightArea;
+        std::array<uint, sahBinCount> rightCount;
+        Box rightBounds = Box::empty(); uint rightSum = 0;
+        for (int split = sahBinCount - 1; split > 0; --split)
+        {
+            rightBounds.grow(bins[split].bounds);
+            rightSum += bins[split].count;
+            rightArea[split]  = rightBounds.surfaceArea();
+            rightCount[split] = rightSum;
+        }
+
+        // Sweep from the left, evaluating the cost of each split
+        Box leftBounds = Box::empty(); uint leftSum = 0;
+        for (int split = 1; split < sahBinCount; ++split)
+        {
+            leftBounds.grow(bins[split - 1].bounds);
+            leftSum += bins[split - 1].count;
+
+            if (leftSum == 0 || rightCount[split] == 0) continue;
+
+            float cost = leftBounds.surfaceArea() * leftSum + rightArea[split] * rightCount[split];
+            if (cost < bestCost)
+            {
+                bestCost  = cost;
+                bestAxis  = axis;
+                bestSplit = split;
+            }
+        }
+    }
+
+    uint middle;
+
+    if (bestAxis == -1)
+    {
+        // Every centre is in the same place so no split plane separates them
+        if (count <= bvhMaxLeafSize)
+        {
+            makeLeaf();
+            return;
+        }
+
+        middle = begin + count / 2;
+    }
+    else
+    {
+        // Compare the cost of splitting with the cost of intersecting every primitive in a leaf
+        float splitCost = sahTraversalCost + bestCost / bounds.surfaceArea();
+        if (splitCost >= (float) count && count <= bvhMaxLeafSize)
+        {
+            makeLeaf();
+            return;
+        }
+
+        float binScale = sahBinCount / centreExtent[bestAxis];
+        auto it = std::partition(primitives.begin() + begin, primitives.begin() + end, [&] (const BuildPrimitive& primitive)
+        {
+            int binIndex = glm::min(int((primitive.centre[bestAxis] - centreBounds.min[bestAxis]) * binScale), sahBinCount - 1);
+            return binIndex < bestSplit;
+        });
+
+        middle = (uint) (it - primitives.begin());
+    }
+
+    // The left child directly follows this node; the right child follows the whole left subtree
+    uint leftIndex = (uint) m_nodes.size();
+    m_nodes.emplace_back();
+    buildRecursive(leftIndex, primitives, begin, middle);
+
+    uint rightIndex = (uint) m_nodes.size();
+    m_nodes.emplace_back();
+    buildRecursive(rightIndex, primitives, middle, end);
+
+    m_nodes[nodeIndex].offset = rightIndex;
+    m_nodes[nodeIndex].count  = 0;
+}
+
+void WideBvh::build(const std::vector<Box>& boxes, std::vector<uint>& primitiveOrder, bool lazy)
+{
+    BinaryBvh binary;
+    binary.build(boxes, primitiveOrder, lazy ? bvhLazySubtreeSize : 0);
+    build(binary);
+
+    // Keep the boxes for building the lazy subtrees later
+    if (!m_lazySubtrees.empty())
+    {
+        m_lazyBoxes.reserve(boxes.size());
+        for (uint index : primitiveOrder) m_lazyBoxes.push_back(boxes[index]);
+    }
+}
+
+void WideBvh::build(const BinaryBvh& binary)
+{
+    m_nodes.clear();
+    m_lazySubtrees.clear();
+    m_lazyBoxes.clear();
+
+    if (binary.getNodes().empty()) return;
+
+    // Collapsing a binary tree into a 4-wide tree leaves roughly a third as many nodes
+    m_nodes.reserve(binary.getNodes().size() / 3 + 1);
+
+    m_cost = 0.0f;
+    collapse(binary, 0);
+    m_buildCost = m_cost;
+}
+
+void WideBvh::refit(const std::vector<Box>& boxes)
+{
+    // Children are stored after their parents, so walking the nodes backwards visits every child
+    // before its parent
+    std::vector<Box> nodeBounds(m_nodes.size());
+    m_cost = 0.0f;
+
+    for (std::size_t nodeIndex = m_nodes.size(); nodeIndex-- > 0;)
+    {
+        Node& node = m_nodes[nodeIndex];
+
+        std::array<Box, width> childBounds;
+        Box bounds = Box::empty();
+
+        for (int i = 0; i < node.childCount; ++i)
+        {
+            if (node.primitiveCount[i] == lazyChild)
+            {
+                // Start the subtree over, to be built around the primitives' new positions
+                auto& subtree = m_lazySubtrees[node.child[i]];
+                subtree = std::make_unique<LazySubtree>(subtree->begin, subtree->end);
+
+                childBounds[i] = Box::empty();
+                for (uint j = subtree->begin; j < subtree->end; ++j) childBounds[i].grow(boxes[j]);
+            }
+            else if (node.primitiveCount[i] > 0)
+            {
+                childBounds[i] = Box::empty();
+                for (uint j = node.child[i]; j < node.child[i] + node.primitiveCount[i]; ++j) childBounds[i].grow(boxes[j]);
+            }
+            else
+            {
+                childBounds[i] = nodeBounds[node.child[i]];
+            }
+
+            bounds.grow(childBounds[i]);
+        }
+
+        quantize(node, bounds, childBounds.data());
+        nodeBounds[nodeIndex] = bounds;
+        m_cost += bounds.surfaceArea();
+    }
+
+    if (!m_lazySubtrees.empty()) m_lazyBoxes = boxes;
+}
+
+std::size_t WideBvh::getMemoryFootprint() const
+{
+    std::size_t footprint = m_nodes.size() * sizeof(Node);
+
+    for (const auto& subtree : m_lazySubtrees)
+        if (subtree->built) footprint += subtree->bvh.getMemoryFootprint() + subtree->order.size() * sizeof(uint);
+
+    return footprint;
+}
+
+const WideBvh::LazySubtree& WideBvh::getLazySubtree(uint index) const
+{
+    LazySubtree& subtree = *m_lazySubtrees[index];
+
+    std::call_once(subtree.buildFlag, [&]
+    {
+        std::vector<Box> boxes(m_lazyBoxes.begin() + subtree.begin, m_lazyBoxes.begin() + subtree.end);
+        subtree.bvh.build(boxes, subtree.order);
+        subtree.built = true;
+    });
+
+    return subtree;
+}
+
+void WideBvh::quantize(Node& node, const Box& bounds, const Box* childBounds)
+{
+    // Choose the smallest power-of-two scale per axis such that 255 steps cover the node's box
+    node.origin = bounds.min;
+
+    glm::vec3 scale;
+    for (int axis = 0; axis < 3; ++axis)
+    {
+        float extent = bounds.max[axis] - node.origin[axis];
+
+        int exponent;
+        std::frexp(extent / 255.0f, &exponent);
+        exponent = glm::clamp(exponent, -100, 100);
+
+        // Guard against rounding in the division
+        while (node.origin[axis] + 255.0f * exp2i(exponent) < bounds.max[axis]) ++exponent;
+
+        node.exponent[axis] = (std::int8_t) exponent;
+        scale[axis] = exp2i(exponent);
+    }
+
+    for (int i = 0; i < node.childCount; ++i)
+    {
+        // Quantize the child's bounds, rounding outwards so the decoded box is never smaller
+        for (int axis = 0; axis < 3; ++axis)
+        {
+            int lo = (int) std::floor((childBounds[i].min[axis] - node.origin[axis]) / scale[axis]);
+            int hi = (int) std::ceil((childBounds[i].max[axis] - node.origin[axis]) / scale[axis]);
+            lo = glm::clamp(lo, 0, 255);
+            hi = glm::clamp(hi, 0, 255);
+
+            while (lo > 0   && node.origin[axis] + lo * scale[axis] > childBounds[i].min[axis]) --lo;
+            while (hi < 255 && node.origin[axis] + hi * scale[axis] < childBounds[i].max[axis]) ++hi;
+
+            node.lo[axis][i] = (glm::u8) lo;
+            node.hi[axis][i] = (glm::u8) hi;
+        }
+    }
+}
+
+uint WideBvh::collapse(const BinaryBvh& binary, uint binaryIndex)
+{
+    const auto& binaryNodes = binary.getNodes();
+    const auto& binaryNode  = binaryNodes[binaryIndex];
+
+    // Gather up to four descendants of the binary node to become the children of the wide node by
+    // repeatedly opening the interior child with the largest surface area
+    std::array<uint, width> children;
+    int childCount = 0;
+
+    if (binaryNode.count > 0)
+    {
+        children[childCount++] = binaryIndex; // Only happens when the root is a leaf
+    }
+    else
+    {
+        children[childCount++] = binaryIndex + 1;
+        children[childCount++] = binaryNode.offset;
+
+        while (childCount < width)
+        {
+            int largest = -1; float largestArea = -1.0f;
+            for (int i = 0; i < childCount; ++i)
+            {
+                const auto& child = binaryNodes[children[i]];
+                if (child.count == 0 && child.bounds.surfaceArea() > largestArea)
+                {
+                    largest = i;
+                    largestArea = child.bounds.surfaceArea();
+                }
+            }
+
+            if (largest == -1) break; // All children are leaves
+
+            uint opened = children[largest];
+            children[largest] = opened + 1;
+            children[childCount++] = binaryNodes[opened].offset;
+        }
+    }
+
+    uint nodeIndex = (uint) m_nodes.size();
+    m_nodes.emplace_back();
+
+    Node node = {};
+    node.childCount = (glm::u8) childCount;
+
+    std::array<Box, width> childBounds;
+    for (int i = 0; i < childCount; ++i) childBounds[i] = binaryNodes[children[i]].bounds;
+
+    quantize(node, binaryNode.bounds, childBounds.data());
+    m_cost += binaryNode.bounds.surfaceArea();
+
+    // Leaves reference their primitives directly; interior children are collapsed recursively,
+    // which places each subtree directly after its parent (depth-first order)
+    for (int i = 0; i < childCount; ++i)
+    {
+        const auto& child = binaryNodes[children[i]];
+
+        if (child.count > bvhMaxLeafSize)
+        {
+            // A leaf that the binary BVH deferred, to be built when a ray first reaches it
+            node.child[i] = (uint) m_lazySubtrees.size();
+            node.primitiveCount[i] = lazyChild;
+            m_lazySubtrees.push_back(std::make_unique<LazySubtree>(child.offset, child.offset + child.count));
+        }
+        else if (child.count > 0)
+        {
+            node.child[i] = child.offset;
+            node.primitiveCount[i] = (glm::u8) child.count;
+        }
+        else
+        {
+            node.child[i] = collapse(binary, children[i]);
+            node.primitiveCount[i] = 0;
+        }
+    }
+
+    m_nodes[nodeIndex] = node;
+
+    return nodeIndex;
+}
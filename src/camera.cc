@@ -27,6 +27,29 @@ Ray PerspectiveCamera::getPrimaryRay(const glm::vec2& coord) const {
     // Calculate ray direction, assuming that the camera is facing along the z axis
     glm::vec3 rayDir = normalize(pixelPos);
 
+    Ray ray;
+    ray.o = this->position;
+    ray.d = getRotation() * rayDir;
+
+    return ray;
+}
+
+bool PerspectiveCamera::project(const glm::vec3& pos, glm::vec2& coord) const {
+    // Undo the camera's rotation, so that the camera faces along the z axis again. The inverse of a
+    // rotation matrix is its transpose
+    glm::vec3 localPos = glm::transpose(getRotation()) * (pos - this->position);
+    if (localPos.z <= 0.0f) return false;
+
+    // Scale the direction back onto the screen, then undo the mapping from coord to the screen
+    // in getPrimaryRay
+    float perpendicularDistance = 0.5f / glm::tan(0.5f * fov * degrees);
+    glm::vec3 pixelPos = localPos * (perpendicularDistance / localPos.z);
+
+    coord = glm::vec2(0.5f - pixelPos.x, 0.5f - pixelPos.y * aspectRatio);
+    return true;
+}
+
+glm::mat3 PerspectiveCamera::getRotation() const {
     // Compute sine and cosine of yaw and pitch angles
     float cosYaw   = cos(rotation.x * degrees), sinYaw   = sin(rotation.x * degrees);
     float cosPitch = cos(rotation.y * degrees), sinPitch = sin(rotation.y * degrees);
@@ -35,9 +58,11 @@ Ray PerspectiveCamera::getPrimaryRay(const glm::vec2& coord) const {
     glm::mat3 rotateYaw   = glm::mat3(cosYaw, 0.0f, -sinYaw, 0.0f, 1.0f, 0.0f, sinYaw, 0.0f, cosYaw);
     glm::mat3 rotatePitch = glm::mat3(1.0f, 0.0f, 0.0f, 0.0f, cosPitch, sinPitch, 0.0f, -sinPitch, cosPitch);
 
-    Ray ray;
-    ray.o = this->position;
-    ray.d = rotateYaw * (rotatePitch * rayDir);
+    return rotateYaw * rotatePitch;
+}
 
-    return ray;
-}
\ No newline at end of file
+float PerspectiveCamera::getPixelSpreadAngle(glm::ivec2 imageSize) const {
+    // The screen is 1.0 wide at a distance of 0.5 / tan(fov / 2) from the camera (see above), so
+    // one pixel is 1 / width wide at that distance
+    return 2.0f * glm::tan(0.5f * fov * degrees) / (float) imageSize.x;
+}
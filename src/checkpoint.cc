@@ -0,0 +1,111 @@
+#include <cstdio>
+
+#if defined(_WIN32)
+#define NOMINMAX
+#define WIN32_LEAN_AND_MEAN
+#include <io.h>
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+#include <fmt/format.h>
+
+#include "checkpoint.hh"
+
+// Makes sure that everything written to a file has reached the disk
+static bool syncFile(FILE* file)
+{
+    if (std::fflush(file) != 0) return false;
+
+#if defined(_WIN32)
+    return _commit(_fileno(file)) == 0;
+#else
+    return fsync(fileno(file)) == 0;
+#endif
+}
+
+#if !defined(_WIN32)
+// Makes sure that a rename inside a directory has reached the disk
+static void syncDirectory(const std::string& path)
+{
+    std::size_t separator = path.find_last_of('/');
+    std::string directory = separator == std::string::npos ? "." : separator == 0 ? "/" : path.substr(0, separator);
+
+    int file = open(directory.c_str(), O_RDONLY);
+    if (file < 0) return;
+
+    fsync(file);
+    close(file);
+}
+#endif
+
+bool Checkpoint::saveToFile(const std::string& path) const
+{
+    std::string temporaryPath = path + ".tmp";
+
+    FILE* file = std::fopen(temporaryPath.c_str(), "wb");
+    if (file == nullptr) return false;
+
+    // Write the copied values, with the referenced blocks in their places between them
+    auto writeBytes = [&] (const void* data, std::size_t size) { return std::fwrite(data, 1, size, file) == size; };
+
+    bool success = true;
+    std::size_t position = 0;
+    for (const auto& reference : m_references)
+    {
+        success = success && writeBytes(m_data.data() + position, reference.offset - position) && writeBytes(reference.data, reference.size);
+        position = reference.offset;
+    }
+
+    success = success && writeBytes(m_data.data() + position, m_data.size() - position);
+
+    // The data has to be on the disk before the rename is, or a power loss could leave the new name
+    // pointing to a truncated file
+    success = syncFile(file) && success;
+    success = std::fclose(file) == 0 && success;
+
+    if (!success)
+    {
+        std::remove(temporaryPath.c_str());
+        return false;
+    }
+
+#if defined(_WIN32)
+    // Replaces the old file in one step, returning once the move is on the disk
+    return MoveFileExA(temporaryPath.c_str(), path.c_str(), MOVEFILE_REPLACE_EXISTING | MOVEFILE_WRITE_THROUGH) != 0;
+#else
+    // Renaming replaces the old file in one step
+    if (std::rename(temporaryPath.c_str(), path.c_str()) != 0) return false;
+
+    syncDirectory(path);
+    return true;
+#endif
+}
+
+bool Checkpoint::loadFromFile(const std::string& path)
+{
+    m_file.close();
+    m_file.clear();
+    m_file.open(path, std::ios_base::in | std::ios_base::binary);
+
+    return (bool) m_file;
+}
+
+void CheckpointSaver::save(Checkpoint&& checkpoint, const std::string& path)
+{
+    wait();
+
+    m_saving = true;
+    m_thread = std::thread([this, checkpoint = std::move(checkpoint), path]
+    {
+        if (!checkpoint.saveToFile(path)) fmt::print("Failed to save checkpoint: {}\n", path);
+        m_saving = false;
+    });
+}
+
+void CheckpointSaver::wait()
+{
+    if (m_thread.joinable()) m_thread.join();
+}
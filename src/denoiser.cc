@@ -0,0 +1,139 @@
+#include <vector>
+
+#include <fmt/format.h>
+#include <glm/glm.hpp>
+#include <stb/stb_image.h>
+#include <stb/stb_image_write.h>
+
+#include "denoiser.hh"
+
+// Smallest albedo that radiance is divided by when removing the albedo from the image
+constexpr float minAlbedo = 0.01f;
+
+Denoiser::Denoiser(glm::ivec2 size, PixelLayout layout, ImageBacking backing) :
+    m_ping(size, layout, backing),
+    m_pong(size, layout, backing)
+{}
+
+void Denoiser::denoise(
+    const Image<glm::vec3>& radiance,
+    const Image<float>& luminanceMoment,
+    const Image<glm::vec3, CompactVec3>& albedo,
+    const Image<glm::vec3, CompactVec3>& normal,
+    const Image<float>& sampleCount,
+    Image<glm::vec3, CompactColor>& output,
+    ThreadPool& pool
+) {
+    const glm::ivec2 size = radiance.getSize();
+
+    // 1D B3-spline kernel; the 2D kernel is the outer product with itself
+    constexpr float kernel[3] = { 3.0f / 8.0f, 1.0f / 4.0f, 1.0f / 16.0f };
+
+    // Remove the albedo, leaving only the irradiance to be filtered, and estimate the variance of
+    // each pixel's mean from the moments of its samples
+    m_ping.process([&] (glm::ivec2 pos)
+    {
+        glm::vec3 pixelAlbedo = glm::max(albedo.load(pos), glm::vec3(minAlbedo));
+        glm::vec3 color = radiance.load(pos);
+
+        float mean = luminance(color);
+        float sampleVariance = glm::max(luminanceMoment.load(pos) - mean * mean, 0.0f);
+        float variance = sampleVariance / glm::max(sampleCount.load(pos), 1.0f) / glm::pow(luminance(pixelAlbedo), 2.0f);
+
+        return glm::vec4(color / pixelAlbedo, variance);
+    }, pool);
+
+    // With few samples per pixel, most pixels' samples may all have missed the light, giving them
+    // no variance. The spread of luminance among neighbouring pixels is a more robust estimate of
+    // the noise then, so take whichever estimate is larger
+    m_pong.process([&] (glm::ivec2 pos)
+    {
+        glm::vec4 centre = m_ping.load(pos);
+
+        float sum = 0.0f, squareSum = 0.0f;
+        int count = 0;
+
+        for (int y = -2; y <= 2; ++y)
+        {
+            for (int x = -2; x <= 2; ++x)
+            {
+                glm::ivec2 tapPos = pos + glm::ivec2(x, y);
+                if (tapPos.x < 0 || tapPos.y < 0 || tapPos.x >= size.x || tapPos.y >= size.y) continue;
+
+                float tapLuminance = luminance(xyz(m_ping.load(tapPos)));
+                sum += tapLuminance;
+                squareSum += tapLuminance * tapLuminance;
+                ++count;
+            }
+        }
+
+        float mean = sum / count;
+        float spatialVariance = glm::max(squareSum / count - mean * mean, 0.0f);
+
+        return glm::vec4(xyz(centre), glm::max(centre.w, spatialVariance));
+    }, pool);
+
+    Image<glm::vec4, CompactVec4>* source = &m_pong;
+    Image<glm::vec4, CompactVec4>* target = &m_ping;
+
+    for (int iteration = 0; iteration < iterationCount; ++iteration)
+    {
+        const int stepSize = 1 << iteration;
+        const float albedoWeightScale = -1.0f / (albedoPhi * albedoPhi);
+
+        target->process([&] (glm::ivec2 pos)
+        {
+            glm::vec4 centre       = source->load(pos);
+            glm::vec3 centreNormal = normal.load(pos);
+            glm::vec3 centreAlbedo = albedo.load(pos);
+
+            float centreLuminance = luminance(xyz(centre));
+            float colorWeightScale = -1.0f / (colorPhi * glm::sqrt(centre.w) + eps);
+
+            // The centre tap always has full weight
+            float weightSum = kernel[0] * kernel[0];
+            glm::vec3 colorSum = xyz(centre) * weightSum;
+            float varianceSum = centre.w * weightSum * weightSum;
+
+            for (int y = -2; y <= 2; ++y)
+            {
+                for (int x = -2; x <= 2; ++x)
+                {
+                    if (x == 0 && y == 0) continue;
+
+                    glm::ivec2 tapPos = pos + glm::ivec2(x, y) * stepSize;
+                    if (tapPos.x < 0 || tapPos.y < 0 || tapPos.x >= size.x || tapPos.y >= size.y) continue;
+
+                    glm::vec4 tap       = source->load(tapPos);
+                    glm::vec3 tapNormal = normal.load(tapPos);
+                    glm::vec3 tapAlbedo = albedo.load(tapPos);
+
+                    // Edge-stopping weights
+                    float normalWeight = glm::max(glm::dot(tapNormal, centreNormal), 0.0f);
+                    for (int i = 0; i < normalSharpness; ++i) normalWeight *= normalWeight;
+
+                    glm::vec3 albedoDelta = tapAlbedo - centreAlbedo;
+                    float colorWeight = glm::abs(luminance(xyz(tap)) - centreLuminance) * colorWeightScale;
+                    float albedoWeight = glm::dot(albedoDelta, albedoDelta) * albedoWeightScale;
+
+                    float weight = kernel[glm::abs(x)] * kernel[glm::abs(y)] * normalWeight * glm::exp(colorWeight + albedoWeight);
+
+                    colorSum    += xyz(tap) * weight;
+                    varianceSum += tap.w * weight * weight;
+                    weightSum   += weight;
+                }
+            }
+
+            // The variance of a weighted sum is the sum of the variances times the squared weights
+            return glm::vec4(colorSum / weightSum, varianceSum / (weightSum * weightSum));
+        }, pool);
+
+        std::swap(source, target);
+    }
+
+    // Multiply the albedo back in
+    output.process([&] (glm::ivec2 pos)
+    {
+        return xyz(source->load(pos)) * glm::max(albedo.load(pos), glm::vec3(minAlbedo));
+    }, pool);
+}
@@ -0,0 +1,178 @@
+#include <algorithm>
+#include <cmath>
+
+#include <glm/glm.hpp>
+
+#include "guiding.hh"
+
+// Cells with fewer recorded samples than this in a round of training are not guided, because their
+// distributions would be mostly noise
+constexpr int minGuideSampleCount = 32;
+
+// Training values are summed as fixed point numbers with this many steps per unit. Integer addition
+// gives the same sums in whatever order the threads record their values, where float addition
+// would not, so a guided render comes out the same every time
+constexpr double guideFixedPointScale = 65536.0;
+
+// Recorded values are clamped to this, so that at least 2^24 of them fit in each bin of a round
+// of training without overflowing
+constexpr double maxGuideValue = 16777216.0;
+
+void PathGuide::reset(const Box& bounds, int resolution)
+{
+    m_bounds = bounds;
+    m_resolution = glm::max(resolution, 1);
+
+    std::size_t cellCount = (std::size_t) m_resolution * m_resolution * m_resolution;
+
+    m_training = std::vector<std::atomic<std::uint64_t>>(cellCount * binCount);
+    m_sampleCounts = std::vector<std::atomic<int>>(cellCount);
+    for (auto& value : m_training) value.store(0, std::memory_order_relaxed);
+    for (auto& count : m_sampleCounts) count.store(0, std::memory_order_relaxed);
+
+    m_cdf.assign(cellCount * binCount, 0.0f);
+    m_trained.assign(cellCount, false);
+}
+
+int PathGuide::getCellIndex(const glm::vec3& pos) const
+{
+    glm::vec3 relative = (pos - m_bounds.min) / glm::max(m_bounds.extent(), glm::vec3(eps));
+    glm::ivec3 cell = glm::clamp(glm::ivec3(relative * (float) m_resolution), glm::ivec3(0), glm::ivec3(m_resolution - 1));
+
+    return (cell.z * m_resolution + cell.y) * m_resolution + cell.x;
+}
+
+int PathGuide::getBinIndex(const glm::vec3& direction)
+{
+    float cosTheta = glm::clamp(direction.z, -1.0f, 1.0f);
+    float phi = std::atan2(direction.y, direction.x);
+
+    int zIndex   = glm::clamp((int) ((cosTheta + 1.0f) * 0.5f * directionResolution), 0, directionResolution - 1);
+    int phiIndex = glm::clamp((int) ((phi + pi) / tau * directionResolution), 0, directionResolution - 1);
+
+    return zIndex * directionResolution + phiIndex;
+}
+
+void PathGuide::record(const glm::vec3& pos, const glm::vec3& direction, float value)
+{
+    if (m_resolution == 0 || !(value > 0.0f) || std::isinf(value)) return;
+
+    int cell = getCellIndex(pos);
+    auto fixedValue = (std::uint64_t) (glm::min((double) value, maxGuideValue) * guideFixedPointScale + 0.5);
+    m_training[(std::size_t) cell * binCount + getBinIndex(direction)].fetch_add(fixedValue, std::memory_order_relaxed);
+    m_sampleCounts[cell].fetch_add(1, std::memory_order_relaxed);
+}
+
+void PathGuide::update()
+{
+    for (std::size_t cell = 0; cell < m_trained.size(); ++cell)
+    {
+        std::atomic<std::uint64_t>* training = &m_training[cell * binCount];
+        float* cdf = &m_cdf[cell * binCount];
+
+        std::uint64_t sums[binCount];
+        std::uint64_t total = 0;
+        for (int bin = 0; bin < binCount; ++bin)
+        {
+            total += training[bin].load(std::memory_order_relaxed);
+            sums[bin] = total;
+            training[bin].store(0, std::memory_order_relaxed);
+        }
+
+        m_trained[cell] = m_sampleCounts[cell].load(std::memory_order_relaxed) >= minGuideSampleCount && total > 0;
+        m_sampleCounts[cell].store(0, std::memory_order_relaxed);
+
+        for (int bin = 0; bin < binCount; ++bin)
+            cdf[bin] = m_trained[cell] ? (float) ((double) sums[bin] / (double) total) : 0.0f;
+    }
+}
+
+int PathGuide::getCell(const glm::vec3& pos) const
+{
+    if (m_resolution == 0) return -1;
+
+    int cell = getCellIndex(pos);
+    return m_trained[cell] ? cell : -1;
+}
+
+glm::vec3 PathGuide::sample(int cell, const glm::vec2& random) const
+{
+    const float* cdf = &m_cdf[(std::size_t) cell * binCount];
+
+    // Choose a bin, then reuse the part of random.x within the bin's range of the CDF as the
+    // position within the bin
+    int bin = glm::min((int) (std::upper_bound(cdf, cdf + binCount, random.x) - cdf), binCount - 1);
+    float begin = bin > 0 ? cdf[bin - 1] : 0.0f;
+    float withinBin = glm::clamp((random.x - begin) / glm::max(cdf[bin] - begin, eps), 0.0f, 1.0f);
+
+    int zIndex = bin / directionResolution, phiIndex = bin % directionResolution;
+
+    float cosTheta = -1.0f + 2.0f * (zIndex + withinBin) / directionResolution;
+    float phi = -pi + tau * (phiIndex + random.y) / directionResolution;
+    float sinTheta = glm::sqrt(glm::max(1.0f - cosTheta * cosTheta, 0.0f));
+
+    return glm::vec3(sinTheta * glm::cos(phi), sinTheta * glm::sin(phi), cosTheta);
+}
+
+float PathGuide::getPdf(int cell, const glm::vec3& direction) const
+{
+    const float* cdf = &m_cdf[(std::size_t) cell * binCount];
+
+    int bin = getBinIndex(direction);
+    float probability = cdf[bin] - (bin > 0 ? cdf[bin - 1] : 0.0f);
+
+    // Every bin covers the same solid angle
+    return probability * binCount / (4.0f * pi);
+}
+
+void PathGuide::saveCheckpoint(Checkpoint& checkpoint) const
+{
+    checkpoint.write(m_bounds);
+    checkpoint.write(m_resolution);
+
+    for (const auto& value : m_training) checkpoint.write(value.load(std::memory_order_relaxed));
+    for (const auto& count : m_sampleCounts) checkpoint.write(count.load(std::memory_order_relaxed));
+    checkpoint.writeBytes(m_cdf.data(), m_cdf.size() * sizeof(float));
+    for (bool trained : m_trained) checkpoint.write(trained);
+}
+
+bool PathGuide::loadCheckpoint(Checkpoint& checkpoint)
+{
+    Box bounds;
+    int resolution;
+    if (!checkpoint.read(bounds) || !checkpoint.read(resolution)) return false;
+
+    // A guide that was never reset has no cells
+    if (resolution == 0)
+    {
+        *this = PathGuide();
+        return true;
+    }
+
+    reset(bounds, resolution);
+
+    for (auto& value : m_training)
+    {
+        std::uint64_t sum;
+        if (!checkpoint.read(sum)) return false;
+        value.store(sum, std::memory_order_relaxed);
+    }
+
+    for (auto& count : m_sampleCounts)
+    {
+        int sampleCount;
+        if (!checkpoint.read(sampleCount)) return false;
+        count.store(sampleCount, std::memory_order_relaxed);
+    }
+
+    if (!checkpoint.readBytes(m_cdf.data(), m_cdf.size() * sizeof(float))) return false;
+
+    for (std::size_t cell = 0; cell < m_trained.size(); ++cell)
+    {
+        bool trained;
+        if (!checkpoint.read(trained)) return false;
+        m_trained[cell] = trained;
+    }
+
+    return true;
+}
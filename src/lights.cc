@@ -0,0 +1,315 @@
+#include <algorithm>
+#include <cassert>
+#include <cmath>
+
+#include <glm/glm.hpp>
+
+#include "lights.hh"
+
+// Number of bins used to evaluate candidate splits along each axis
+constexpr int lightBinCount = 12;
+
+// Number of bits in a light's bit trail, and so the deepest a leaf of the light tree may be
+constexpr int lightMaxDepth = 64;
+
+// Returns the number of levels of median splits needed to separate `count` lights, ceil(log2(count))
+static int getMedianSplitDepth(uint count)
+{
+    int depth = 0;
+    while (depth < 32 && ((std::uint64_t) 1 << depth) < count) ++depth;
+    return depth;
+}
+
+// A cone of directions, treated as a double cone because the lights emit from both sides
+struct NormalCone
+{
+    glm::vec3 axis;
+    float angle; // Half-angle, up to pi/2
+
+    // Returns the smallest double cone found by the construction in Estevez and Kulla 2018 that
+    // contains both cones
+    static NormalCone merge(NormalCone a, NormalCone b)
+    {
+        // Either direction of a double cone's axis describes the same cone, so use the one closest to a's
+        if (glm::dot(a.axis, b.axis) < 0.0f) b.axis = -b.axis;
+        if (a.angle < b.angle) std::swap(a, b);
+
+        float angleBetween = glm::acos(glm::clamp(glm::dot(a.axis, b.axis), -1.0f, 1.0f));
+        if (angleBetween + b.angle <= a.angle) return a; // b is already inside a
+
+        float angle = 0.5f * (a.angle + angleBetween + b.angle);
+        if (angle >= 0.5f * pi) return { a.axis, 0.5f * pi };
+
+        // Rotate a's axis towards b's so that the new cone just touches the far sides of both
+        float rotation = angle - a.angle;
+        glm::vec3 ortho = b.axis - a.axis * glm::dot(a.axis, b.axis);
+        if (glm::dot(ortho, ortho) < eps) return { a.axis, angle };
+
+        return { glm::normalize(a.axis * glm::cos(rotation) + glm::normalize(ortho) * glm::sin(rotation)), angle };
+    }
+};
+
+void LightTree::build(std::vector<LightTriangle> lights)
+{
+    m_lights = std::move(lights);
+    m_nodes.clear();
+
+    if (m_lights.empty()) return;
+
+    // A binary tree with n leaves has 2n - 1 nodes
+    m_nodes.reserve(2 * m_lights.size());
+    buildNode(0, (uint) m_lights.size(), 0, 0);
+}
+
+uint LightTree::buildNode(uint begin, uint end, std::uint64_t bitTrail, int depth)
+{
+    uint nodeIndex = (uint) m_nodes.size();
+    m_nodes.emplace_back();
+
+    // Bound the lights' positions, normals and power
+    Box bounds = Box::empty(), centreBounds = Box::empty();
+    NormalCone cone = { m_lights[begin].normal, 0.0f };
+    float power = 0.0f;
+
+    for (uint i = begin; i < end; ++i)
+    {
+        const auto& light = m_lights[i];
+        Box box = light.getBoundingBox();
+
+        bounds.grow(box);
+        centreBounds.grow(box.centre());
+        cone = NormalCone::merge(cone, { light.normal, 0.0f });
+        power += luminance(light.emission) * light.area;
+    }
+
+    m_nodes[nodeIndex] = { bounds, cone.axis, cone.angle, power, 0, false };
+
+    if (end - begin == 1)
+    {
+        m_lights[begin].bitTrail = bitTrail;
+        m_nodes[nodeIndex].offset = begin;
+        m_nodes[nodeIndex].isLeaf = true;
+        return nodeIndex;
+    }
+
+    auto getCentre = [] (const LightTriangle& light) { return light.getBoundingBox().centre(); };
+
+    // Find the binned split that minimizes the sum of each side's power times its surface area, so
+    // that bright lights end up in small nodes
+    int bestAxis = -1;
+    float bestPosition = 0.0f;
+    float bestCost = inf;
+
+    glm::vec3 centreExtent = centreBounds.extent();
+
+    // A binned split may leave all but one light on one side, while median splits below a node
+    // finish within getMedianSplitDepth() levels. Only bin while the larger side could still be
+    // split at the median without its bit trails overflowing
+    bool canBin = depth + 1 + getMedianSplitDepth(end - begin - 1) <= lightMaxDepth;
+
+    for (int axis = 0; axis < 3 && canBin; ++axis)
+    {
+        if (centreExtent[axis] <= 0.0f) continue;
+
+        Box binBounds[lightBinCount];
+        float binPower[lightBinCount] = {};
+        uint binCount[lightBinCount] = {};
+        for (auto& box : binBounds) box = Box::empty();
+
+        float scale = lightBinCount / centreExtent[axis];
+        for (uint i = begin; i < end; ++i)
+        {
+            const auto& light = m_lights[i];
+            int bin = glm::min((int) ((getCentre(light)[axis] - centreBounds.min[axis]) * scale), lightBinCount - 1);
+
+            binBounds[bin].grow(light.getBoundingBox());
+            binPower[bin] += luminance(light.emission) * light.area;
+            ++binCount[bin];
+        }
+
+        // Sweep from the right to get the cost of everything right of each split
+        float rightCost[lightBinCount];
+        Box rightBox = Box::empty();
+        float rightPower = 0.0f;
+        for (int bin = lightBinCount - 1; bin > 0; --bin)
+        {
+            rightBox.grow(binBounds[bin]);
+            rightPower += binPower[bin];
+            rightCost[bin] = rightPower * rightBox.surfaceArea();
+        }
+
+        Box leftBox = Box::empty();
+        float leftPower = 0.0f;
+        uint leftCount = 0;
+        for (int bin = 0; bin < lightBinCount - 1; ++bin)
+        {
+            leftBox.grow(binBounds[bin]);
+            leftPower += binPower[bin];
+            leftCount += binCount[bin];
+
+            // Both sides must contain a light
+            if (leftCount == 0 || leftCount == end - begin) continue;
+
+            float cost = leftPower * leftBox.surfaceArea() + rightCost[bin + 1];
+            if (cost < bestCost)
+            {
+                bestCost = cost;
+                bestAxis = axis;
+                bestPosition = centreBounds.min[axis] + (bin + 1) / scale;
+            }
+        }
+    }
+
+    auto first = m_lights.begin() + begin, last = m_lights.begin() + end;
+    auto middle = last;
+
+    if (bestAxis >= 0)
+    {
+        middle = std::partition(first, last, [&] (const LightTriangle& light)
+        {
+            return getCentre(light)[bestAxis] < bestPosition;
+        });
+    }
+
+    // Split at the median of the longest axis if the binned split failed to separate the lights
+    if (middle == first || middle == last)
+    {
+        int axis = centreExtent.x > centreExtent.y ? (centreExtent.x > centreExtent.z ? 0 : 2) : (centreExtent.y > centreExtent.z ? 1 : 2);
+
+        middle = first + (end - begin) / 2;
+        std::nth_element(first, middle, last, [&] (const LightTriangle& a, const LightTriangle& b)
+        {
+            return getCentre(a)[axis] < getCentre(b)[axis];
+        });
+    }
+
+    uint split = (uint) (middle - m_lights.begin());
+    assert(depth < lightMaxDepth);
+
+    buildNode(begin, split, bitTrail, depth + 1);
+    m_nodes[nodeIndex].offset = buildNode(split, end, bitTrail | (std::uint64_t) 1 << depth, depth + 1);
+
+    return nodeIndex;
+}
+
+float LightTree::getImportance(const Node& node, const glm::vec3& pos, const glm::vec3& normal)
+{
+    glm::vec3 toCentre = node.bounds.centre() - pos;
+    float radius = 0.5f * glm::length(node.bounds.extent());
+
+    // Clamp the distance to the node's radius so that nodes around the point are not infinitely important
+    float distanceSquared = glm::max(glm::dot(toCentre, toCentre), radius * radius);
+    float distance = glm::sqrt(distanceSquared);
+    glm::vec3 direction = toCentre / glm::max(glm::length(toCentre), eps);
+
+    // Half-angle of the cone around `direction` that contains the node's bounding sphere
+    float boundsAngle = glm::asin(glm::min(radius / glm::max(distance, eps), 1.0f));
+
+    // The smallest angle that any of the lights' normals could make with the direction to the point
+    float emitterAngle = glm::acos(glm::min(glm::abs(glm::dot(node.axis, direction)), 1.0f));
+    float emitterCos = glm::cos(glm::max(emitterAngle - node.coneAngle - boundsAngle, 0.0f));
+
+    // The smallest angle that the direction to any of the lights could make with the point's normal
+    float receiverCos = 1.0f;
+    if (normal != glm::vec3(0.0f))
+    {
+        float receiverAngle = glm::acos(glm::clamp(glm::dot(normal, direction), -1.0f, 1.0f));
+        float angle = glm::max(receiverAngle - boundsAngle, 0.0f);
+        if (angle >= 0.5f * pi) return 0.0f; // Entirely below the horizon
+
+        receiverCos = glm::cos(angle);
+    }
+
+    return node.power * emitterCos * receiverCos / distanceSquared;
+}
+
+float LightTree::getLeftProbability(uint nodeIndex, const glm::vec3& pos, const glm::vec3& normal) const
+{
+    float left  = getImportance(m_nodes[nodeIndex + 1], pos, normal);
+    float right = getImportance(m_nodes[m_nodes[nodeIndex].offset], pos, normal);
+
+    // Neither child looks important, but the parent did; fall back to an even choice
+    if (left + right <= 0.0f) return 0.5f;
+
+    return left / (left + right);
+}
+
+int LightTree::pick(const glm::vec3& pos, const glm::vec3& normal, float random, float& pmf) const
+{
+    pmf = 0.0f;
+    if (m_nodes.empty() || getImportance(m_nodes[0], pos, normal) <= 0.0f) return -1;
+
+    pmf = 1.0f;
+    uint nodeIndex = 0;
+
+    while (!m_nodes[nodeIndex].isLeaf)
+    {
+        float leftProbability = getLeftProbability(nodeIndex, pos, normal);
+
+        // Choose a child, and stretch the part of [0, 1) it was chosen from back over [0, 1) so that
+        // the same random number can be used for the next choice
+        if (random < leftProbability)
+        {
+            random /= leftProbability;
+            pmf *= leftProbability;
+            nodeIndex = nodeIndex + 1;
+        }
+        else
+        {
+            random = (random - leftProbability) / (1.0f - leftProbability);
+            pmf *= 1.0f - leftProbability;
+            nodeIndex = m_nodes[nodeIndex].offset;
+        }
+
+        random = glm::min(random, 1.0f - eps);
+    }
+
+    return (int) m_nodes[nodeIndex].offset;
+}
+
+float LightTree::getPickProbability(const glm::vec3& pos, const glm::vec3& normal, int lightIndex) const
+{
+    if (m_nodes.empty() || getImportance(m_nodes[0], pos, normal) <= 0.0f) return 0.0f;
+
+    float pmf = 1.0f;
+    uint nodeIndex = 0;
+    std::uint64_t bitTrail = m_lights[lightIndex].bitTrail;
+
+    // Follow the light's bit trail down to its leaf
+    while (!m_nodes[nodeIndex].isLeaf)
+    {
+        float leftProbability = getLeftProbability(nodeIndex, pos, normal);
+
+        if ((bitTrail & 1) == 0)
+        {
+            pmf *= leftProbability;
+            nodeIndex = nodeIndex + 1;
+        }
+        else
+        {
+            pmf *= 1.0f - leftProbability;
+            nodeIndex = m_nodes[nodeIndex].offset;
+        }
+
+        bitTrail >>= 1;
+    }
+
+    return pmf;
+}
+
+LightSample LightTree::sample(int lightIndex, const glm::vec2& random) const
+{
+    const auto& light = m_lights[lightIndex];
+
+    // Uniformly distributed barycentric coordinates
+    float s = glm::sqrt(random.x);
+    glm::vec2 barycentrics(s * (1.0f - random.y), s * random.y);
+
+    LightSample sample;
+    sample.pos      = light.v0 + light.edge1 * barycentrics.x + light.edge2 * barycentrics.y;
+    sample.normal   = light.normal;
+    sample.emission = light.emission;
+    sample.pdf      = 1.0f / light.area;
+
+    return sample;
+}
@@ -0,0 +1,267 @@
+#include <algorithm>
+
+#include <fmt/format.h>
+#include <glm/glm.hpp>
+#include <tinyobjloader/tiny_obj_loader.h>
+
+#include "loader.hh"
+
+// Number of triangles the loading thread reads between updates of its progress
+constexpr std::size_t loaderBatchSize = 4096;
+
+// Number of triangles the loading thread reads before building the first mesh
+constexpr std::size_t loaderMinChunkSize = 65536;
+
+SceneLoader::SceneLoader(const std::string& path, Scene& scene) :
+    m_path(path),
+    m_lazyBvh(scene.getLazyBvh()),
+    m_defaultMaterialIndex(scene.addMaterial(Material())),
+    m_objectOffset((uint) scene.getObjects().size())
+{
+    m_thread = std::thread([this] { load(); });
+}
+
+SceneLoader::~SceneLoader()
+{
+    m_cancelled = true;
+    if (m_thread.joinable()) m_thread.join();
+}
+
+void SceneLoader::load()
+{
+    m_file.open(m_path, std::ios_base::in | std::ios_base::binary);
+    if (!m_file)
+    {
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_error = fmt::format("Cannot open file {}\n", m_path);
+        }
+
+        buildMesh(true);
+        return;
+    }
+
+    m_file.seekg(0, std::ios_base::end);
+    m_fileSize = m_file.tellg();
+    m_file.seekg(0, std::ios_base::beg);
+
+    // Material libraries are relative to the model's directory
+    std::string baseDir = m_path;
+    auto separator = baseDir.find_last_of("/\\");
+    baseDir = separator == std::string::npos ? "" : baseDir.substr(0, separator + 1);
+    tinyobj::MaterialFileReader materialReader(baseDir);
+
+    // The callbacks are plain functions, so they find the loader through the user data pointer
+    tinyobj::callback_t callback;
+
+    callback.vertex_cb = [] (void* user, tinyobj::real_t x, tinyobj::real_t y, tinyobj::real_t z, tinyobj::real_t w)
+    {
+        auto loader = static_cast<SceneLoader*>(user);
+        loader->m_attrib.vertices.insert(loader->m_attrib.vertices.end(), { x, y, z });
+
+        // Stop reading once the loader is no longer wanted. A failed stream reads as its end
+        if (loader->m_cancelled) loader->m_file.setstate(std::ios_base::failbit);
+    };
+
+    callback.normal_cb = [] (void* user, tinyobj::real_t x, tinyobj::real_t y, tinyobj::real_t z)
+    {
+        auto& normals = static_cast<SceneLoader*>(user)->m_attrib.normals;
+        normals.insert(normals.end(), { x, y, z });
+    };
+
+    callback.texcoord_cb = [] (void* user, tinyobj::real_t x, tinyobj::real_t y, tinyobj::real_t z)
+    {
+        auto& texCoords = static_cast<SceneLoader*>(user)->m_attrib.texcoords;
+        texCoords.insert(texCoords.end(), { x, y });
+    };
+
+    callback.usemtl_cb = [] (void* user, const char* name, int materialId)
+    {
+        static_cast<SceneLoader*>(user)->m_materialId = materialId;
+    };
+
+    callback.mtllib_cb = [] (void* user, const tinyobj::material_t* materials, int materialCount)
+    {
+        // Every call passes all of the materials read so far
+        auto loader = static_cast<SceneLoader*>(user);
+        std::lock_guard<std::mutex> lock(loader->m_mutex);
+        loader->m_materials.assign(materials, materials + materialCount);
+    };
+
+    callback.object_cb = [] (void* user, const char* name)
+    {
+        auto loader = static_cast<SceneLoader*>(user);
+        loader->m_objectName = name;
+        loader->m_newObject = true;
+    };
+
+    callback.group_cb = [] (void* user, const char** names, int nameCount)
+    {
+        auto loader = static_cast<SceneLoader*>(user);
+        loader->m_objectName = nameCount > 0 ? names[0] : "";
+        loader->m_newObject = true;
+    };
+
+    callback.index_cb = [] (void* user, tinyobj::index_t* indices, int indexCount)
+    {
+        auto loader = static_cast<SceneLoader*>(user);
+        if (loader->m_cancelled) loader->m_file.setstate(std::ios_base::failbit);
+
+        if (loader->m_newObject)
+        {
+            std::lock_guard<std::mutex> lock(loader->m_mutex);
+            loader->m_objectNames.push_back(loader->m_objectName);
+            loader->m_newObject = false;
+        }
+
+        // OBJ indices count from 1, or back from the latest element if they are negative. Zero
+        // means there is no index
+        auto resolve = [] (int index, std::size_t count)
+        {
+            return index > 0 ? index - 1 : index < 0 ? (int) count + index : -1;
+        };
+
+        const auto& attrib = loader->m_attrib;
+        auto getIndex = [&] (const tinyobj::index_t& index)
+        {
+            tinyobj::index_t resolved;
+            resolved.vertex_index   = resolve(index.vertex_index, attrib.vertices.size() / 3);
+            resolved.normal_index   = resolve(index.normal_index, attrib.normals.size() / 3);
+            resolved.texcoord_index = resolve(index.texcoord_index, attrib.texcoords.size() / 2);
+            return resolved;
+        };
+
+        // Faces without a material, or with one that no material library defines, use the default
+        // material. The model's materials follow it in the scene
+        bool hasMaterial = loader->m_materialId >= 0 && loader->m_materialId < (int) loader->m_materials.size();
+        uint materialIndex = hasMaterial ? loader->m_defaultMaterialIndex + 1 + (uint) loader->m_materialId : loader->m_defaultMaterialIndex;
+        uint objectIndex = loader->m_objectOffset + (uint) loader->m_objectNames.size() - 1;
+
+        // Split polygons into a fan of triangles around their first corner
+        for (int i = 1; i + 1 < indexCount; ++i)
+        {
+            std::array<tinyobj::index_t, 3> triangle = { getIndex(indices[0]), getIndex(indices[i]), getIndex(indices[i + 1]) };
+            loader->m_mesh.add(getObjTriangle(attrib, triangle), materialIndex, objectIndex);
+        }
+
+        // Build a mesh once the triangles read since the last one outnumber those in it
+        std::size_t count = loader->m_mesh.triangles.size();
+        if (count - loader->m_builtCount >= std::max(loaderMinChunkSize, loader->m_builtCount))
+        {
+            loader->buildMesh(false);
+        }
+        else if (count - loader->m_progressCount >= loaderBatchSize)
+        {
+            std::streamoff position = loader->m_file ? (std::streamoff) loader->m_file.tellg() : -1;
+            if (loader->m_fileSize > 0 && position >= 0) loader->m_progress = (float) position / (float) loader->m_fileSize;
+            loader->m_progressCount = count;
+        }
+    };
+
+    std::string warning, error;
+    bool success = tinyobj::LoadObjWithCallback(m_file, callback, this, &materialReader, &warning, &error);
+
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_warning += warning;
+        m_error += error;
+        m_succeeded = success && !m_cancelled;
+    }
+
+    // Nobody waits for the rest of a cancelled model
+    if (!m_cancelled) buildMesh(true);
+}
+
+void SceneLoader::buildMesh(bool last)
+{
+    TriangleMesh mesh;
+    if (last)
+    {
+        mesh = std::move(m_mesh);
+    }
+    else
+    {
+        mesh.triangles = m_mesh.triangles;
+        mesh.shadingData = m_mesh.shadingData;
+    }
+
+    m_builtCount = mesh.triangles.size();
+    mesh.build(m_lazyBvh);
+
+    if (last)
+    {
+        m_progress = 1.0f;
+    }
+    else
+    {
+        std::streamoff position = m_file ? (std::streamoff) m_file.tellg() : -1;
+        if (m_fileSize > 0 && position >= 0) m_progress = (float) position / (float) m_fileSize;
+    }
+
+    // A mesh that has not been swapped into the scene yet is replaced by this one, which holds all
+    // of its triangles
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_builtMesh = std::move(mesh);
+    m_meshReady = true;
+    m_read = last;
+}
+
+bool SceneLoader::update(Scene& scene)
+{
+    if (m_complete) return false;
+
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        if (!m_meshReady) return false;
+    }
+
+    apply(scene);
+    return true;
+}
+
+void SceneLoader::finish(Scene& scene)
+{
+    if (m_complete) return;
+
+    if (m_thread.joinable()) m_thread.join();
+    apply(scene);
+}
+
+void SceneLoader::apply(Scene& scene)
+{
+    TriangleMesh mesh;
+    std::vector<tinyobj::material_t> materials;
+    std::vector<std::string> objectNames;
+    bool read;
+
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        if (!m_meshReady) return;
+
+        mesh = std::move(m_builtMesh);
+        m_meshReady = false;
+        materials = m_materials;
+        objectNames = m_objectNames;
+        read = m_read;
+    }
+
+    // Texture paths in the material file are relative to the model's directory
+    std::string baseDir = m_path;
+    auto separator = baseDir.find_last_of("/\\");
+    baseDir = separator == std::string::npos ? "" : baseDir.substr(0, separator + 1);
+
+    // The mesh refers to the materials and objects read before it was built, which are all in the
+    // lists copied after it
+    std::string warning;
+    for (; m_addedMaterialCount < materials.size(); ++m_addedMaterialCount) scene.addMaterial(materials[m_addedMaterialCount], baseDir, warning);
+    for (; m_addedObjectCount < objectNames.size(); ++m_addedObjectCount) scene.addObject(objectNames[m_addedObjectCount]);
+
+    scene.setTriangles(std::move(mesh));
+
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_warning += warning;
+    }
+
+    m_complete = read;
+}
@@ -3,12 +3,20 @@
 #define STB_IMAGE_WRITE_IMPLEMENTATION
 #define TINYOBJLOADER_IMPLEMENTATION
 
+#include <algorithm>
 #include <array>
+#include <chrono>
+#include <cmath>
+#include <condition_variable>
+#include <cstdio>
+#include <deque>
 #include <exception>
 #include <functional>
 #include <iostream>
 #include <map>
 #include <memory>
+#include <mutex>
+#include <sstream>
 #include <vector>
 #include <thread>
 
@@ -21,8 +29,10 @@
 
 #include "bsdf.hh"
 #include "camera.hh"
+#include "checkpoint.hh"
 #include "config.hh"
 #include "image.hh"
+#include "loader.hh"
 #include "material.hh"
 #include "renderer.hh"
 #include "scene.hh"
@@ -67,6 +77,23 @@ int set(std::vector<std::string> args)
 	return 0;
 }
 
+// Returns the path of a model without its extension, to name the files written about it
+static std::string getModelStem(const std::string& modelPath)
+{
+	std::size_t dot = modelPath.rfind('.');
+	std::size_t slash = modelPath.find_last_of("/\\");
+
+	if (dot == std::string::npos || (slash != std::string::npos && dot < slash)) return modelPath;
+	return modelPath.substr(0, dot);
+}
+
+// Renders the model in a window, refining the image until samples_per_pixel samples have been
+// taken or the window is closed
+//
+// Every checkpoint_interval seconds, if set, the state of the render is saved to checkpoint_path,
+// <model>.checkpoint by default. The window stays responsive while it is written, but rendering
+// waits for it. `lumos render --resume` continues from the checkpoint, which requires the same
+// model, camera, image size and sampling settings
 int render(std::vector<std::string> args)
 {
 	Config config(".lumos");
@@ -94,28 +121,197 @@ int render(std::vector<std::string> args)
 
 	// Load scene from model
 	std::string modelPath = config.get("model");
+	scene.setLazyBvh(config.getInt("lazy_bvh", 0) != 0);
+
+	bool sceneLoaded = false; // Whether any of the scene has been built yet
 
-	std::string warning, error;
-	if (!scene.loadFromFile(modelPath.c_str(), warning, error))
+	// Particles or a point cloud to add to the model, as a PLY file of sphere centres
+	std::string spheresPath = config.get("spheres", "");
+	if (!spheresPath.empty())
 	{
-		std::cout << "failed to load model: " << modelPath << "\n" << error;
-		return 1;
-	} 
-	else
+		std::string warning, error;
+		if (!scene.loadSpheresFromFile(spheresPath.c_str(), config.getFloat("sphere_radius", 0.01f), warning, error))
+		{
+			std::cout << "failed to load spheres: " << spheresPath << "\n" << error;
+			return 1;
+		}
+
+		std::cout << warning;
+		fmt::print("Loaded {} spheres from {}\n", scene.getSphereCount(), spheresPath);
+		sceneLoaded = true;
+	}
+
+	// The model is read on another thread and shown as it loads. It is added after the spheres,
+	// because nothing else may add materials to the scene while it loads
+	SceneLoader loader(modelPath, scene);
+
+	// Number of samples to take per pixel before stopping, or 0 to keep refining the image until the
+	// window is closed
+	int samplesPerPixel = config.getInt("samples_per_pixel", 0);
+
+	// Where to save the image once samplesPerPixel samples have been taken
+	std::string outputPath = config.get("output_path", "");
+
+	// Time to spend tracing paths between handling events and displaying the image, in milliseconds,
+	// or 0 to trace a whole frame each time however long it takes
+	double frameTimeBudget = glm::max(config.getFloat("frame_time_budget", 33.0f), 0.0f) * 1e-3;
+
+	// Seconds between checkpoints, or 0 to save none
+	double checkpointInterval = glm::max(config.getFloat("checkpoint_interval", 0.0f), 0.0f);
+	std::string checkpointPath = config.get("checkpoint_path", getModelStem(modelPath) + ".checkpoint");
+
+	if (std::find(args.begin() + 2, args.end(), "--resume") != args.end())
 	{
-		std::cout << warning << std::endl;
+		// The checkpoint is only valid for the whole model
+		loader.finish(scene);
+		sceneLoaded = true;
+
+		if (!loader.succeeded())
+		{
+			std::cout << "failed to load model: " << modelPath << "\n" << loader.getError();
+			return 1;
+		}
+
+		std::cout << loader.getWarning() << std::endl;
+
+		Checkpoint checkpoint;
+		if (!checkpoint.loadFromFile(checkpointPath))
+		{
+			fmt::print("Failed to load checkpoint: {}\n", checkpointPath);
+			return 1;
+		}
+
+		if (!renderer.loadCheckpoint(checkpoint))
+		{
+			fmt::print("Checkpoint {} does not match the current model, camera, image size or sampling settings\n", checkpointPath);
+			return 1;
+		}
+
+		fmt::print("Resumed from {} at {} samples per pixel\n", checkpointPath, renderer.getFrameIndex());
 	}
 
+	// Distance the camera moves per key press, relative to the size of the scene
+	float moveStep = 0.0f;
+
+	auto startTime = std::chrono::steady_clock::now();
+
+	CheckpointSaver checkpointSaver;
+	auto lastCheckpointTime = startTime;
+
 	while (window.isOpen())
 	{
-		// Handle system events
+		// Add what has been read of the model to the scene. The renderer starts accumulating again
+		// whenever the scene changes
+		bool loading = !loader.isComplete();
+		if (loading)
+		{
+			sceneLoaded = loader.update(scene) || sceneLoaded;
+
+			if (loader.isComplete())
+			{
+				if (!loader.succeeded())
+				{
+					std::cout << "failed to load model: " << modelPath << "\n" << loader.getError();
+					return 1;
+				}
+
+				std::cout << loader.getWarning() << std::endl;
+				window.setTitle("Lumos");
+				startTime = std::chrono::steady_clock::now();
+			}
+			else
+			{
+				window.setTitle(fmt::format("Lumos - loading {:.0f}%", 100.0f * loader.getProgress()));
+			}
+
+			moveStep = 0.02f * glm::length(scene.getBounds().extent());
+		}
+
+		// Handle system events. WASD and QE move the camera, and the arrow keys turn it
 		sf::Event event;
+		bool cameraMoved = false;
 		while (window.pollEvent(event))
 		{
 			if (event.type == sf::Event::Closed) window.close();
+			if (event.type != sf::Event::KeyPressed) continue;
+
+			glm::vec3 forward = camera.getPrimaryRay(glm::vec2(0.5f)).d;
+			glm::vec3 right   = glm::normalize(camera.getPrimaryRay(glm::vec2(1.0f, 0.5f)).d - camera.getPrimaryRay(glm::vec2(0.0f, 0.5f)).d);
+			glm::vec3 up      = glm::normalize(camera.getPrimaryRay(glm::vec2(0.5f, 0.0f)).d - camera.getPrimaryRay(glm::vec2(0.5f, 1.0f)).d);
+
+			auto previousPosition = camera.position;
+			auto previousRotation = camera.rotation;
+
+			switch (event.key.code)
+			{
+				case sf::Keyboard::W:     camera.position += forward * moveStep; break;
+				case sf::Keyboard::S:     camera.position -= forward * moveStep; break;
+				case sf::Keyboard::D:     camera.position += right * moveStep; break;
+				case sf::Keyboard::A:     camera.position -= right * moveStep; break;
+				case sf::Keyboard::E:     camera.position += up * moveStep; break;
+				case sf::Keyboard::Q:     camera.position -= up * moveStep; break;
+				case sf::Keyboard::Left:  camera.rotation.x -= 2.0f; break;
+				case sf::Keyboard::Right: camera.rotation.x += 2.0f; break;
+				case sf::Keyboard::Up:    camera.rotation.y += 2.0f; break;
+				case sf::Keyboard::Down:  camera.rotation.y -= 2.0f; break;
+				default: break;
+			}
+
+			cameraMoved = cameraMoved || camera.position != previousPosition || camera.rotation != previousRotation;
+		}
+
+		// Keep what the new view can reuse of the image, and count the samples from the move
+		if (cameraMoved)
+		{
+			// The checkpoint being saved is written straight from the images that this changes
+			checkpointSaver.wait();
+
+			renderer.updateCameras();
+			startTime = std::chrono::steady_clock::now();
+		}
+
+		if (!sceneLoaded)
+		{
+			// Nothing to render until the first part of the model arrives
+			std::this_thread::sleep_for(std::chrono::milliseconds(16));
+		}
+		else if (checkpointSaver.isSaving())
+		{
+			// Keep the images unchanged until the checkpoint has been written from them
+			std::this_thread::sleep_for(std::chrono::milliseconds(16));
+		}
+		else if (samplesPerPixel == 0 || renderer.getFrameIndex() < samplesPerPixel || loading)
+		{
+			bool frameFinished = true;
+			if (frameTimeBudget > 0.0) frameFinished = renderer.renderFor(frameTimeBudget);
+			else renderer.render();
+
+			// Save the state of the render between frames, writing it out in the background
+			std::chrono::duration<double> sinceCheckpoint = std::chrono::steady_clock::now() - lastCheckpointTime;
+			if (checkpointInterval > 0.0 && frameFinished && loader.isComplete() && sinceCheckpoint.count() >= checkpointInterval)
+			{
+				Checkpoint checkpoint;
+				renderer.saveCheckpoint(checkpoint);
+				checkpointSaver.save(std::move(checkpoint), checkpointPath);
+
+				lastCheckpointTime = std::chrono::steady_clock::now();
+			}
+
+			if (samplesPerPixel > 0 && renderer.getFrameIndex() == samplesPerPixel && loader.isComplete())
+			{
+				std::chrono::duration<double> renderTime = std::chrono::steady_clock::now() - startTime;
+
+				if (!outputPath.empty()) renderer.saveImage(outputPath.c_str());
+
+				fmt::print("Rendered {} samples per pixel in {:.2f}s, denoising took {:.2f}ms in total\n", samplesPerPixel, renderTime.count(), 1000.0 * renderer.getDenoiseTime());
+			}
+		}
+		else
+		{
+			// Finished; don't spin while waiting for the window to close
+			std::this_thread::sleep_for(std::chrono::milliseconds(16));
 		}
 
-		renderer.render();
 		renderer.display(window);
 		window.display();
 	}
@@ -123,6 +319,599 @@ int render(std::vector<std::string> args)
 	return 0;
 }
 
+// Joins the lines of a message with spaces, so that it fits in one reply of `lumos serve`
+static std::string toOneLine(std::string message)
+{
+	while (!message.empty() && (message.back() == '\n' || message.back() == '\r')) message.pop_back();
+	std::replace(message.begin(), message.end(), '\r', ' ');
+	std::replace(message.begin(), message.end(), '\n', ' ');
+	return message;
+}
+
+// A render queued by `lumos serve`, with the settings of each of its views. The settings use the
+// same keys as the config file, and fall back to the values in the config file
+struct RenderJob
+{
+	int id;
+	std::vector<Config> views;
+};
+
+// Settings that a render job may override. Everything else comes from the config file
+static const std::vector<std::string> jobKeys = {
+	"model", "image_width", "image_height", "samples_per_pixel"
+};
+
+// Settings of jobs and views that are read as integers. The others, apart from the paths, are
+// read as floats
+static const std::vector<std::string> integerKeys = {
+	"image_width", "image_height", "samples_per_pixel"
+};
+
+// Settings that may differ between the views of a job
+static const std::vector<std::string> viewKeys = {
+	"output_path", "camera_position_x", "camera_position_y", "camera_position_z", "camera_rotation_x", "camera_rotation_y", "camera_fov_angle"
+};
+
+// Keeps scenes loaded between renders, rendering jobs read from stdin one line at a time in the
+// order they arrive. Progress is reported on stdout one line per event, so that another program
+// can drive the renderer through a pipe, or through a socket with eg `socat UNIX-LISTEN:lumos.sock EXEC:"lumos serve"`
+//
+// Commands:
+//   render key=value ... [view key=value ...]...
+//                          Queues a render. Accepts the keys in jobKeys and viewKeys. Each `view`
+//                          adds another camera, which starts with the settings of the one before
+//                          apart from output_path, and may change those in viewKeys. Views must not
+//                          share an output_path. All of a job's views are rendered at once, sharing
+//                          the threads
+//   quit                   Finishes the queued renders and exits, as does the end of the input
+//
+// Replies:
+//   queued <id>, started <id>, progress <id> <samples>/<total>, done <id> <seconds> <output paths...>, error <id or -> <message>
+//
+// eg: echo "render samples_per_pixel=64 camera_position_x=100 output_path=a.png view camera_position_x=120 output_path=b.png" | lumos serve
+int serve(std::vector<std::string> args)
+{
+	Config defaults(".lumos");
+
+	// Replies come from both threads, and each must reach the client as one whole line
+	std::mutex outputMutex;
+	auto reply = [&] (const std::string& message)
+	{
+		std::lock_guard<std::mutex> lock(outputMutex);
+		fmt::print("{}\n", message);
+		std::fflush(stdout);
+	};
+
+	std::mutex queueMutex;
+	std::condition_variable queueChanged;
+	std::deque<RenderJob> queue;
+	bool inputClosed = false;
+
+	// Read commands on a separate thread, so that jobs are queued and acknowledged while another renders
+	std::thread reader([&]
+	{
+		int nextId = 0;
+
+		for (std::string line; std::getline(std::cin, line);)
+		{
+			std::istringstream stream(line);
+			std::string command;
+			if (!(stream >> command)) continue;
+
+			if (command == "quit") break;
+
+			if (command != "render")
+			{
+				reply(fmt::format("error - unknown command \"{}\"", command));
+				continue;
+			}
+
+			RenderJob job = { nextId++, { defaults } };
+			std::string error;
+
+			for (std::string token; error.empty() && stream >> token;)
+			{
+				if (token == "view")
+				{
+					// A view saves nothing unless given its own output path, so that it never
+					// overwrites the image of the view before
+					job.views.push_back(job.views.back());
+					job.views.back().set("output_path", std::string());
+					continue;
+				}
+
+				auto equals = token.find('=');
+				std::string key = token.substr(0, equals);
+
+				bool isJobKey  = std::find(jobKeys.begin(), jobKeys.end(), key) != jobKeys.end();
+				bool isViewKey = std::find(viewKeys.begin(), viewKeys.end(), key) != viewKeys.end();
+
+				if (equals == std::string::npos || !(isJobKey || isViewKey))
+				{
+					error = fmt::format("unknown setting \"{}\"", token);
+					break;
+				}
+
+				if (isJobKey && job.views.size() > 1)
+				{
+					error = fmt::format("{} must be set before the first view", key);
+					break;
+				}
+
+				// Check numbers now, because Config exits the program when it reads an invalid one.
+				// The whole value must be the number, as std::stoi and std::stof ignore anything after it
+				std::string value = token.substr(equals + 1);
+				if (key != "model" && key != "output_path")
+				{
+					bool isInteger = std::find(integerKeys.begin(), integerKeys.end(), key) != integerKeys.end();
+
+					std::size_t length = 0;
+					try
+					{
+						if (isInteger) std::stoi(value, &length);
+						else std::stof(value, &length);
+					}
+					catch (std::exception& e) { length = 0; }
+
+					if (length == 0 || length != value.size())
+					{
+						error = fmt::format("{} must be {}, not \"{}\"", key, isInteger ? "an integer" : "a number", value);
+						break;
+					}
+				}
+
+				job.views.back().set(key, value);
+			}
+
+			for (std::size_t i = 0; error.empty() && i < job.views.size(); ++i)
+			{
+				std::string outputPath = job.views[i].get("output_path", "");
+				for (std::size_t j = 0; j < i && !outputPath.empty(); ++j)
+				{
+					if (job.views[j].get("output_path", "") != outputPath) continue;
+
+					error = fmt::format("views {} and {} have the same output_path \"{}\"", j, i, outputPath);
+					break;
+				}
+			}
+
+			if (!error.empty())
+			{
+				reply(fmt::format("error {} {}", job.id, error));
+				continue;
+			}
+
+			reply(fmt::format("queued {}", job.id));
+
+			{
+				std::lock_guard<std::mutex> lock(queueMutex);
+				queue.push_back(std::move(job));
+			}
+
+			queueChanged.notify_one();
+		}
+
+		std::lock_guard<std::mutex> lock(queueMutex);
+		inputClosed = true;
+		queueChanged.notify_one();
+	});
+
+	// Scenes by model path, and renderers by resolution, kept for later jobs
+	std::map<std::string, std::unique_ptr<Scene>> scenes;
+	std::map<std::pair<int, int>, std::unique_ptr<Renderer>> renderers;
+
+	// Renders one job and replies with its outcome. Throws if an image cannot be written
+	auto renderJob = [&] (RenderJob& job)
+	{
+		auto startTime = std::chrono::steady_clock::now();
+
+		Config& settings = job.views[0];
+
+		// Load the scene the first time a job uses it
+		std::string modelPath = settings.get("model", "");
+		auto& scene = scenes[modelPath];
+		if (!scene)
+		{
+			// Only keep the scene once it has loaded
+			auto loaded = std::make_unique<Scene>();
+			loaded->setLazyBvh(defaults.getInt("lazy_bvh", 0) != 0);
+
+			std::string warning, error;
+			if (!loaded->loadFromFile(modelPath.c_str(), warning, error))
+			{
+				reply(fmt::format("error {} failed to load model \"{}\": {}", job.id, modelPath, toOneLine(error)));
+				scenes.erase(modelPath);
+				return;
+			}
+
+			scene = std::move(loaded);
+		}
+
+		glm::ivec2 imageSize(settings.getInt("image_width", 1280), settings.getInt("image_height", 720));
+		if (imageSize.x <= 0 || imageSize.y <= 0)
+		{
+			reply(fmt::format("error {} invalid image size", job.id));
+			return;
+		}
+
+		auto& renderer = renderers[{ imageSize.x, imageSize.y }];
+		if (!renderer) renderer = std::make_unique<Renderer>(imageSize);
+
+		std::vector<PerspectiveCamera> cameras(job.views.size());
+		std::vector<const Camera*> cameraPointers;
+		for (std::size_t i = 0; i < cameras.size(); ++i)
+		{
+			Config& view = job.views[i];
+			PerspectiveCamera& camera = cameras[i];
+
+			camera.aspectRatio = (float) imageSize.x / (float) imageSize.y;
+			camera.fov         = view.getFloat("camera_fov_angle", 60.0f);
+			camera.position    = glm::vec3(view.getFloat("camera_position_x", 0.0f), view.getFloat("camera_position_y", 0.0f), view.getFloat("camera_position_z", 0.0f));
+			camera.rotation    = glm::vec2(view.getFloat("camera_rotation_x", 0.0f), view.getFloat("camera_rotation_y", 0.0f));
+
+			cameraPointers.push_back(&camera);
+		}
+
+		renderer->setScene(scene.get());
+		renderer->setCameras(cameraPointers);
+
+		// Report progress every tenth of the samples
+		int samplesPerPixel = glm::max(settings.getInt("samples_per_pixel", 0), 1);
+		for (int sample = 1; sample <= samplesPerPixel; ++sample)
+		{
+			renderer->render();
+
+			if (sample * 10 / samplesPerPixel != (sample - 1) * 10 / samplesPerPixel)
+				reply(fmt::format("progress {} {}/{}", job.id, sample, samplesPerPixel));
+		}
+
+		std::string outputPaths;
+		for (int i = 0; i < (int) job.views.size(); ++i)
+		{
+			std::string outputPath = job.views[i].get("output_path", "");
+			if (!outputPath.empty()) renderer->saveImage(outputPath.c_str(), i);
+
+			outputPaths += " " + outputPath;
+		}
+
+		std::chrono::duration<double> renderTime = std::chrono::steady_clock::now() - startTime;
+		reply(fmt::format("done {} {:.3f}{}", job.id, renderTime.count(), outputPaths));
+	};
+
+	while (true)
+	{
+		std::unique_lock<std::mutex> lock(queueMutex);
+		queueChanged.wait(lock, [&] { return !queue.empty() || inputClosed; });
+		if (queue.empty()) break;
+
+		RenderJob job = std::move(queue.front());
+		queue.pop_front();
+		lock.unlock();
+
+		reply(fmt::format("started {}", job.id));
+
+		// A job that fails, such as by being unable to write its images, only ends that job
+		try
+		{
+			renderJob(job);
+		}
+		catch (std::exception& e)
+		{
+			reply(fmt::format("error {} {}", job.id, toOneLine(e.what())));
+		}
+	}
+
+	reader.join();
+
+	return 0;
+}
+
+// Measures how quickly the renderer converges on each model, so that changes to sampling are
+// judged by the error they reach in a given time rather than by their time per frame
+//
+// A reference image is rendered with converge_reference_samples samples per pixel and saved to
+// <model>.reference.pfm, or loaded from there if an earlier run saved one. The model is then
+// rendered again for converge_duration seconds, and every converge_interval seconds the RMSE and
+// relative MSE of the radiance against the reference are written to <model>.convergence.csv.
+// Only the time spent in Renderer::render counts, and the radiance is compared before denoising.
+// Finally the time taken to reach a relative MSE of converge_target_relmse is printed
+//
+// The camera and renderer settings come from the config file. Delete the reference files after
+// changing them. With no models given, the bundled scenes are used
+//
+// eg: lumos converge cornell_box.obj logo_image.obj
+int converge(std::vector<std::string> args)
+{
+	Config config(".lumos");
+
+	std::vector<std::string> modelPaths(args.begin() + 2, args.end());
+	if (modelPaths.empty()) modelPaths = { "cornell_box.obj", "logo_image.obj" };
+
+	int referenceSamples = glm::max(config.getInt("converge_reference_samples", 4096), 1);
+	float duration       = config.getFloat("converge_duration", 60.0f);
+	float interval       = glm::max(config.getFloat("converge_interval", 1.0f), 0.0f);
+	float targetRelMse   = config.getFloat("converge_target_relmse", 0.01f);
+
+	glm::ivec2 imageSize;
+	imageSize.x = config.getInt("image_width", 1280);
+	imageSize.y = config.getInt("image_height", 720);
+
+	PerspectiveCamera camera;
+	camera.aspectRatio = (float) imageSize.x / (float) imageSize.y;
+	camera.fov         = config.getFloat("camera_fov_angle", 60.0f);
+	camera.position    = glm::vec3(config.getFloat("camera_position_x", 0.0f), config.getFloat("camera_position_y", 0.0f), config.getFloat("camera_position_z", 0.0f));
+	camera.rotation    = glm::vec2(config.getFloat("camera_rotation_x", 0.0f), config.getFloat("camera_rotation_y", 0.0f));
+
+	for (const auto& modelPath : modelPaths)
+	{
+		Scene scene;
+
+		std::string warning, error;
+		if (!scene.loadFromFile(modelPath.c_str(), warning, error))
+		{
+			std::cout << "failed to load model: " << modelPath << "\n" << error;
+			return 1;
+		}
+
+		std::string stem = getModelStem(modelPath);
+		std::string referencePath = stem + ".reference.pfm";
+		std::string csvPath = stem + ".convergence.csv";
+
+		// Load the reference, or render it if there is none of the right size
+		Image<glm::vec3> reference;
+		try { reference.loadFromPfm(referencePath.c_str()); }
+		catch (std::exception& e) {}
+
+		if (reference.getSize() != imageSize)
+		{
+			fmt::print("{}: rendering a reference with {} samples per pixel\n", modelPath, referenceSamples);
+
+			Renderer renderer(imageSize);
+			renderer.setScene(&scene);
+			renderer.setCamera(&camera);
+
+			auto start = std::chrono::steady_clock::now();
+			while (renderer.getFrameIndex() < referenceSamples) renderer.render();
+			std::chrono::duration<double> seconds = std::chrono::steady_clock::now() - start;
+
+			renderer.getRadianceImage().writeToPfm(referencePath.c_str());
+			reference.loadFromPfm(referencePath.c_str());
+
+			fmt::print("{}: saved the reference to {} after {:.1f}s\n", modelPath, referencePath, seconds.count());
+		}
+
+		// A fresh renderer, so that nothing learned while rendering the reference carries over
+		Renderer renderer(imageSize);
+		renderer.setScene(&scene);
+		renderer.setCamera(&camera);
+
+		FILE* csv = std::fopen(csvPath.c_str(), "w");
+		if (csv == nullptr)
+		{
+			fmt::print("failed to write {}\n", csvPath);
+			return 1;
+		}
+
+		std::fprintf(csv, "seconds,samples_per_pixel,rmse,relmse\n");
+
+		double renderSeconds = 0.0, nextMeasurement = interval;
+		double targetSeconds = -1.0;
+		double rmse = 0.0, relMse = 0.0;
+
+		while (renderSeconds < duration)
+		{
+			auto start = std::chrono::steady_clock::now();
+			renderer.render();
+			std::chrono::duration<double> seconds = std::chrono::steady_clock::now() - start;
+			renderSeconds += seconds.count();
+
+			if (renderSeconds < nextMeasurement && renderSeconds < duration) continue;
+			nextMeasurement = renderSeconds + interval;
+
+			// Squared error per channel, and relative to the reference's squared value with a small
+			// offset so that black pixels do not dominate
+			const auto& radiance = renderer.getRadianceImage();
+			double squaredError = 0.0, relativeError = 0.0;
+
+			for (int y = 0; y < imageSize.y; ++y)
+			{
+				for (int x = 0; x < imageSize.x; ++x)
+				{
+					glm::vec3 expected = reference.load(glm::ivec2(x, y));
+					glm::vec3 difference = radiance.load(glm::ivec2(x, y)) - expected;
+
+					for (int i = 0; i < 3; ++i)
+					{
+						squaredError  += difference[i] * difference[i];
+						relativeError += difference[i] * difference[i] / (expected[i] * expected[i] + 0.01f);
+					}
+				}
+			}
+
+			double valueCount = 3.0 * imageSize.x * imageSize.y;
+			rmse = std::sqrt(squaredError / valueCount);
+			relMse = relativeError / valueCount;
+
+			if (targetSeconds < 0.0 && relMse <= targetRelMse) targetSeconds = renderSeconds;
+
+			std::fprintf(csv, "%.3f,%d,%g,%g\n", renderSeconds, renderer.getFrameIndex(), rmse, relMse);
+		}
+
+		std::fclose(csv);
+
+		fmt::print("{}: {} samples per pixel in {:.1f}s, RMSE {:.4g}, relMSE {:.4g}, wrote {}\n",
+			modelPath, renderer.getFrameIndex(), renderSeconds, rmse, relMse, csvPath);
+
+		if (targetSeconds >= 0.0)
+			fmt::print("{}: reached relMSE {:.4g} after {:.2f}s\n", modelPath, targetRelMse, targetSeconds);
+		else
+			fmt::print("{}: did not reach relMSE {:.4g} within {:.1f}s\n", modelPath, targetRelMse, duration);
+	}
+
+	return 0;
+}
+
+// Compares the memory footprint and traversal speed of the binary and wide BVH layouts on each
+// model, using primary rays and diffuse bounce rays from the configured camera, and prints one row
+// per model. Then measures how a parallel image pass scales with the number of threads on each
+// model. With no models given, the bundled scenes are used
+//
+// eg: lumos benchmark cornell_box.obj logo_image.obj
+int benchmark(std::vector<std::string> args)
+{
+	Config config(".lumos");
+
+	std::vector<std::string> modelPaths(args.begin() + 2, args.end());
+	if (modelPaths.empty()) modelPaths = { "cornell_box.obj", "logo_image.obj" };
+
+	glm::ivec2 imageSize;
+	imageSize.x = config.getInt("image_width", 1280);
+	imageSize.y = config.getInt("image_height", 720);
+
+	PerspectiveCamera camera;
+	camera.aspectRatio = (float) imageSize.x / (float) imageSize.y;
+	camera.fov         = config.getFloat("camera_fov_angle", 60.0f);
+	camera.position    = glm::vec3(config.getFloat("camera_position_x", 0.0f), config.getFloat("camera_position_y", 0.0f), config.getFloat("camera_position_z", 0.0f));
+	camera.rotation    = glm::vec2(config.getFloat("camera_rotation_x", 0.0f), config.getFloat("camera_rotation_y", 0.0f));
+
+	int chunkSize = config.getInt("chunk_size", 4);
+
+	// The thread scaling of each model, printed after the table
+	std::string scaling;
+
+	fmt::print("Footprints in KiB, throughput in Mrays/s of primary, bounce and occlusion rays
+");
+	fmt::print("{:<24} {:>10} {:>10} {:>10} {:>10} {:>10} {:>10} {:>10} {:>10}
+",
+		"model", "triangles", "binary KiB", "primary", "bounce", "wide KiB", "primary", "bounce", "occlusion");
+
+	for (const auto& modelPath : modelPaths)
+	{
+		Scene scene;
+
+		std::string warning, error;
+		if (!scene.loadFromFile(modelPath.c_str(), warning, error))
+		{
+			std::cout << "failed to load model: " << modelPath << "\n" << error;
+			return 1;
+		}
+
+		// Build both layouts over the same triangles
+		const auto& triangles = scene.getTriangles();
+
+		std::vector<Box> boxes;
+		for (const auto& triangle : triangles) boxes.push_back(triangle.getBoundingBox());
+
+		std::vector<uint> order;
+		BinaryBvh binaryBvh;
+		binaryBvh.build(boxes, order);
+
+		WideBvh wideBvh;
+		wideBvh.build(binaryBvh);
+
+		// Primary rays through the centre of each pixel
+		std::vector<Ray> primaryRays;
+		for (int y = 0; y < imageSize.y; ++y)
+			for (int x = 0; x < imageSize.x; ++x)
+				primaryRays.push_back(camera.getPrimaryRay((glm::vec2(x, y) + 0.5f) / glm::vec2(imageSize)));
+
+		// Incoherent rays leaving the primary hits in cosine-distributed directions
+		std::vector<Ray> bounceRays;
+		for (const auto& ray : primaryRays)
+		{
+			Hit hit;
+			if (!scene.intersects(ray, hit)) continue;
+
+			glm::vec2 random = hash(glm::vec2(bounceRays.size(), 0.5f));
+			Ray bounceRay;
+			bounceRay.d = glm::normalize(hit.normal + uniformSphereSample(random));
+			bounceRay.o = hit.pos + bounceRay.d * 0.0001f;
+			bounceRays.push_back(bounceRay);
+		}
+
+		// Returns the throughput in millions of rays per second of tracing `rays` through `bvh`
+		auto measure = [&] (const auto& bvh, const std::vector<Ray>& rays)
+		{
+			auto start = std::chrono::steady_clock::now();
+
+			int hitCount = 0;
+			for (const auto& ray : rays)
+			{
+				float tMax = inf;
+				hitCount += bvh.intersect(ray, tMax, [&] (uint index, float& tMax)
+				{
+					float t; glm::vec2 barycentrics;
+					if (intersectTriangle(ray, triangles[order[index]], t, barycentrics) && t < tMax)
+					{
+						tMax = t;
+						return true;
+					}
+
+					return false;
+				});
+			}
+
+			std::chrono::duration<double> seconds = std::chrono::steady_clock::now() - start;
+			return (double) rays.size() / seconds.count() * 1e-6;
+		};
+
+		double binaryPrimary = measure(binaryBvh, primaryRays), binaryBounce = measure(binaryBvh, bounceRays);
+		double widePrimary = measure(wideBvh, primaryRays), wideBounce = measure(wideBvh, bounceRays);
+
+		// Visibility queries along the bounce rays, as used for shadow rays
+		auto shadowStart = std::chrono::steady_clock::now();
+		int occludedCount = 0;
+		for (const auto& ray : bounceRays) occludedCount += scene.occluded(ray, inf);
+		std::chrono::duration<double> shadowSeconds = std::chrono::steady_clock::now() - shadowStart;
+
+		fmt::print("{:<24} {:>10} {:>10.1f} {:>10.2f} {:>10.2f} {:>10.1f} {:>10.2f} {:>10.2f} {:>10.2f}\n",
+			modelPath, triangles.size(),
+			binaryBvh.getMemoryFootprint() / 1024.0, binaryPrimary, binaryBounce,
+			wideBvh.getMemoryFootprint() / 1024.0, widePrimary, wideBounce,
+			(double) bounceRays.size() / shadowSeconds.count() * 1e-6);
+
+		// Scaling of a parallel image pass with the number of threads. Each pixel traces its primary
+		// ray and one bounce, which is roughly the work of one frame with a short path depth
+		Image<glm::vec3> image(imageSize, PixelLayout::Tiled);
+		double singleThreadSeconds = 0.0;
+
+		for (int threadCount = 1; ; threadCount = glm::min(threadCount * 2, ThreadPool::getDefaultThreadCount()))
+		{
+			ThreadPool pool(threadCount);
+
+			auto start = std::chrono::steady_clock::now();
+
+			image.process([&] (glm::ivec2 pos)
+			{
+				Ray ray = camera.getPrimaryRay((glm::vec2(pos) + 0.5f) / glm::vec2(imageSize));
+
+				Hit hit;
+				if (!scene.intersects(ray, hit)) return glm::vec3(0.0f);
+
+				Ray bounceRay;
+				bounceRay.d = glm::normalize(hit.normal + uniformSphereSample(hash(glm::vec2(pos))));
+				bounceRay.o = hit.pos + bounceRay.d * 0.0001f;
+
+				Hit bounceHit;
+				return scene.intersects(bounceRay, bounceHit) ? bounceHit.material.diffuse : glm::vec3(1.0f);
+			}, pool, chunkSize);
+
+			std::chrono::duration<double> seconds = std::chrono::steady_clock::now() - start;
+			if (threadCount == 1) singleThreadSeconds = seconds.count();
+
+			double speedup = singleThreadSeconds / seconds.count();
+			scaling += fmt::format("{}: {:3} threads: {:8.2f} ms per frame, {:5.2f}x speedup, {:5.1f}% efficiency\n",
+				modelPath, threadCount, seconds.count() * 1e3, speedup, 100.0 * speedup / threadCount);
+
+			if (threadCount == ThreadPool::getDefaultThreadCount()) break;
+		}
+	}
+
+	fmt::print("\n{}", scaling);
+
+	return 0;
+}
+
 int main(int argc, char** argv)
 {
 	// Transfer command line arguments into std::vector
@@ -137,6 +926,9 @@ int main(int argc, char** argv)
 	handlers["get"]    = get;
 	handlers["set"]    = set;
 	handlers["render"] = render;
+	handlers["benchmark"] = benchmark;
+	handlers["serve"]  = serve;
+	handlers["converge"] = converge;
 	
 	if (handlers.count(args[1])) {
 		// Handler exists for command
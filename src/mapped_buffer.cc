@@ -0,0 +1,131 @@
+#include <algorithm>
+#include <cstdint>
+#include <filesystem>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#if defined(_WIN32)
+#define NOMINMAX
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+#include <fmt/format.h>
+
+#include "mapped_buffer.hh"
+
+static std::string s_directory; // Directory for the temporary files, or empty for the system's
+
+void MappedBuffer::setDirectory(const std::string& directory)
+{
+    s_directory = directory;
+}
+
+// Returns the directory to create the temporary files in
+static std::string getDirectory()
+{
+    return s_directory.empty() ? std::filesystem::temp_directory_path().string() : s_directory;
+}
+
+#if defined(_WIN32)
+
+MappedBuffer::MappedBuffer(std::size_t size) : m_size(size)
+{
+    if (size == 0) return;
+
+    char path[MAX_PATH];
+    if (GetTempFileNameA(getDirectory().c_str(), "lms", 0, path) == 0)
+        throw std::runtime_error(fmt::format("Failed to create a temporary file in {}", getDirectory()));
+
+    // The file is deleted once the last handle to it is closed, including when the program exits
+    m_file = CreateFileA(path, GENERIC_READ | GENERIC_WRITE, 0, nullptr, CREATE_ALWAYS, FILE_ATTRIBUTE_TEMPORARY | FILE_FLAG_DELETE_ON_CLOSE, nullptr);
+    if (m_file == INVALID_HANDLE_VALUE)
+    {
+        m_file = nullptr;
+        throw std::runtime_error(fmt::format("Failed to create temporary file {}", path));
+    }
+
+    m_mapping = CreateFileMappingA(m_file, nullptr, PAGE_READWRITE, (DWORD) ((std::uint64_t) size >> 32), (DWORD) size, nullptr);
+    if (m_mapping != nullptr) m_data = MapViewOfFile(m_mapping, FILE_MAP_ALL_ACCESS, 0, 0, size);
+
+    if (m_data == nullptr)
+    {
+        if (m_mapping != nullptr) CloseHandle(m_mapping);
+        CloseHandle(m_file);
+        throw std::runtime_error(fmt::format("Failed to map {} bytes of temporary file {}", size, path));
+    }
+}
+
+MappedBuffer::~MappedBuffer()
+{
+    if (m_data != nullptr) UnmapViewOfFile(m_data);
+    if (m_mapping != nullptr) CloseHandle(m_mapping);
+    if (m_file != nullptr) CloseHandle(m_file);
+}
+
+#else
+
+MappedBuffer::MappedBuffer(std::size_t size) : m_size(size)
+{
+    if (size == 0) return;
+
+    std::string pathTemplate = getDirectory() + "/lumos-XXXXXX";
+    std::vector<char> path(pathTemplate.begin(), pathTemplate.end());
+    path.push_back('\0');
+
+    int file = mkstemp(path.data());
+    if (file < 0) throw std::runtime_error(fmt::format("Failed to create a temporary file in {}", getDirectory()));
+
+    // Unlink the file straight away, so that it disappears once it is unmapped, even if the program
+    // exits without destroying the buffer
+    unlink(path.data());
+
+    void* data = MAP_FAILED;
+    if (ftruncate(file, (off_t) size) == 0) data = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, file, 0);
+
+    // The mapping keeps the file open
+    close(file);
+
+    if (data == MAP_FAILED) throw std::runtime_error(fmt::format("Failed to map {} bytes of temporary file {}", size, path.data()));
+
+    m_data = data;
+}
+
+MappedBuffer::~MappedBuffer()
+{
+    if (m_data != nullptr) munmap(m_data, m_size);
+}
+
+#endif
+
+void MappedBuffer::release(std::size_t offset, std::size_t size)
+{
+    if (m_data == nullptr) return;
+
+#if defined(_WIN32)
+    SYSTEM_INFO info;
+    GetSystemInfo(&info);
+    std::size_t pageSize = info.dwPageSize;
+#else
+    std::size_t pageSize = (std::size_t) sysconf(_SC_PAGESIZE);
+#endif
+
+    // Only whole pages can be dropped, so round the range inwards to page boundaries
+    std::size_t begin = (offset + pageSize - 1) / pageSize * pageSize;
+    std::size_t end   = std::min(offset + size, m_size) / pageSize * pageSize;
+    if (begin >= end) return;
+
+    char* pages = static_cast<char*>(m_data) + begin;
+
+#if defined(_WIN32)
+    // Unlocking pages that are not locked removes them from the working set
+    VirtualUnlock(pages, end - begin);
+#else
+    // The pages of a shared file mapping keep their contents in the file
+    madvise(pages, end - begin, MADV_DONTNEED);
+#endif
+}
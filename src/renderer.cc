@@ -1,5 +1,10 @@
 #include <array>
+#include <cassert>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
 #include <exception>
+#include <filesystem>
 #include <functional>
 #include <iostream>
 #include <memory>
@@ -17,16 +22,41 @@
 
 #include "bsdf.hh"
 #include "camera.hh"
+#include "checkpoint.hh"
 #include "config.hh"
 #include "image.hh"
 #include "material.hh"
 #include "renderer.hh"
+#include "sampling_tables.hh"
 #include "scene.hh"
 #include "shape.hh"
 #include "utility.hh"
 
-// Resolution of the precomputed blue noise texture
-#define BLUE_NOISE_RES 512
+static_assert((blueNoiseSize & (blueNoiseSize - 1)) == 0, "The blue noise tile is wrapped with a mask");
+
+// Returns the blue noise offset for a pixel from the table compiled into the program, repeating the
+// tile over the image
+static glm::vec2 getBlueNoise(glm::ivec2 pos)
+{
+    int index = 2 * ((pos.y & (blueNoiseSize - 1)) * blueNoiseSize + (pos.x & (blueNoiseSize - 1)));
+    return glm::vec2(blueNoiseTable[index], blueNoiseTable[index + 1]);
+}
+
+// Spread angle added to the ray cone by a bounce off a surface with roughness 1
+constexpr float roughConeSpread = 0.5f;
+
+// Largest maximum path depth for which the path tracer is compiled with a fixed depth
+constexpr int maxFixedPathDepth = 8;
+
+// Identifies a renderer checkpoint, and the version of its contents, which changes whenever they do
+constexpr std::uint32_t checkpointMagic   = 0x6b636c6c; // "llck"
+constexpr std::uint32_t checkpointVersion = 5;
+
+// When reprojecting, a pixel's samples are kept if the depth of its first surface is within this
+// fraction of the depth the new view sees there, and its average normal is at least this close to
+// the new one
+constexpr float reprojectionDepthTolerance = 0.02f;
+constexpr float reprojectionMinNormalCos = 0.9f;
 
 // Tone mapping operator by Jim Hejl and Richard Burgess
 // Maps radiance values on [0, inf] to colors on [0, 1]
@@ -36,50 +66,205 @@ inline glm::vec3 tonemapHejlBurgess(glm::vec3 rgb)
 	return (rgb * (6.2f * rgb + 0.5f)) / (rgb * (6.2f * rgb + 1.7f) + 0.06f);
 }
 
+// Reads the memory layout used for the renderer's intermediate images from the config file
+static PixelLayout getPixelLayout()
+{
+    Config config(".lumos");
+    std::string layout = config.get("pixel_layout", "tiled");
+
+    if (layout == "row_major") return PixelLayout::RowMajor;
+    if (layout == "morton")    return PixelLayout::Morton;
+    if (layout != "tiled")     fmt::print("Unknown pixel_layout \"{}\", using \"tiled\"\n", layout);
+
+    return PixelLayout::Tiled;
+}
+
+// Reads where the renderer's intermediate images are held from the config file. Mapped images are
+// created in mapped_image_directory if it is set
+static ImageBacking getImageBacking()
+{
+    Config config(".lumos");
+    if (config.getInt("mapped_images", 0) == 0) return ImageBacking::Memory;
+
+    std::string directory = config.get("mapped_image_directory", "");
+    if (!directory.empty()) MappedBuffer::setDirectory(directory);
+
+    return ImageBacking::MappedFile;
+}
+
+// Reads the number of threads the renderer uses from the config file. Defaults to one per hardware thread
+static int getThreadCount()
+{
+    Config config(".lumos");
+    return glm::max(config.getInt("thread_count", ThreadPool::getDefaultThreadCount()), 1);
+}
+
 Renderer::Renderer(glm::ivec2 windowSize) :
-    m_groupCount(2),
+    m_sequenceOffset(0),
+    m_nextTile(0),
+    m_tileCost(0.0),
+    m_threadPool(getThreadCount()),
     m_windowSize(windowSize),
-    m_radianceImage(windowSize),
-    m_displayImage(windowSize),
-    m_blueNoiseImage(glm::ivec2(BLUE_NOISE_RES)),
-    m_scene(nullptr),
-    m_camera(nullptr)
+    m_pixelLayout(getPixelLayout()),
+    m_imageBacking(getImageBacking()),
+    m_denoiser(windowSize, m_pixelLayout, m_imageBacking),
+    m_guidingFrameIndex(0),
+    m_guidingTraining(false),
+    m_denoiseTime(0.0),
+    m_unbudgetedDenoiseTime(0.0),
+    m_sceneVersion(0),
+    m_scene(nullptr)
 {
-    m_blueNoiseImage.loadFromFile("assets/blueNoise.png");
-    m_displayTexture.create((unsigned) windowSize.x, (unsigned) windowSize.y);
-
     Config config(".lumos");
     m_ambient.r = config.getFloat("ambient_r", 0.0f);
     m_ambient.g = config.getFloat("ambient_g", 0.0f);
     m_ambient.b = config.getFloat("ambient_b", 0.0f);
 
-    reset();
+    m_maxPathDepth = config.getInt("max_path_depth", 3);
+    m_denoise = config.getInt("denoise", 0) != 0;
+    m_denoiseInterval = glm::max(config.getFloat("denoise_interval", 250.0f), 0.0f) * 1e-3;
+    m_sampleLights = config.getInt("sample_lights", 1) != 0;
+    m_chunkSize = glm::max(config.getInt("chunk_size", 4), 1);
+    m_pathGuiding = config.getInt("path_guiding", 0) != 0;
+    m_guidingTrainingFrames = glm::max(config.getInt("guiding_training_frames", 64), 0);
+    m_guidingResolution = glm::max(config.getInt("guiding_grid_resolution", 16), 1);
+    m_reprojection = config.getInt("reprojection", 1) != 0;
+    m_reprojectionMaxSamples = glm::max(config.getInt("reprojection_max_samples", 32), 0);
+
+    setCamera(nullptr);
 }
 
-glm::vec3 Renderer::tracePathSegment(const Ray& ray, const glm::vec2& random, int depth, int maxDepth, bool insideTransparentMaterial)
+Renderer::View::View(glm::ivec2 size, PixelLayout layout, ImageBacking backing) :
+    radianceImage(size, layout, backing),
+    momentImage(size, layout, backing),
+    albedoImage(size, layout, backing),
+    normalImage(size, layout, backing),
+    denoisedImage(size, layout, backing),
+    depthImage(size, layout, backing),
+    sampleCountImage(size, layout, backing)
+{}
+
+void Renderer::View::releaseTiles(int begin, int end)
 {
+    radianceImage.releaseTiles(begin, end);
+    momentImage.releaseTiles(begin, end);
+    albedoImage.releaseTiles(begin, end);
+    normalImage.releaseTiles(begin, end);
+    denoisedImage.releaseTiles(begin, end);
+    depthImage.releaseTiles(begin, end);
+    sampleCountImage.releaseTiles(begin, end);
+}
+
+void Renderer::View::release()
+{
+    releaseTiles(0, radianceImage.getTileCount());
+}
+
+template <bool hasTransmission, bool hasSpecular, int fixedDepth>
+glm::vec3 Renderer::tracePathSegment(const Ray& ray, const glm::vec2& random, int remainingDepth, bool insideTransparentMaterial, const ScatterEvent& scatter, FirstHit* firstHit)
+{
+    if (fixedDepth != anyDepth) remainingDepth = fixedDepth;
+
     // Return zero if the path depth exceeds the maximum path depth - preventing infinite recursion
-    if (depth > maxDepth) return glm::vec3(0.0f);
+    if (remainingDepth < 0) return glm::vec3(0.0f);
 
     // Invoke the ray-scene intersection algorithm to determine if the ray hit anything or not
     Hit hit; // will store data about the hit surface - its material properties and normal vector
     if (m_scene->intersects(ray, hit))
     {
+        if (firstHit != nullptr)
+        {
+            // Metals and glass have no diffuse albedo, so use their specular colour instead
+            firstHit->albedo = glm::clamp(hit.material.diffuse + hit.material.specular, 0.0f, 1.0f);
+            firstHit->normal = hit.normal;
+            firstHit->depth  = hit.distance;
+        }
+
+        // If the light was also sampled directly from the previous surface, its emission has been
+        // estimated twice, so weigh this estimate against the other one
+        glm::vec3 emission = hit.material.emission;
+        if (scatter.sampledLights && hit.lightIndex >= 0)
+        {
+            const LightTree& lightTree = m_scene->getLightTree();
+            const LightTriangle& light = lightTree.getLights()[hit.lightIndex];
+
+            float lightPdf = lightTree.getPickProbability(scatter.pos, scatter.normal, hit.lightIndex) * hit.distance * hit.distance
+                / (light.area * glm::max(glm::abs(glm::dot(light.normal, ray.d)), eps));
+
+            emission *= powerHeuristic(scatter.bsdfPdf, lightPdf);
+        }
+
         glm::vec3 fr(1.0f); // Multiplicative component of the BSDF
+        BsdfLobe lobe;
+        float bsdfPdf;
+
+        // Once the path guide has learned where light reaches this part of the scene from, mix it
+        // into the choice of direction for opaque surfaces. Sharp reflections are left to the BSDF,
+        // which samples them far better than the guide's coarse bins can
+        bool isOpaque = !hasTransmission || hit.material.isOpaque;
+        int guideCell = -1;
+        float guideFraction = 0.0f;
+        if (m_pathGuiding && isOpaque)
+        {
+            guideCell = m_pathGuide.getCell(hit.pos);
+            if (guideCell >= 0)
+            {
+                guideFraction = 0.5f;
+                if (hasSpecular && getGgxAlpha(hit.material) < 0.1f)
+                    guideFraction *= 1.0f - getSpecularProbability(hit.material, glm::abs(glm::dot(hit.normal, ray.d)));
+            }
+        }
 
-        // Construct the new ray using BSDF importance sampling
+        // Construct the new ray using BSDF importance sampling, or by sampling the guide
         Ray outgoingRay;
         outgoingRay.o = hit.pos;
-        outgoingRay.d = importanceSampleBsdf(hit.material, hit.normal, ray.d, random, insideTransparentMaterial, fr);
+
+        if (guideFraction > 0.0f && hash(random + 0.53f).x < guideFraction)
+            outgoingRay.d = m_pathGuide.sample(guideCell, random);
+        else
+            outgoingRay.d = importanceSampleBsdf<hasTransmission, hasSpecular>(hit.material, hit.normal, ray.d, random, insideTransparentMaterial, fr, lobe, bsdfPdf);
+
+        // With the guide mixed in, the direction's density is the mixture of both densities
+        if (guideFraction > 0.0f)
+        {
+            bsdfPdf = getScatterPdf<hasSpecular>(hit, -ray.d, outgoingRay.d, guideCell, guideFraction);
+            fr = bsdfPdf > 0.0f ? evaluateBsdf<hasSpecular>(hit.material, hit.normal, -ray.d, outgoingRay.d) / bsdfPdf : glm::vec3(0.0f);
+        }
 
         // Add a tiny bias in the direction of the new ray to its origin to prevent self-intersections
         outgoingRay.o += outgoingRay.d * 0.0001f;
 
-        // Sample the radiance along the new ray
-        auto incidentRadiance = tracePathSegment(outgoingRay, hash(random), depth + 1, maxDepth, insideTransparentMaterial);
+        // Continue the ray cone from the hit point. Rough surfaces scatter light over a wide range
+        // of directions, so the cone widens to match
+        outgoingRay.coneWidth  = ray.coneWidth + ray.coneSpread * hit.distance;
+        outgoingRay.coneSpread = ray.coneSpread + hit.material.roughness * roughConeSpread;
+
+        // Sample a light directly from opaque surfaces, where the BSDF can be evaluated for the
+        // direction to the light. Lights reached by the new ray are then weighed against this sample
+        ScatterEvent outgoingScatter;
+        glm::vec3 directLight(0.0f);
+
+        if (m_sampleLights && isOpaque && remainingDepth > 0 && !m_scene->getLightTree().empty())
+        {
+            directLight = sampleDirectLight<hasSpecular>(hit, ray.d, random, guideCell, guideFraction);
+            outgoingScatter = { hit.pos, hit.normal, bsdfPdf, true };
+        }
+
+        // Sample the radiance along the new ray. The last segment of a path finds none
+        glm::vec3 incidentRadiance(0.0f);
+        if constexpr (fixedDepth != 0)
+        {
+            constexpr int nextFixedDepth = fixedDepth == anyDepth ? anyDepth : fixedDepth - 1;
+            if (remainingDepth > 0)
+                incidentRadiance = tracePathSegment<hasTransmission, hasSpecular, nextFixedDepth>(outgoingRay, hash(random), remainingDepth - 1, insideTransparentMaterial, outgoingScatter);
+        }
+
+        // Teach the guide how much light arrived along the new ray
+        if (m_guidingTraining && isOpaque && bsdfPdf > 0.0f)
+            m_pathGuide.record(hit.pos, outgoingRay.d, luminance(incidentRadiance) / bsdfPdf);
 
         // Evaluate the rendering equation integrand
-        return hit.material.emission + incidentRadiance * fr;
+        return emission + directLight + incidentRadiance * fr;
     }
     else
     {
@@ -87,91 +272,623 @@ glm::vec3 Renderer::tracePathSegment(const Ray& ray, const glm::vec2& random, in
     }
 }
 
+template <bool hasTransmission, bool hasSpecular, int fixedDepth>
+glm::vec3 Renderer::tracePath(const Ray& ray, const glm::vec2& random, FirstHit* firstHit)
+{
+    return tracePathSegment<hasTransmission, hasSpecular, fixedDepth>(ray, random, m_maxPathDepth, false, ScatterEvent(), firstHit);
+}
+
+Renderer::PathKernel Renderer::selectPathKernel() const
+{
+    const MaterialFeatures& features = m_scene->getMaterialFeatures();
+    auto depths = std::make_integer_sequence<int, maxFixedPathDepth + 1>();
+
+    if (features.transmission)
+        return features.specular ? selectPathKernel<true, true>(depths) : selectPathKernel<true, false>(depths);
+    else
+        return features.specular ? selectPathKernel<false, true>(depths) : selectPathKernel<false, false>(depths);
+}
+
+template <bool hasTransmission, bool hasSpecular, int... depths>
+Renderer::PathKernel Renderer::selectPathKernel(std::integer_sequence<int, depths...>) const
+{
+    static constexpr PathKernel fixedDepthKernels[] = { &Renderer::tracePath<hasTransmission, hasSpecular, depths>... };
+
+    if (m_maxPathDepth >= 0 && m_maxPathDepth < (int) sizeof...(depths)) return fixedDepthKernels[m_maxPathDepth];
+
+    return &Renderer::tracePath<hasTransmission, hasSpecular, anyDepth>;
+}
+
+template <bool hasSpecular>
+glm::vec3 Renderer::sampleDirectLight(const Hit& hit, const glm::vec3& incidentDirection, const glm::vec2& random, int guideCell, float guideFraction)
+{
+    const LightTree& lightTree = m_scene->getLightTree();
+
+    // Pick a light, then a point on it
+    float pickProbability;
+    int lightIndex = lightTree.pick(hit.pos, hit.normal, hash(random + 0.71f).x, pickProbability);
+    if (lightIndex < 0) return glm::vec3(0.0f);
+
+    LightSample sample = lightTree.sample(lightIndex, hash(random + 0.37f));
+
+    glm::vec3 toLight = sample.pos - hit.pos;
+    float distance = glm::length(toLight);
+    glm::vec3 direction = toLight / distance;
+
+    glm::vec3 bsdf = evaluateBsdf<hasSpecular>(hit.material, hit.normal, -incidentDirection, direction);
+    float cosLight = glm::abs(glm::dot(sample.normal, direction));
+    if (bsdf == glm::vec3(0.0f) || cosLight <= eps) return glm::vec3(0.0f);
+
+    // Trace a shadow ray, stopping just short of the light so that it does not hit the light itself
+    Ray shadowRay;
+    shadowRay.o = hit.pos + direction * 0.0001f;
+    shadowRay.d = direction;
+    if (m_scene->occluded(shadowRay, distance * 0.999f - 0.0001f)) return glm::vec3(0.0f);
+
+    // Convert the density from area on the light to solid angle at the surface
+    float lightPdf = pickProbability * sample.pdf * distance * distance / cosLight;
+    float bsdfPdf  = getScatterPdf<hasSpecular>(hit, -incidentDirection, direction, guideCell, guideFraction);
+    float weight   = powerHeuristic(lightPdf, bsdfPdf);
+
+    // The guide learns about direct light from these samples too, since bounces that reach a light
+    // only count for part of its contribution
+    if (m_guidingTraining)
+        m_pathGuide.record(hit.pos, direction, luminance(sample.emission) * weight / lightPdf);
+
+    return sample.emission * bsdf * weight / lightPdf;
+}
+
+template <bool hasSpecular>
+float Renderer::getScatterPdf(const Hit& hit, const glm::vec3& wo, const glm::vec3& wi, int guideCell, float guideFraction) const
+{
+    float bsdfPdf = getBsdfPdf<hasSpecular>(hit.material, hit.normal, wo, wi);
+    if (guideFraction <= 0.0f) return bsdfPdf;
+
+    return glm::mix(bsdfPdf, m_pathGuide.getPdf(guideCell, wi), guideFraction);
+}
+
 void Renderer::reset()
 {
     m_frameIndex = 0;
+    m_sequenceOffset = 0;
+    m_nextTile = 0;
+    m_lastDenoiseTime = {};
+
+    for (auto& view : m_views)
+    {
+        view->sampleCountImage.process([] (glm::ivec2 pos) { return 0.0f; }, m_threadPool, m_chunkSize);
+        view->denoiseValid = false;
+    }
 }
 
 void Renderer::render()
 {
-    if (m_scene == nullptr) return; // No scene to render
-    if (m_camera == nullptr) return; // No camera to render for
+    if (!prepareFrame()) return;
 
-    Config config(".lumos");
-    int maxPathDepth = config.getInt("max_path_depth", 3);
+    renderTiles(m_nextTile, getFrameTileCount());
+    finishFrame();
+}
+
+bool Renderer::renderFor(double budget)
+{
+    if (!prepareFrame()) return false;
+
+    // Denoising for the display happens between calls, so it comes out of the time for tracing
+    budget -= m_unbudgetedDenoiseTime;
+    m_unbudgetedDenoiseTime = 0.0;
+
+    // Trace as many tiles as the recent cost per tile says fit in the budget, but at least enough to
+    // give every thread a chunk
+    int tileCount = getFrameTileCount();
+    int minTileCount = m_threadPool.getThreadCount() * m_chunkSize;
+    int count = m_tileCost > 0.0 ? (int) glm::min(budget / m_tileCost, (double) tileCount) : minTileCount;
+    count = glm::min(glm::max(count, minTileCount), tileCount - m_nextTile);
 
-    // Trace one path for every pixel in the image
-    m_radianceImage.process([&] (glm::ivec2 pos)
+    auto start = std::chrono::steady_clock::now();
+    renderTiles(m_nextTile, m_nextTile + count);
+    std::chrono::duration<double> seconds = std::chrono::steady_clock::now() - start;
+
+    // Follow changes in the cost per tile, such as between parts of the image, within a few calls
+    double tileCost = seconds.count() / count;
+    m_tileCost = m_tileCost > 0.0 ? glm::mix(m_tileCost, tileCost, 0.5) : tileCost;
+
+    m_nextTile += count;
+    if (m_nextTile < tileCount) return false;
+
+    finishFrame();
+    return true;
+}
+
+bool Renderer::prepareFrame()
+{
+    if (m_scene == nullptr) return false; // No scene to render
+    if (m_views.empty()) return false; // No cameras to render for
+
+    for (const auto& view : m_views)
+        if (view->camera == nullptr) return false; // No camera to render for
+
+    // Start a new image if the scene has changed since the last frame. The guide has learned the
+    // old scene, so it starts over too
+    if (m_scene->getVersion() != m_sceneVersion)
     {
-        // Calculate the position of this pixel on the image on [0, 1]
-        auto coord = glm::vec2(pos) / glm::vec2(m_windowSize);
+        m_sceneVersion = m_scene->getVersion();
+        m_guidingFrameIndex = 0;
+        reset();
+    }
 
-        // Load blue noise pattern from the precomputed texture
-        auto blueNoiseInt = m_blueNoiseImage.load(pos % BLUE_NOISE_RES);
-        auto blueNoise = glm::clamp(glm::vec2(blueNoiseInt) / 255.0f, 0.0f, 1.0f);
+    // The rest only happens at the start of a frame, not when continuing one
+    if (m_nextTile > 0) return true;
 
-        // Calculate quasi-random numbers as input for the path tracer for this sample
-        auto random = R2(m_frameIndex, blueNoise);
+    // Start the path guide over on the first frame of a scene, once the scene has been built, and
+    // record training data for it during its first frames. Without guiding, the guide stays empty
+    // rather than allocating resolution^3 cells that are never used
+    if (m_guidingFrameIndex == 0 && m_pathGuiding) m_pathGuide.reset(m_scene->getBounds(), m_guidingResolution);
+    m_guidingTraining = m_pathGuiding && m_guidingFrameIndex < m_guidingTrainingFrames;
 
-        // Apply a random offset to the pixel position (anti-aliasing)
-        auto aaOffset = R2(m_frameIndex + 43, blueNoise);
-        coord += 2.0f * (aaOffset - 0.5f) / glm::vec2(m_windowSize);
+    return true;
+}
 
-        // Get the primary ray from the camera for this pixel
-        auto ray = m_camera->getPrimaryRay(coord);
+int Renderer::getFrameTileCount() const
+{
+    return (int) m_views.size() * m_views[0]->radianceImage.getTileCount();
+}
 
-        // Invoke the path tracer
-        auto color = tracePathSegment(ray, random, 0, maxPathDepth, false);
+void Renderer::renderTiles(int begin, int end)
+{
+    // Trace one path for every pixel of every view. The views' tiles are interleaved, so that the
+    // threads work on the same part of each view at once, where the views of nearby cameras see the
+    // same parts of the scene, and so that threads that finish one view early move on to the next
+    int viewCount = (int) m_views.size();
 
-        // Accumulate the path traced result in the radiance image
-        if (m_frameIndex == 0)
-        {
-            return color;
-        }
-        else
+    // Choose the path tracer once for the whole pass, rather than testing for features per bounce
+    PathKernel tracePath = selectPathKernel();
+
+    // The tiles of view i in this pass are those whose interleaved index is in [begin, end)
+    std::vector<std::unique_ptr<TileReleaseTracker>> releaseTrackers;
+    for (int i = 0; i < viewCount; ++i)
+        releaseTrackers.push_back(std::make_unique<TileReleaseTracker>((begin - i + viewCount - 1) / viewCount, (end - i + viewCount - 1) / viewCount));
+
+    m_threadPool.parallelFor(end - begin, m_chunkSize, [&] (int offset)
+    {
+        int index = begin + offset;
+        View& view = *m_views[index % viewCount];
+        int tileIndex = index / viewCount;
+        float pixelSpreadAngle = view.camera->getPixelSpreadAngle(m_windowSize);
+
+        view.radianceImage.processTile(tileIndex, [&] (glm::ivec2 pos)
         {
-            auto historyColor = m_radianceImage.load(pos);
-            auto historyWeight = (float) m_frameIndex / (float) (m_frameIndex + 1);
+            // Calculate the position of this pixel on the image on [0, 1]
+            auto coord = glm::vec2(pos) / glm::vec2(m_windowSize);
+
+            // Look up the blue noise pattern for this pixel
+            auto blueNoise = getBlueNoise(pos);
+
+            // Calculate quasi-random numbers as input for the path tracer for this sample
+            auto random = R2(m_sequenceOffset + m_frameIndex, blueNoise);
+
+            // Apply a random offset to the pixel position (anti-aliasing)
+            auto aaOffset = R2(m_sequenceOffset + m_frameIndex + 43, blueNoise);
+            coord += 2.0f * (aaOffset - 0.5f) / glm::vec2(m_windowSize);
+
+            // Get the primary ray from the camera for this pixel
+            auto ray = view.camera->getPrimaryRay(coord);
+            ray.coneSpread = pixelSpreadAngle;
+
+            // Invoke the path tracer
+            FirstHit firstHit;
+            auto color = (this->*tracePath)(ray, random, &firstHit);
+
+            // Accumulate the path traced result in the radiance image, and the first hit properties in
+            // the denoiser's guide images and the depth image
+            float sampleCount = view.sampleCountImage.load(pos);
+            view.sampleCountImage.store(pos, sampleCount + 1.0f);
+
+            if (sampleCount == 0.0f)
+            {
+                view.momentImage.store(pos, luminance(color) * luminance(color));
+                view.albedoImage.store(pos, firstHit.albedo);
+                view.normalImage.store(pos, firstHit.normal);
+                view.depthImage.store(pos, firstHit.depth);
+
+                return color;
+            }
+            else
+            {
+                auto historyColor = view.radianceImage.load(pos);
+                auto historyWeight = sampleCount / (sampleCount + 1.0f);
+
+                view.momentImage.store(pos, glm::mix(luminance(color) * luminance(color), view.momentImage.load(pos), historyWeight));
+                view.albedoImage.store(pos, glm::mix(firstHit.albedo, view.albedoImage.load(pos), historyWeight));
+                view.normalImage.store(pos, glm::mix(firstHit.normal, view.normalImage.load(pos), historyWeight));
+                view.depthImage.store(pos, glm::mix(firstHit.depth, view.depthImage.load(pos), historyWeight));
+
+                return glm::mix(color, historyColor, historyWeight);
+            }
+        });
+
+        // Let mapped images drop the tiles that have been traced, so that only the part of each
+        // view being traced stays in memory
+        int blockBegin, blockEnd;
+        if (releaseTrackers[index % viewCount]->finish(tileIndex, blockBegin, blockEnd)) view.releaseTiles(blockBegin, blockEnd);
+    });
+
+    for (auto& view : m_views)
+    {
+        view->release();
+        view->denoiseValid = false;
+    }
+}
 
-            return glm::mix(color, historyColor, historyWeight);
-        }
-    }, m_groupCount);
+void Renderer::finishFrame()
+{
+    // Rebuild the guide's distributions after 1, 2, 4, ... frames of training. Each round has twice
+    // the data of the one before, and is sampled with a better guide
+    ++m_guidingFrameIndex;
+    if (m_guidingTraining && ((m_guidingFrameIndex & (m_guidingFrameIndex - 1)) == 0 || m_guidingFrameIndex == m_guidingTrainingFrames))
+        m_pathGuide.update();
 
     // Increment frame counter for the next frame
     ++m_frameIndex;
+    m_nextTile = 0;
+    for (auto& view : m_views) view->renderedCamera = view->camera->clone();
 }
 
-void Renderer::display(sf::RenderWindow& window) {
-    if (m_scene == nullptr) return; // No scene to render
-    if (m_camera == nullptr) return; // No camera to render for
+void Renderer::updateDenoisedImage(View& view)
+{
+    if (view.denoiseValid) return;
 
-    // Update display image with the latest path-traced result
-    m_displayImage.process([&] (glm::ivec2 pos)
-        {
-            // Load the radiance value from the radiance image
-            auto radiance = m_radianceImage.load(pos);
+    auto start = std::chrono::steady_clock::now();
 
-            // Tone map the radiance to obtain the final color
-            auto color = tonemapHejlBurgess(radiance);
+    m_denoiser.denoise(view.radianceImage, view.momentImage, view.albedoImage, view.normalImage, view.sampleCountImage, view.denoisedImage, m_threadPool);
+    view.release();
 
-            // Store the color in the image
-			return u8vec4(255.0f * glm::vec4(color, 1.0f));
-        }, m_groupCount
-    );
+    m_lastDenoiseTime = std::chrono::steady_clock::now();
+    std::chrono::duration<double> seconds = m_lastDenoiseTime - start;
+    m_denoiseTime += seconds.count();
+    m_unbudgetedDenoiseTime += seconds.count();
+    view.denoiseValid = true;
+}
 
-    // Upload the display image to the GPU as a sf::Texture
-    m_displayTexture.update(m_displayImage.data());
+void Renderer::updateDisplayImage(View& view, bool updateDenoised)
+{
+    if (!m_displayImage) m_displayImage = std::make_unique<Image<u8vec4>>(m_windowSize, PixelLayout::RowMajor, m_imageBacking);
+
+    auto tonemap = [&] (const auto& outputImage)
+    {
+        m_displayImage->process([&] (glm::ivec2 pos)
+            {
+                // Load the radiance value from the output image
+                glm::vec3 radiance = outputImage.load(pos);
+
+                // Tone map the radiance to obtain the final color
+                auto color = tonemapHejlBurgess(radiance);
+
+                // Store the color in the image
+                return u8vec4(255.0f * glm::vec4(color, 1.0f));
+            }, m_threadPool, m_chunkSize
+        );
+    };
+
+    // Display the denoised image if denoising is enabled, or the radiance image otherwise
+    if (m_denoise)
+    {
+        if (updateDenoised) updateDenoisedImage(view);
+        tonemap(view.denoisedImage);
+    }
+    else
+    {
+        tonemap(view.radianceImage);
+    }
+
+    view.release();
+}
+
+void Renderer::display(sf::RenderWindow& window) {
+    if (m_scene == nullptr) return; // No scene to render
+    if (m_views.empty() || m_views[0]->camera == nullptr) return; // No camera to render for
+
+    // Update display image with the latest path-traced result of the first view. Denoising takes
+    // far longer than the few tiles traced between displays, so the denoised image is refreshed at
+    // most every denoise_interval, and straight away when the image starts over
+    std::chrono::duration<double> sinceDenoise = std::chrono::steady_clock::now() - m_lastDenoiseTime;
+    updateDisplayImage(*m_views[0], sinceDenoise.count() >= m_denoiseInterval);
+
+    // Upload the display image to the GPU as a sf::Texture, which is only created once there is a
+    // window to display it in
+    if (m_displayTexture.getSize().x == 0) m_displayTexture.create((unsigned) m_windowSize.x, (unsigned) m_windowSize.y);
+    m_displayTexture.update(m_displayImage->data());
 
     // Display the display texture to the screen using a sf::Sprite
     window.draw(sf::Sprite(m_displayTexture));
 }
 
+void Renderer::saveImage(const char* path, int viewIndex)
+{
+    if (m_scene == nullptr) return; // No scene to render
+    if (viewIndex >= (int) m_views.size() || m_views[viewIndex]->camera == nullptr) return; // No camera to render for
+
+    View& view = *m_views[viewIndex];
+
+    // PFM files hold the radiance itself, so they are written straight from the view's images
+    // without tone mapping or a display image, which a very large image may not have room for
+    std::string extension = std::filesystem::path(path).extension().string();
+    if (extension == ".pfm" || extension == ".PFM")
+    {
+        if (m_denoise)
+        {
+            updateDenoisedImage(view);
+            view.denoisedImage.writeToPfm(path);
+        }
+        else
+        {
+            view.radianceImage.writeToPfm(path);
+        }
+
+        view.release();
+        return;
+    }
+
+    updateDisplayImage(view);
+    m_displayImage->writeToFile(path);
+
+    // Without a window, the display image is only needed while saving
+    if (m_displayTexture.getSize().x == 0) m_displayImage.reset();
+}
+
 void Renderer::setScene(const Scene* scene)
 {
+    // The guide only depends on the scene, so it keeps learning when the camera moves, and starts
+    // over for a new scene
+    if (scene != m_scene) m_guidingFrameIndex = 0;
+
     m_scene = scene;
 }
 
 void Renderer::setCamera(const Camera* camera)
 {
-    m_camera = camera;
+    setCameras({ camera });
+}
+
+void Renderer::setCameras(const std::vector<const Camera*>& cameras)
+{
+    // Keep the images of existing views rather than allocating them again
+    while (m_views.size() > cameras.size()) m_views.pop_back();
+    while (m_views.size() < cameras.size()) m_views.push_back(std::make_unique<View>(m_windowSize, m_pixelLayout, m_imageBacking));
+
+    for (std::size_t i = 0; i < cameras.size(); ++i) m_views[i]->camera = cameras[i];
+
+    reset();
+}
+
+void Renderer::updateCameras()
+{
+    bool canReproject = m_reprojection && m_scene != nullptr;
+    for (const auto& view : m_views)
+        canReproject = canReproject && view->camera != nullptr && view->renderedCamera != nullptr;
+
+    if (!canReproject)
+    {
+        reset();
+        return;
+    }
+
+    if (!m_reprojectionView) m_reprojectionView = std::make_unique<View>(m_windowSize, m_pixelLayout, m_imageBacking);
+
+    for (auto& sourcePointer : m_views)
+    {
+        View& source = *sourcePointer;
+        View& target = *m_reprojectionView;
+        const Camera& previousCamera = *source.renderedCamera;
+
+        // For each pixel of the new view, find the surface it sees through its centre, and where that
+        // surface was on the previous image
+        m_threadPool.parallelFor(target.radianceImage.getTileCount(), m_chunkSize, [&] (int tileIndex)
+        {
+            target.radianceImage.processTile(tileIndex, [&] (glm::ivec2 pos)
+            {
+                Ray ray = source.camera->getPrimaryRay((glm::vec2(pos) + 0.5f) / glm::vec2(m_windowSize));
+
+                Hit hit;
+                bool hitSurface = m_scene->intersects(ray, hit);
+
+                // Where the ray misses, it sees the same ambient light from every position, so only
+                // its direction matters
+                glm::vec2 previousCoord;
+                bool valid = previousCamera.project(hitSurface ? hit.pos : previousCamera.position + ray.d, previousCoord) &&
+                    previousCoord.x >= 0.0f && previousCoord.y >= 0.0f && previousCoord.x < 1.0f && previousCoord.y < 1.0f;
+
+                glm::ivec2 previousPos = glm::min(glm::ivec2(previousCoord * glm::vec2(m_windowSize)), m_windowSize - 1);
+
+                // Reject pixels that saw a different surface, because it was hidden behind another
+                // one or is seen from a different side now
+                if (valid)
+                {
+                    float previousDepth = source.depthImage.load(previousPos);
+
+                    if (hitSurface)
+                    {
+                        float expectedDepth = glm::length(hit.pos - previousCamera.position);
+                        valid = glm::abs(previousDepth - expectedDepth) <= reprojectionDepthTolerance * expectedDepth &&
+                            glm::dot(source.normalImage.load(previousPos), hit.normal) >= reprojectionMinNormalCos;
+                    }
+                    else
+                    {
+                        valid = std::isinf(previousDepth);
+                    }
+                }
+
+                if (!valid || source.sampleCountImage.load(previousPos) == 0.0f)
+                {
+                    target.sampleCountImage.store(pos, 0.0f);
+                    return glm::vec3(0.0f);
+                }
+
+                target.momentImage.store(pos, source.momentImage.load(previousPos));
+                target.albedoImage.store(pos, source.albedoImage.load(previousPos));
+                target.normalImage.store(pos, source.normalImage.load(previousPos));
+                target.depthImage.store(pos, hitSurface ? hit.distance : inf);
+                target.sampleCountImage.store(pos, glm::min(source.sampleCountImage.load(previousPos), (float) m_reprojectionMaxSamples));
+
+                return source.radianceImage.load(previousPos);
+            });
+        });
+
+        source.release();
+        target.release();
+
+        target.camera = source.camera;
+        target.renderedCamera = source.camera->clone();
+        target.denoiseValid = false;
+
+        std::swap(sourcePointer, m_reprojectionView);
+    }
+
+    // Count samples from the move, and continue the sequence of random numbers so that the pixels
+    // that kept their samples take new ones, including any from an unfinished frame
+    m_sequenceOffset += m_frameIndex + (m_nextTile > 0 ? 1 : 0);
+    m_frameIndex = 0;
+    m_nextTile = 0;
+    m_lastDenoiseTime = {};
+}
+
+std::uint64_t Renderer::getSettingsHash() const
+{
+    // FNV-1a over the bytes of each setting
+    std::uint64_t hash = 0xcbf29ce484222325;
+    auto add = [&] (const auto& value)
+    {
+        const unsigned char* bytes = reinterpret_cast<const unsigned char*>(&value);
+        for (std::size_t i = 0; i < sizeof(value); ++i) hash = (hash ^ bytes[i]) * 0x100000001b3;
+    };
+
+    add(m_ambient);
+    add(m_maxPathDepth);
+    add(m_sampleLights);
+    add(m_pathGuiding);
+    add(m_guidingTrainingFrames);
+    add(m_guidingResolution);
+    add(m_reprojection);
+    add(m_reprojectionMaxSamples);
+
+    return hash;
+}
+
+void Renderer::saveCheckpoint(Checkpoint& checkpoint) const
+{
+    assert(m_nextTile == 0);
+
+    checkpoint.write(checkpointMagic);
+    checkpoint.write(checkpointVersion);
+
+    // What a render must match to continue from the checkpoint
+    checkpoint.write(m_windowSize);
+    checkpoint.write(m_views[0]->radianceImage.getLayout());
+    checkpoint.write((std::uint64_t) m_scene->getTriangles().size());
+    checkpoint.write((std::uint64_t) m_scene->getShapeCount());
+    checkpoint.write((std::uint64_t) m_scene->getSphereCount());
+    checkpoint.write((int) m_views.size());
+    checkpoint.write(getSettingsHash());
+
+    // The rays through opposite corners of the image capture the field of view as well as the pose
+    for (const auto& view : m_views)
+    {
+        checkpoint.write(view->camera->position);
+        checkpoint.write(view->camera->rotation);
+        checkpoint.write(view->camera->getPrimaryRay(glm::vec2(0.0f)).d);
+        checkpoint.write(view->camera->getPrimaryRay(glm::vec2(1.0f)).d);
+    }
+
+    // The state of the sampler, which decides the random numbers and guided directions of later frames
+    checkpoint.write(m_frameIndex);
+    checkpoint.write(m_sequenceOffset);
+    checkpoint.write(m_guidingFrameIndex);
+    m_pathGuide.saveCheckpoint(checkpoint);
+
+    // The accumulated images, byte for byte, so that they are restored exactly. They are written
+    // straight from the views when the checkpoint is saved
+    auto writeImage = [&] (const auto& image) { checkpoint.writeReference(image.getStorage(), image.getStorageBytes()); };
+
+    for (const auto& view : m_views)
+    {
+        writeImage(view->radianceImage);
+        writeImage(view->momentImage);
+        writeImage(view->albedoImage);
+        writeImage(view->normalImage);
+        writeImage(view->depthImage);
+        writeImage(view->sampleCountImage);
+    }
+}
+
+bool Renderer::loadCheckpoint(Checkpoint& checkpoint)
+{
+    if (m_scene == nullptr || m_views.empty()) return false;
+
+    for (const auto& view : m_views)
+        if (view->camera == nullptr) return false;
+
+    // Reads the next value of the checkpoint and checks that it equals `expected`
+    auto matches = [&] (const auto& expected)
+    {
+        auto value = expected;
+        return checkpoint.read(value) && value == expected;
+    };
+
+    bool valid =
+        matches(checkpointMagic) &&
+        matches(checkpointVersion) &&
+        matches(m_windowSize) &&
+        matches(m_views[0]->radianceImage.getLayout()) &&
+        matches((std::uint64_t) m_scene->getTriangles().size()) &&
+        matches((std::uint64_t) m_scene->getShapeCount()) &&
+        matches((std::uint64_t) m_scene->getSphereCount()) &&
+        matches((int) m_views.size()) &&
+        matches(getSettingsHash());
+
+    for (const auto& view : m_views)
+    {
+        valid = valid &&
+            matches(view->camera->position) &&
+            matches(view->camera->rotation) &&
+            matches(view->camera->getPrimaryRay(glm::vec2(0.0f)).d) &&
+            matches(view->camera->getPrimaryRay(glm::vec2(1.0f)).d);
+    }
+
+    if (!valid) return false;
+
+    auto readImage = [&] (auto& image) { return checkpoint.readBytes(image.getStorage(), image.getStorageBytes()); };
+
+    valid = checkpoint.read(m_frameIndex) && checkpoint.read(m_sequenceOffset) && checkpoint.read(m_guidingFrameIndex) &&
+        m_pathGuide.loadCheckpoint(checkpoint);
+
+    for (const auto& view : m_views)
+    {
+        valid = valid &&
+            readImage(view->radianceImage) &&
+            readImage(view->momentImage) &&
+            readImage(view->albedoImage) &&
+            readImage(view->normalImage) &&
+            readImage(view->depthImage) &&
+            readImage(view->sampleCountImage);
+    }
+
+    // A checkpoint that ends early leaves the images partly restored, so start over
+    if (!valid)
+    {
+        m_guidingFrameIndex = 0;
+        reset();
+        return false;
+    }
+
+    // Continue with the next frame of the scene as it is now, rather than starting over because
+    // the scene was loaded after the renderer was set up
+    m_sceneVersion = m_scene->getVersion();
+    m_nextTile = 0;
+
+    for (auto& view : m_views)
+    {
+        view->renderedCamera = view->camera->clone();
+        view->denoiseValid = false;
+    }
+
+    return true;
 }
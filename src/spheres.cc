@@ -0,0 +1,394 @@
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <limits>
+#include <sstream>
+#include <utility>
+
+#include <fmt/format.h>
+
+#include "spheres.hh"
+
+Box SpherePacket::getBoundingBox() const
+{
+    Box box = Box::empty();
+    for (int i = 0; i < width; ++i)
+    {
+        if (std::isnan(x[i])) continue; // Unused slot
+
+        box.grow(getCentre(i) - radius[i]);
+        box.grow(getCentre(i) + radius[i]);
+    }
+
+    return box;
+}
+
+void SphereSet::add(const glm::vec3& centre, float radius, uint materialIndex)
+{
+    m_centres.push_back(centre);
+    m_radii.push_back(radius);
+    m_newMaterialIndices.push_back(materialIndex);
+}
+
+// Spreads the lower 10 bits of v out so that there are two zeros between each bit
+static uint spreadBits3(uint v)
+{
+    v &= 0x000003ff;
+    v = (v | (v << 16)) & 0x030000ff;
+    v = (v | (v << 8))  & 0x0300f00f;
+    v = (v | (v << 4))  & 0x030c30c3;
+    v = (v | (v << 2))  & 0x09249249;
+    return v;
+}
+
+void SphereSet::build()
+{
+    if (m_centres.empty()) return;
+
+    // Unpack the spheres from the last build, so that they are sorted together with the new ones
+    for (std::size_t i = 0; i < m_packets.size() * SpherePacket::width; ++i)
+    {
+        const SpherePacket& packet = m_packets[i / SpherePacket::width];
+        int slot = (int) (i % SpherePacket::width);
+        if (std::isnan(packet.x[slot])) continue;
+
+        m_centres.push_back(packet.getCentre(slot));
+        m_radii.push_back(packet.radius[slot]);
+        m_newMaterialIndices.push_back(m_materialIndices[i]);
+    }
+
+    m_packets.clear();
+    m_materialIndices.clear();
+
+    m_size = m_centres.size();
+
+    // Sort the spheres along a Morton curve through the box around their centres, so that the four
+    // spheres in each packet are close together
+    Box centreBounds = Box::empty();
+    for (const auto& centre : m_centres) centreBounds.grow(centre);
+
+    glm::vec3 scale = 1023.0f / glm::max(centreBounds.extent(), glm::vec3(1e-20f));
+
+    std::vector<std::pair<uint, uint>> codes; // Morton code and index of each sphere
+    codes.reserve(m_size);
+    for (uint i = 0; i < m_size; ++i)
+    {
+        glm::uvec3 cell = glm::uvec3(glm::clamp((m_centres[i] - centreBounds.min) * scale, 0.0f, 1023.0f));
+        codes.emplace_back(spreadBits3(cell.x) | (spreadBits3(cell.y) << 1) | (spreadBits3(cell.z) << 2), i);
+    }
+
+    std::sort(codes.begin(), codes.end());
+
+    // Pack runs of four spheres, filling the slots left over in the last packet with NaNs
+    std::size_t packetCount = (m_size + SpherePacket::width - 1) / SpherePacket::width;
+    std::vector<SpherePacket> packets(packetCount);
+    std::vector<uint> materialIndices(packetCount * SpherePacket::width, 0);
+
+    for (std::size_t i = 0; i < packetCount * SpherePacket::width; ++i)
+    {
+        SpherePacket& packet = packets[i / SpherePacket::width];
+        int slot = (int) (i % SpherePacket::width);
+
+        if (i >= m_size)
+        {
+            packet.x[slot] = packet.y[slot] = packet.z[slot] = std::numeric_limits<float>::quiet_NaN();
+            packet.radius[slot] = 0.0f;
+            continue;
+        }
+
+        uint index = codes[i].second;
+        packet.x[slot] = m_centres[index].x;
+        packet.y[slot] = m_centres[index].y;
+        packet.z[slot] = m_centres[index].z;
+        packet.radius[slot] = m_radii[index];
+        materialIndices[i] = m_newMaterialIndices[index];
+    }
+
+    m_centres.clear(); m_centres.shrink_to_fit();
+    m_radii.clear(); m_radii.shrink_to_fit();
+    m_newMaterialIndices.clear(); m_newMaterialIndices.shrink_to_fit();
+
+    // Build the hierarchy over the packets and store them in the order of its leaves
+    std::vector<Box> boxes;
+    boxes.reserve(packetCount);
+    for (const auto& packet : packets) boxes.push_back(packet.getBoundingBox());
+
+    std::vector<uint> order;
+    m_bvh.build(boxes, order);
+
+    m_bounds = Box::empty();
+    for (const auto& box : boxes) m_bounds.grow(box);
+
+    m_packets.reserve(packetCount);
+    m_materialIndices.reserve(packetCount * SpherePacket::width);
+    for (uint index : order)
+    {
+        m_packets.push_back(packets[index]);
+        for (int slot = 0; slot < SpherePacket::width; ++slot)
+            m_materialIndices.push_back(materialIndices[index * SpherePacket::width + slot]);
+    }
+}
+
+// Types of PLY properties
+enum class PlyType { Int8, UInt8, Int16, UInt16, Int32, UInt32, Float32, Float64 };
+
+// Returns the type with the given name, or false if there is none
+static bool getPlyType(const std::string& name, PlyType& type)
+{
+    static const std::pair<const char*, PlyType> types[] = {
+        { "char",  PlyType::Int8 },    { "int8",    PlyType::Int8 },
+        { "uchar", PlyType::UInt8 },   { "uint8",   PlyType::UInt8 },
+        { "short", PlyType::Int16 },   { "int16",   PlyType::Int16 },
+        { "ushort", PlyType::UInt16 }, { "uint16",  PlyType::UInt16 },
+        { "int",   PlyType::Int32 },   { "int32",   PlyType::Int32 },
+        { "uint",  PlyType::UInt32 },  { "uint32",  PlyType::UInt32 },
+        { "float", PlyType::Float32 }, { "float32", PlyType::Float32 },
+        { "double", PlyType::Float64 }, { "float64", PlyType::Float64 },
+    };
+
+    for (const auto& entry : types)
+    {
+        if (name != entry.first) continue;
+
+        type = entry.second;
+        return true;
+    }
+
+    return false;
+}
+
+// Reads one binary PLY value of the given type, swapping its bytes if the file's byte order is not
+// the machine's
+template <typename T>
+static bool readPlyBinary(std::istream& stream, bool swapBytes, double& value)
+{
+    char bytes[sizeof(T)];
+    if (!stream.read(bytes, sizeof(T))) return false;
+    if (swapBytes) std::reverse(bytes, bytes + sizeof(T));
+
+    T result;
+    std::memcpy(&result, bytes, sizeof(T));
+    value = (double) result;
+    return true;
+}
+
+// Reads one PLY value, as text if the file is ascii
+static bool readPlyValue(std::istream& stream, bool ascii, bool swapBytes, PlyType type, double& value)
+{
+    if (ascii) return (bool) (stream >> value);
+
+    switch (type)
+    {
+        case PlyType::Int8:    return readPlyBinary<std::int8_t>(stream, swapBytes, value);
+        case PlyType::UInt8:   return readPlyBinary<std::uint8_t>(stream, swapBytes, value);
+        case PlyType::Int16:   return readPlyBinary<std::int16_t>(stream, swapBytes, value);
+        case PlyType::UInt16:  return readPlyBinary<std::uint16_t>(stream, swapBytes, value);
+        case PlyType::Int32:   return readPlyBinary<std::int32_t>(stream, swapBytes, value);
+        case PlyType::UInt32:  return readPlyBinary<std::uint32_t>(stream, swapBytes, value);
+        case PlyType::Float32: return readPlyBinary<float>(stream, swapBytes, value);
+        case PlyType::Float64: return readPlyBinary<double>(stream, swapBytes, value);
+    }
+
+    return false;
+}
+
+bool SphereSet::loadFromFile(
+    const char* path,
+    float defaultRadius,
+    const std::vector<uint>& materialIndices,
+    uint defaultMaterialIndex,
+    std::string& warning,
+    std::string& error
+)
+{
+    std::ifstream file(path, std::ios_base::in | std::ios_base::binary);
+    if (!file)
+    {
+        error += fmt::format("Cannot open file {}\n", path);
+        return false;
+    }
+
+    struct Property
+    {
+        std::string name;
+        PlyType type;
+        bool isList = false;
+        PlyType countType; // Type of a list's length
+    };
+
+    struct Element
+    {
+        std::string name;
+        std::size_t count;
+        std::vector<Property> properties;
+    };
+
+    // Read the header, which lists the elements in the order they are stored
+    std::vector<Element> elements;
+    bool ascii = false, bigEndian = false;
+
+    std::string line;
+    if (!std::getline(file, line) || line.compare(0, 3, "ply") != 0)
+    {
+        error += fmt::format("{} is not a PLY file\n", path);
+        return false;
+    }
+
+    while (true)
+    {
+        if (!std::getline(file, line))
+        {
+            error += fmt::format("{} ends before the end of its PLY header\n", path);
+            return false;
+        }
+
+        std::istringstream words(line);
+        std::string keyword;
+        words >> keyword;
+
+        if (keyword == "end_header") break;
+
+        if (keyword == "format")
+        {
+            std::string format;
+            words >> format;
+
+            ascii = format == "ascii";
+            bigEndian = format == "binary_big_endian";
+
+            if (!ascii && !bigEndian && format != "binary_little_endian")
+            {
+                error += fmt::format("{} has unknown PLY format {}\n", path, format);
+                return false;
+            }
+        }
+        else if (keyword == "element")
+        {
+            Element element;
+            words >> element.name >> element.count;
+            elements.push_back(element);
+        }
+        else if (keyword == "property" && !elements.empty())
+        {
+            Property property;
+            std::string typeName;
+            words >> typeName;
+
+            if (typeName == "list")
+            {
+                std::string countTypeName;
+                words >> countTypeName >> typeName;
+                property.isList = true;
+
+                if (!getPlyType(countTypeName, property.countType))
+                {
+                    error += fmt::format("{} has unknown PLY type {}\n", path, countTypeName);
+                    return false;
+                }
+            }
+
+            words >> property.name;
+
+            if (!getPlyType(typeName, property.type))
+            {
+                error += fmt::format("{} has unknown PLY type {}\n", path, typeName);
+                return false;
+            }
+
+            elements.back().properties.push_back(property);
+        }
+    }
+
+    std::uint16_t byteOrderTest = 1;
+    bool littleEndianMachine = *reinterpret_cast<const std::uint8_t*>(&byteOrderTest) == 1;
+    bool swapBytes = !ascii && bigEndian == littleEndianMachine;
+
+    bool foundVertices = false;
+    std::size_t unknownMaterialCount = 0;
+
+    for (const auto& element : elements)
+    {
+        // Find the properties that describe a sphere
+        int x = -1, y = -1, z = -1, radius = -1, material = -1;
+        for (int i = 0; i < (int) element.properties.size(); ++i)
+        {
+            const auto& name = element.properties[i].name;
+            if (element.properties[i].isList) continue;
+
+            if      (name == "x") x = i;
+            else if (name == "y") y = i;
+            else if (name == "z") z = i;
+            else if (name == "radius") radius = i;
+            else if (name == "material_index") material = i;
+        }
+
+        bool isVertex = element.name == "vertex";
+        if (isVertex && (x < 0 || y < 0 || z < 0))
+        {
+            error += fmt::format("{} has vertices without x, y and z\n", path);
+            return false;
+        }
+
+        if (isVertex && radius < 0)
+            warning += fmt::format("{} has no radius property, so every sphere has radius {}\n", path, defaultRadius);
+
+        // Every element has to be read through, even those that are not used, to reach the next
+        std::vector<double> values(element.properties.size());
+        for (std::size_t index = 0; index < element.count; ++index)
+        {
+            for (std::size_t i = 0; i < element.properties.size(); ++i)
+            {
+                const Property& property = element.properties[i];
+
+                bool success;
+                if (property.isList)
+                {
+                    double length;
+                    success = readPlyValue(file, ascii, swapBytes, property.countType, length);
+                    for (std::size_t j = 0; success && j < (std::size_t) length; ++j)
+                        success = readPlyValue(file, ascii, swapBytes, property.type, values[i]);
+                }
+                else
+                {
+                    success = readPlyValue(file, ascii, swapBytes, property.type, values[i]);
+                }
+
+                if (!success)
+                {
+                    error += fmt::format("{} ends in the middle of element {} {}\n", path, element.name, index);
+                    return false;
+                }
+            }
+
+            if (!isVertex) continue;
+
+            glm::vec3 centre((float) values[x], (float) values[y], (float) values[z]);
+            float sphereRadius = radius >= 0 ? (float) values[radius] : defaultRadius;
+
+            uint materialIndex = defaultMaterialIndex;
+            if (material >= 0)
+            {
+                double id = values[material];
+                if (id >= 0.0 && id < (double) materialIndices.size()) materialIndex = materialIndices[(std::size_t) id];
+                else ++unknownMaterialCount;
+            }
+
+            add(centre, sphereRadius, materialIndex);
+        }
+
+        foundVertices |= isVertex;
+    }
+
+    if (!foundVertices)
+    {
+        error += fmt::format("{} has no vertex element\n", path);
+        return false;
+    }
+
+    if (unknownMaterialCount > 0)
+        warning += fmt::format("{} spheres in {} have a material_index with no material, so use the default material\n", unknownMaterialCount, path);
+
+    return true;
+}
@@ -0,0 +1,139 @@
+#include <stb/stb_image.h>
+
+#include "texture.hh"
+
+bool Texture::loadFromFile(const char* path, bool isSrgb)
+{
+    int width, height, channelCount;
+    unsigned char* data = stbi_load(path, &width, &height, &channelCount, 4);
+
+    if (data == NULL) return false;
+
+    m_isSrgb = isSrgb;
+
+    // Work in floating point while generating the mip levels, decoding sRGB so that averaging is
+    // done in linear space
+    auto decode = [&] (glm::u8 value) { return isSrgb ? srgbToLinear(value) : value / 255.0f; };
+    auto encode = [&] (float value) { return isSrgb ? linearToSrgb(value) : (glm::u8) (glm::clamp(value, 0.0f, 1.0f) * 255.0f + 0.5f); };
+
+    glm::ivec2 size(width, height);
+    std::vector<glm::vec4> texels(width * height);
+    for (int i = 0; i < width * height; ++i)
+        texels[i] = glm::vec4(decode(data[4 * i + 0]), decode(data[4 * i + 1]), decode(data[4 * i + 2]), data[4 * i + 3] / 255.0f);
+
+    stbi_image_free(data);
+
+    m_levels.clear();
+    m_texels.clear();
+
+    while (true)
+    {
+        // Allocate the level, padding it to a whole number of tiles
+        Level level;
+        level.size = size;
+        level.tileCountX = (size.x + tileSize - 1) / tileSize;
+        level.offset = m_texels.size();
+
+        int tileCountY = (size.y + tileSize - 1) / tileSize;
+        m_texels.resize(m_texels.size() + std::size_t(level.tileCountX) * tileCountY * tileSize * tileSize);
+
+        for (int y = 0; y < size.y; ++y)
+        {
+            for (int x = 0; x < size.x; ++x)
+            {
+                glm::vec4 texel = texels[y * size.x + x];
+                m_texels[getTexelIndex(level, glm::ivec2(x, y))] = u8vec4(encode(texel.r), encode(texel.g), encode(texel.b), (glm::u8) (texel.a * 255.0f + 0.5f));
+            }
+        }
+
+        m_levels.push_back(level);
+
+        if (size.x == 1 && size.y == 1) break;
+
+        // Downsample with a box filter to create the next level. Odd sizes round up, so that the
+        // last row and column are kept rather than dropped; their 2x2 boxes are clamped to the edge
+        glm::ivec2 nextSize = (size + 1) / 2;
+        std::vector<glm::vec4> nextTexels(nextSize.x * nextSize.y);
+
+        for (int y = 0; y < nextSize.y; ++y)
+        {
+            for (int x = 0; x < nextSize.x; ++x)
+            {
+                glm::ivec2 pos0 = glm::min(2 * glm::ivec2(x, y), size - 1);
+                glm::ivec2 pos1 = glm::min(pos0 + 1, size - 1);
+
+                nextTexels[y * nextSize.x + x] = 0.25f * (
+                    texels[pos0.y * size.x + pos0.x] + texels[pos0.y * size.x + pos1.x] +
+                    texels[pos1.y * size.x + pos0.x] + texels[pos1.y * size.x + pos1.x]
+                );
+            }
+        }
+
+        size = nextSize;
+        texels = std::move(nextTexels);
+    }
+
+    return true;
+}
+
+glm::vec4 Texture::fetch(const Level& level, glm::ivec2 pos) const
+{
+    u8vec4 texel = m_texels[getTexelIndex(level, pos)];
+
+    if (m_isSrgb)
+        return glm::vec4(srgbToLinear(texel.r), srgbToLinear(texel.g), srgbToLinear(texel.b), texel.a / 255.0f);
+    else
+        return glm::vec4(texel) / 255.0f;
+}
+
+glm::vec4 Texture::sample(glm::vec2 uv, float footprint) const
+{
+    if (m_levels.empty()) return glm::vec4(1.0f);
+
+    // Level 0 texels are 1 / size wide in texture space, and each level doubles that
+    glm::vec2 baseSize(m_levels[0].size);
+    float lod = glm::log2(glm::max(footprint * glm::sqrt(baseSize.x * baseSize.y), 1e-8f));
+    int levelIndex = glm::clamp((int) glm::round(lod), 0, (int) m_levels.size() - 1);
+
+    const Level& level = m_levels[levelIndex];
+
+    // Flip v, as the image rows are stored top to bottom, then find the four texels to blend
+    glm::vec2 pos = glm::vec2(uv.x, 1.0f - uv.y) * glm::vec2(level.size) - 0.5f;
+    glm::vec2 floorPos = glm::floor(pos);
+    glm::vec2 weight = pos - floorPos;
+
+    // Wrap the texel positions (modulo with positive results)
+    glm::ivec2 pos0 = glm::ivec2(floorPos) % level.size;
+    pos0 += glm::ivec2(glm::lessThan(pos0, glm::ivec2(0))) * level.size;
+    glm::ivec2 pos1 = (pos0 + 1) % level.size;
+
+    glm::vec4 top    = glm::mix(fetch(level, pos0), fetch(level, glm::ivec2(pos1.x, pos0.y)), weight.x);
+    glm::vec4 bottom = glm::mix(fetch(level, glm::ivec2(pos0.x, pos1.y)), fetch(level, pos1), weight.x);
+
+    return glm::mix(top, bottom, weight.y);
+}
+
+int TextureCache::load(const std::string& path, bool isSrgb, std::string& warning)
+{
+    auto key = std::make_pair(path, isSrgb);
+
+    auto it = m_indices.find(key);
+    if (it != m_indices.end()) return it->second;
+
+    auto texture = std::make_unique<Texture>();
+    int index = -1;
+
+    if (texture->loadFromFile(path.c_str(), isSrgb))
+    {
+        index = (int) m_textures.size();
+        m_textures.push_back(std::move(texture));
+    }
+    else
+    {
+        warning += "failed to load texture: " + path + "\n";
+    }
+
+    // Failures are cached too, so that the warning is only given once
+    m_indices[key] = index;
+    return index;
+}
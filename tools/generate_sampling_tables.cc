@@ -0,0 +1,59 @@
+/*
+ * Generates the sampling tables that are compiled into lumos, so that the renderer reads no files
+ * at startup. Run by the build with the blue noise texture and the header to write:
+ *
+ *     generate_sampling_tables assets/bluenoise.png sampling_tables.hh
+ *
+ * The blue noise is stored as the pairs of floats on [0, 1] that the renderer offsets its
+ * low-discrepancy sequence by, one pair per pixel in row-major order
+ */
+
+#include <cstdio>
+
+#define STB_IMAGE_IMPLEMENTATION
+#include <stb/stb_image.h>
+
+int main(int argc, char** argv)
+{
+    if (argc != 3)
+    {
+        std::fprintf(stderr, "usage: %s <blue noise png> <output header>\n", argv[0]);
+        return 1;
+    }
+
+    // Only the first two channels of the texture are used
+    int width, height, channelCount;
+    unsigned char* blueNoise = stbi_load(argv[1], &width, &height, &channelCount, 4);
+
+    if (blueNoise == nullptr || width != height || (width & (width - 1)) != 0)
+    {
+        std::fprintf(stderr, "%s: %s is not a square power-of-two image\n", argv[0], argv[1]);
+        return 1;
+    }
+
+    FILE* file = std::fopen(argv[2], "w");
+    if (file == nullptr)
+    {
+        std::fprintf(stderr, "%s: cannot write %s\n", argv[0], argv[2]);
+        return 1;
+    }
+
+    std::fprintf(file, "// Generated by tools/generate_sampling_tables.cc from %s. Do not edit\n\n", argv[1]);
+    std::fprintf(file, "#pragma once\n\n");
+    std::fprintf(file, "// Width and height of the blue noise tile\n");
+    std::fprintf(file, "constexpr int blueNoiseSize = %d;\n\n", width);
+    std::fprintf(file, "// Two channels of blue noise on [0, 1] for each pixel of the tile, in row-major order\n");
+    std::fprintf(file, "alignas(64) constexpr float blueNoiseTable[blueNoiseSize * blueNoiseSize * 2] = {\n");
+
+    for (int i = 0; i < width * height; ++i)
+    {
+        // Written with enough digits to give back exactly the float that value / 255.0f gives
+        std::fprintf(file, "%#.9gf,%#.9gf,", blueNoise[4 * i + 0] / 255.0f, blueNoise[4 * i + 1] / 255.0f);
+        if (i % 8 == 7) std::fprintf(file, "\n");
+    }
+
+    std::fprintf(file, "};\n");
+
+    stbi_image_free(blueNoise);
+    return std::fclose(file) == 0 ? 0 : 1;
+}